@@ -2,6 +2,7 @@
 #include <admin.h>
 #include <crypto-util.h>
 #include <ctap.h>
+#include <ctaphid.h>
 #include <device.h>
 #include <fs.h>
 #include <ndef.h>
@@ -68,7 +69,7 @@ int admin_install(const uint8_t reset) {
   } else {
     if (read_file(CFG_FILE, &current_config, 0, sizeof(current_config)) < 0) return -1;
   }
-  if (reset || get_file_size(pin.path) < 0) {
+  if (reset || fs_exists(pin.path) <= 0) {
     if (pin_create(&pin, "123456", 6, PIN_RETRY_COUNTER) < 0) return -1;
   }
   return 0;
@@ -102,7 +103,7 @@ static int admin_change_pin(const CAPDU *capdu, RAPDU *rapdu) {
 static int admin_write_sn(const CAPDU *capdu, RAPDU *rapdu) {
   if (P1 != 0x00 || P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
   if (LC != 0x04) EXCEPT(SW_WRONG_LENGTH);
-  if (get_file_size(SN_FILE) >= 0) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
+  if (fs_exists(SN_FILE) > 0) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
   return write_file(SN_FILE, DATA, 0, LC, 1);
 }
 
@@ -150,13 +151,96 @@ static int admin_read_config(const CAPDU *capdu, RAPDU *rapdu) {
   return 0;
 }
 
+typedef struct {
+  RAPDU *rapdu;
+  uint16_t max_len;
+  uint8_t count;
+} flash_file_list;
+
+// fs_list_files visitor, appends name_len | name | size (4 bytes) while it fits in LE
+static int flash_list_file(int index, const char *name, lfs_size_t size, void *user) {
+  UNUSED(index);
+  flash_file_list *list = user;
+  RAPDU *rapdu = list->rapdu;
+  const size_t name_len = strlen(name);
+  if (LL + 1 + name_len + 4 > list->max_len || list->count == UINT8_MAX) return 1;
+  RDATA[LL++] = (uint8_t) name_len;
+  memcpy(RDATA + LL, name, name_len);
+  LL += name_len;
+  RDATA[LL++] = (uint8_t) (size >> 24);
+  RDATA[LL++] = (uint8_t) (size >> 16);
+  RDATA[LL++] = (uint8_t) (size >> 8);
+  RDATA[LL++] = (uint8_t) size;
+  ++list->count;
+  return 0;
+}
+
+// P1 = 0: used and total size in KiB
+// P1 = 1: used blocks (2 bytes) | free blocks (2 bytes) | block size (2 bytes) | number of files listed (1 byte),
+//         followed by the files from the P2-th, each as name_len | name | size (4 bytes), as many as fit in Le
 static int admin_flash_usage(const CAPDU *capdu, RAPDU *rapdu) {
-  if (P1 != 0x00 || P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
-  if (LE < 2) EXCEPT(SW_WRONG_LENGTH);
+  if (P1 == 0x00) {
+    if (P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
+    if (LE < 2) EXCEPT(SW_WRONG_LENGTH);
 
-  RDATA[0] = get_fs_usage();
-  RDATA[1] = get_fs_size();
-  LL = 2;
+    RDATA[0] = get_fs_usage();
+    RDATA[1] = get_fs_size();
+    LL = 2;
+
+    return 0;
+  }
+  if (P1 != 0x01) EXCEPT(SW_WRONG_P1P2);
+  if (LE < 7) EXCEPT(SW_WRONG_LENGTH);
+
+  const int used = get_fs_used_blocks();
+  if (used < 0) return -1;
+  const int free_blocks = get_fs_block_count() - used;
+  const int block_size = get_fs_block_size();
+  RDATA[0] = HI(used);
+  RDATA[1] = LO(used);
+  RDATA[2] = HI(free_blocks);
+  RDATA[3] = LO(free_blocks);
+  RDATA[4] = HI(block_size);
+  RDATA[5] = LO(block_size);
+  LL = 7;
+  flash_file_list list = {.rapdu = rapdu, .max_len = LE, .count = 0};
+  if (fs_list_files(P2, flash_list_file, &list) < 0) return -1;
+  RDATA[6] = list.count;
+
+  return 0;
+}
+
+// Each bucket as prefix_len | prefix | block reads | block progs | block erases | bytes read | bytes written | commits,
+// all counters in 4 bytes. The last bucket, with an empty prefix, counts the other files.
+// The buckets are followed by the 4-byte count of CTAPHID reports dropped since the USB init.
+// P1 = 1 clears the I/O counters after they are read.
+static int admin_fs_stats(const CAPDU *capdu, RAPDU *rapdu) {
+  if (P1 > 0x01 || P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
+
+  size_t len = 0;
+  for (int i = 0; i < FS_STATS_BUCKETS; ++i) len += 1 + strlen(fs_io_stats_prefix(i)) + sizeof(fs_io_stats_t);
+  len += sizeof(uint32_t);
+  if (LE < len) EXCEPT(SW_WRONG_LENGTH);
+
+  fs_io_stats_t stats[FS_STATS_BUCKETS];
+  fs_get_io_stats(stats);
+  for (int i = 0; i < FS_STATS_BUCKETS; ++i) {
+    const char *prefix = fs_io_stats_prefix(i);
+    const size_t prefix_len = strlen(prefix);
+    RDATA[LL++] = (uint8_t) prefix_len;
+    memcpy(RDATA + LL, prefix, prefix_len);
+    LL += prefix_len;
+    const uint32_t *counters = (const uint32_t *) &stats[i];
+    for (size_t j = 0; j < sizeof(fs_io_stats_t) / sizeof(uint32_t); ++j) {
+      const uint32_t counter = htobe32(counters[j]);
+      memcpy(RDATA + LL, &counter, sizeof(counter));
+      LL += sizeof(counter);
+    }
+  }
+  const uint32_t overruns = htobe32(CTAPHID_GetOverruns());
+  memcpy(RDATA + LL, &overruns, sizeof(overruns));
+  LL += sizeof(overruns);
+  if (P1 == 0x01) fs_reset_io_stats();
 
   return 0;
 }
@@ -293,6 +377,9 @@ int admin_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
   case ADMIN_INS_READ_CONFIG:
     ret = admin_read_config(capdu, rapdu);
     break;
+  case ADMIN_INS_FS_STATS:
+    ret = admin_fs_stats(capdu, rapdu);
+    break;
   case ADMIN_INS_READ_PASS_CONFIG:
     ret = pass_read_config(capdu, rapdu);
     break;
@@ -20,9 +20,18 @@
 #define KH_KEY_ATTR     0x04
 #define HE_KEY_ATTR     0x05
 #define SM2_ATTR        0x06
-#define DC_FILE         "ctap_dc"
+#define DC_FILE         "ctap_dc"  // holds DC_GENERAL_ATTR, and the DCs in the legacy layout
+#define DC_FILE_TMP     "ctap_dct"
 #define DC_GENERAL_ATTR 0x00
-#define DC_META_FILE    "ctap_dm"
+#define DC_PAGE_FILE    "ctap_dp"  // the first page of DC headers, followed by ctap_dp1, ctap_dp2, ...
+#define DC_PAGE_FILE_TMP "ctap_dpt"
+#define DC_USER_FILE    "ctap_du"  // the encoded users of the first page, followed by ctap_du1, ctap_du2, ...
+#define DC_USER_FILE_TMP "ctap_dut"
+#define DC_META_FILE    "ctap_dm"  // legacy RP metas with a slot bitmap, migrated to RP_FILE
+#define DC_META_FILE_TMP "ctap_dmt"
+#define RP_FILE         "ctap_rp"
+#define RP_FILE_TMP     "ctap_rpt"
+#define DC_SWAP_FILE    "ctap_dcs"
 #define LB_FILE         "ctap_lb"
 #define LB_FILE_TMP     "ctap_lbt"
 
@@ -220,13 +229,38 @@
 #define USER_ID_MAX_SIZE              64
 #define DISPLAY_NAME_LIMIT            65
 #define USER_NAME_LIMIT               65
-#define MAX_DC_NUM                    64
+#ifndef MAX_DC_NUM
+#define MAX_DC_NUM                    256 // bounded by the flash in practice
+#endif
+#define DC_PAGE_CAPACITY              64  // DCs per file, which keeps rewrites of a file short
+#define DC_USER_COMPACT_MIN_GARBAGE   1024 // bytes of superseded users in a user file worth a compaction
+#define MAX_DC_PAGES                  ((MAX_DC_NUM + DC_PAGE_CAPACITY - 1) / DC_PAGE_CAPACITY)
+#define MAX_RP_NUM                    128
+#define MAX_DC_NUM_IN_ASSERTION       64
+#ifndef SIGN_CTR_RESERVATION
+#define SIGN_CTR_RESERVATION          16 // signature counter values persisted ahead by one write
+#endif
+#ifndef KEY_POOL_SIZE_PER_TYPE
+#define KEY_POOL_SIZE_PER_TYPE        2 // pre-generated credential keys of each algorithm, 0 disables the pool
+#endif
+#ifndef KEY_POOL_REFILL_INTERVAL
+#define KEY_POOL_REFILL_INTERVAL      DEVICE_IDLE_TIME // in ms, at least between two keys generated in idle time
+#endif
+#define PUB_KEY_CACHE_SIZE            4 // public keys of the credentials used last
+#ifndef CTAP_SECRET_CACHE_TIMEOUT
+#define CTAP_SECRET_CACHE_TIMEOUT     0 // in ms, 0 keeps the cached device secrets until ctap_install
+#endif
+#ifndef CTAP_SHARED_SECRET_TIMEOUT
+#define CTAP_SHARED_SECRET_TIMEOUT    30000 // in ms, how long a decapsulated shared secret is reused
+#endif
 #define MAX_STORED_RPID_LENGTH        32
 #define MAX_EXTENSION_SIZE_IN_AUTH    140
 #define MAX_CREDENTIAL_COUNT_IN_LIST  8
 #define MAX_CRED_BLOB_LENGTH          32
 #define LARGE_BLOB_KEY_SIZE           32
-#define LARGE_BLOB_SIZE_LIMIT         4096
+#ifndef LARGE_BLOB_SIZE_LIMIT
+#define LARGE_BLOB_SIZE_LIMIT         4096 // the serialized array, which is kept twice and rehashed whole when written
+#endif
 #define MAX_FRAGMENT_LENGTH           (MAX_CTAP_BUFSIZE - 64)
 
 typedef struct {
@@ -243,29 +277,56 @@ typedef struct {
   int32_t alg_type;
 } __packed credential_id;
 
+// a decoded DC, which is also the record of the legacy layout
 typedef struct {
   credential_id credential_id;
   user_entity user;
-  bool deleted;
+  bool deleted; // only read when migrating a legacy file
   bool has_large_blob_key;
   uint8_t cred_blob_len;
   uint8_t cred_blob[MAX_CRED_BLOB_LENGTH];
 } __packed CTAP_discoverable_credential;
 
+// The record of a DC in a page, which is all that scans read. The user and the cred blob are encoded in the user
+// file of the page, see dc_encode_user.
 typedef struct {
-  uint8_t numbers;
-  uint8_t index; // enough when MAX_DC_NUM == 64
+  credential_id credential_id;
+  bool has_large_blob_key;
+  uint8_t cred_blob_len;
+  uint8_t user_len;
+  uint32_t user_off;
+  uint32_t created; // a counter increased by each new DC, which orders the DCs of an RP
+} __packed CTAP_dc_header;
+
+typedef struct {
+  uint16_t numbers;
+  uint16_t index; // of the DC being added or deleted
   uint8_t pending_add: 1;
   uint8_t pending_delete: 1;
+  uint8_t rp_id_hash[SHA256_DIGEST_LENGTH]; // of the DC being added or deleted
 } __packed CTAP_dc_general_attr;
 
+typedef struct {
+  uint8_t numbers;
+  uint8_t index;
+  uint8_t pending_add: 1;
+  uint8_t pending_delete: 1;
+} __packed CTAP_legacy_dc_general_attr;
+
+// the DCs of an RP are the ones with its rp_id_hash, found through the DC index
 typedef struct {
   uint8_t rp_id_hash[SHA256_DIGEST_LENGTH];
   uint8_t rp_id[MAX_STORED_RPID_LENGTH];
-  size_t rp_id_len;
-  uint64_t slots;
+  uint8_t rp_id_len;
 } __packed CTAP_rp_meta;
 
+typedef struct {
+  uint8_t rp_id_hash[SHA256_DIGEST_LENGTH];
+  uint8_t rp_id[MAX_STORED_RPID_LENGTH];
+  size_t rp_id_len;
+  uint64_t slots; // bit i for the DC at slot i
+} __packed CTAP_legacy_rp_meta;
+
 typedef struct {
   uint8_t aaguid[AAGUID_SIZE];
   uint16_t credential_id_length;
@@ -52,7 +52,8 @@ static void maybe_truncate_rpid(uint8_t stored_rpid[MAX_STORED_RPID_LENGTH], siz
   *stored_len = MAX_STORED_RPID_LENGTH;
 }
 
-static uint8_t parse_rp(CTAP_make_credential *mc, CborValue *val) {
+static uint8_t parse_rp(void *req, CborValue *val) {
+  CTAP_make_credential *mc = req;
   if (cbor_value_get_type(val) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
 
   CborValue map;
@@ -145,26 +146,54 @@ uint8_t parse_user(user_entity *user, CborValue *val) {
   return 0;
 }
 
+// Look up the values of several text keys in a single walk of a map, while cbor_value_map_find_value
+// walks the map once per key. The values not found are left invalid, as cbor_value_map_find_value does.
+static uint8_t map_find_values(const CborValue *val, const char *const keys[], CborValue values[], size_t n) {
+  CborValue map;
+  for (size_t i = 0; i < n; ++i)
+    values[i].type = CborInvalidType;
+
+  int ret = cbor_value_enter_container(val, &map);
+  CHECK_CBOR_RET(ret);
+  while (!cbor_value_at_end(&map)) {
+    size_t found = n;
+    if (cbor_value_get_type(&map) == CborTextStringType) {
+      for (size_t i = 0; i < n && found == n; ++i) {
+        bool equal;
+        ret = cbor_value_text_string_equals(&map, keys[i], &equal);
+        CHECK_CBOR_RET(ret);
+        if (equal && !cbor_value_is_valid(&values[i])) found = i;
+      }
+    }
+    ret = cbor_value_advance(&map);
+    CHECK_CBOR_RET(ret);
+    if (found < n) values[found] = map;
+    ret = cbor_value_advance(&map);
+    CHECK_CBOR_RET(ret);
+  }
+  return 0;
+}
+
 static uint8_t parse_pub_key_cred_param(CborValue *val, int32_t *alg_type) {
   if (cbor_value_get_type(val) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
 
-  CborValue cred, alg;
-  int ret = cbor_value_map_find_value(val, "type", &cred);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_value_map_find_value(val, "alg", &alg);
-  CHECK_CBOR_RET(ret);
+  static const char *const keys[] = {"type", "alg"};
+  CborValue values[2];
+  int ret = map_find_values(val, keys, values, 2);
+  CHECK_PARSER_RET(ret);
+  CborValue *cred = &values[0], *alg = &values[1];
 
-  if (cbor_value_get_type(&cred) != CborTextStringType) return CTAP2_ERR_MISSING_PARAMETER;
-  if (cbor_value_get_type(&alg) != CborIntegerType) return CTAP2_ERR_MISSING_PARAMETER;
+  if (cbor_value_get_type(cred) != CborTextStringType) return CTAP2_ERR_MISSING_PARAMETER;
+  if (cbor_value_get_type(alg) != CborIntegerType) return CTAP2_ERR_MISSING_PARAMETER;
 
   bool is_public_key;
-  ret = cbor_value_text_string_equals(&cred, "public-key", &is_public_key);
+  ret = cbor_value_text_string_equals(cred, "public-key", &is_public_key);
   CHECK_CBOR_RET(ret);
 
   // required by FIDO Conformance Tool
   if (!is_public_key) return CTAP2_ERR_UNSUPPORTED_ALGORITHM;
 
-  ret = cbor_value_get_int_checked(&alg, (int *) alg_type);
+  ret = cbor_value_get_int_checked(alg, (int *) alg_type);
   CHECK_CBOR_RET(ret);
   return 0;
 }
@@ -208,19 +237,18 @@ uint8_t parse_verify_pub_key_cred_params(CborValue *val, int32_t *alg_type) {
 uint8_t parse_credential_descriptor(CborValue *arr, uint8_t *id) {
   if (cbor_value_get_type(arr) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
 
-  CborValue val;
-  int ret = cbor_value_map_find_value(arr, "id", &val);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&val) != CborByteStringType) return CTAP2_ERR_MISSING_PARAMETER;
+  static const char *const keys[] = {"id", "type"};
+  CborValue values[2];
+  int ret = map_find_values(arr, keys, values, 2);
+  CHECK_PARSER_RET(ret);
+
+  if (cbor_value_get_type(&values[0]) != CborByteStringType) return CTAP2_ERR_MISSING_PARAMETER;
   size_t len = sizeof(credential_id);
   if (id) {
-    ret = cbor_value_copy_byte_string(&val, id, &len, NULL);
+    ret = cbor_value_copy_byte_string(&values[0], id, &len, NULL);
     CHECK_CBOR_RET(ret);
   }
-
-  ret = cbor_value_map_find_value(arr, "type", &val);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&val) != CborTextStringType) return CTAP2_ERR_MISSING_PARAMETER;
+  if (cbor_value_get_type(&values[1]) != CborTextStringType) return CTAP2_ERR_MISSING_PARAMETER;
 
   return 0;
 }
@@ -560,12 +588,133 @@ uint8_t parse_ga_extensions(CTAP_get_assertion *ga, CborValue *val) {
   return 0;
 }
 
-uint8_t parse_cm_params(CTAP_credential_management *cm, CborValue *val, size_t *total_length) {
-  *total_length = 0;
-  if (cbor_value_get_type(val) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  size_t map_length, len;
+/*
+ * The requests are integer-keyed maps, each of which is parsed by a single walk driven by a table of
+ * field descriptors. A field names its key, how its value is checked and where in the request it is
+ * stored, and the PARAM_* bit set once it is parsed. The keys missing from the table are skipped.
+ * Every request struct starts with its parsed_params.
+ */
+enum {
+  FIELD_INT,             // an integer in [min, max], stored into a uint8_t
+  FIELD_UINT16,          // an unsigned integer, saturated at max and stored into a uint16_t
+  FIELD_BYTES,           // a byte string of [min, max] bytes
+  FIELD_RP_ID,           // a text string, whose SHA-256 is stored
+  FIELD_OPTIONS,         // see parse_options
+  FIELD_CREDENTIAL_LIST, // see parse_public_key_credential_list, the first item is stored
+  FIELD_FLAG,            // nothing but the param is recorded
+  FIELD_CUSTOM,          // parsed by the handler
+};
+
+typedef struct {
+  uint8_t key;
+  uint8_t type;
+  uint8_t err;         // returned when the value or the length is out of [min, max]
+  uint16_t offset;     // of the target in the request
+  uint16_t len_offset; // of the size_t receiving the length of a string or list, 0 if not needed
+  int32_t min, max;
+  uint32_t param;
+  uint8_t (*parse)(void *req, CborValue *val);
+} parse_field;
+
+_Static_assert(offsetof(CTAP_make_credential, parsed_params) == 0, "parsed_params must come first");
+_Static_assert(offsetof(CTAP_get_assertion, parsed_params) == 0, "parsed_params must come first");
+_Static_assert(offsetof(CTAP_client_pin, parsed_params) == 0, "parsed_params must come first");
+_Static_assert(offsetof(CTAP_credential_management, parsed_params) == 0, "parsed_params must come first");
+_Static_assert(offsetof(CTAP_large_blobs, parsed_params) == 0, "parsed_params must come first");
+
+#define PIN_UV_AUTH_PROTOCOL_FIELD(request, k)                                                                         \
+  {.key = k, .type = FIELD_INT, .err = CTAP1_ERR_INVALID_PARAMETER,                                                    \
+   .offset = offsetof(request, pin_uv_auth_protocol), .min = 1, .max = 2, .param = PARAM_PIN_UV_AUTH_PROTOCOL}
+
+// an empty pin_uv_auth_param is allowed by MC and GA to probe for a user presence, see Section 6.1.2 and 6.2.2
+#define PIN_UV_AUTH_PARAM_FIELD(request, k, min_len, len_off)                                                          \
+  {.key = k, .type = FIELD_BYTES, .err = CTAP2_ERR_PIN_AUTH_INVALID, .offset = offsetof(request, pin_uv_auth_param), \
+   .len_offset = len_off, .min = min_len, .max = SHA256_DIGEST_LENGTH, .param = PARAM_PIN_UV_AUTH_PARAM}
+
+#define SUB_COMMAND_FIELD(request, k)                                                                                  \
+  {.key = k, .type = FIELD_INT, .offset = offsetof(request, sub_command), .min = INT32_MIN, .max = INT32_MAX,         \
+   .param = PARAM_SUB_COMMAND}
+
+#define UINT16_FIELD(request, k, member, p)                                                                            \
+  {.key = k, .type = FIELD_UINT16, .offset = offsetof(request, member), .max = UINT16_MAX, .param = p}
+
+#define CUSTOM_FIELD(k, handler, p) {.key = k, .type = FIELD_CUSTOM, .param = p, .parse = handler}
+
+static uint8_t parse_field_value(const parse_field *field, void *req, CborValue *val) {
+  uint8_t *target = (uint8_t *) req + field->offset;
+  char domain[DOMAIN_NAME_MAX_SIZE + 1];
+  size_t len;
+  int ret, value;
+
+  switch (field->type) {
+    case FIELD_INT:
+    case FIELD_UINT16:
+      if (cbor_value_get_type(val) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+      ret = cbor_value_get_int_checked(val, &value);
+      CHECK_CBOR_RET(ret);
+      DBG_MSG("value: %d\n", value);
+      if (field->type == FIELD_INT) {
+        if (value < field->min || value > field->max) return field->err;
+        *target = (uint8_t) value;
+      } else {
+        if (value < 0) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE; // should be unsigned integer
+        if (value > field->max) value = field->max;
+        *(uint16_t *) target = (uint16_t) value;
+      }
+      return 0;
+
+    case FIELD_BYTES:
+      if (cbor_value_get_type(val) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+      ret = cbor_value_get_string_length(val, &len);
+      CHECK_CBOR_RET(ret);
+      if (len < (size_t) field->min || len > (size_t) field->max) return field->err;
+      if (len > 0) {
+        ret = cbor_value_copy_byte_string(val, target, &len, NULL);
+        CHECK_CBOR_RET(ret);
+        PRINT_HEX(target, len);
+      }
+      if (field->len_offset) *(size_t *) ((uint8_t *) req + field->len_offset) = len;
+      return 0;
+
+    case FIELD_RP_ID:
+      if (cbor_value_get_type(val) != CborTextStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+      len = DOMAIN_NAME_MAX_SIZE;
+      ret = cbor_value_copy_text_string(val, domain, &len, NULL);
+      CHECK_CBOR_RET(ret);
+      domain[len] = 0;
+      DBG_MSG("rp_id: %s\n", domain);
+      sha256_raw((uint8_t *) domain, len, target);
+      return 0;
+
+    case FIELD_OPTIONS:
+      return parse_options((CTAP_options *) target, val);
+
+    case FIELD_CREDENTIAL_LIST:
+      ret = parse_public_key_credential_list(val);
+      CHECK_PARSER_RET(ret);
+      ret = cbor_value_enter_container(val, (CborValue *) target);
+      CHECK_CBOR_RET(ret);
+      ret = cbor_value_get_array_length(val, (size_t *) ((uint8_t *) req + field->len_offset));
+      CHECK_CBOR_RET(ret);
+      return 0;
+
+    case FIELD_FLAG:
+      return 0;
+
+    default:
+      return field->parse(req, val);
+  }
+}
+
+// Walk through an integer-keyed map, filling req by the fields. If end is not NULL, it receives the end of the map.
+static uint8_t parse_map(CborValue *val, const parse_field *fields, size_t n_fields, void *req,
+                         const uint8_t **end) {
+  uint32_t *parsed_params = req;
   CborValue map;
+  size_t map_length;
   int key;
+
+  if (cbor_value_get_type(val) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
   int ret = cbor_value_enter_container(val, &map);
   CHECK_CBOR_RET(ret);
   ret = cbor_value_get_map_length(val, &map_length);
@@ -578,183 +727,107 @@ uint8_t parse_cm_params(CTAP_credential_management *cm, CborValue *val, size_t *
     ret = cbor_value_advance(&map);
     CHECK_CBOR_RET(ret);
 
-    switch (key) {
-      case CM_PARAM_RP_ID_HASH:
-        DBG_MSG("rp_id_hash found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if (len != SHA256_DIGEST_LENGTH) return CTAP2_ERR_INVALID_CBOR;
-        ret = cbor_value_copy_byte_string(&map, cm->rp_id_hash, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        cm->parsed_params |= PARAM_RP;
-        break;
-
-      case CM_PARAM_CREDENTIAL_ID:
-        DBG_MSG("credential_id found\n");
-        ret = parse_credential_descriptor(&map, (uint8_t *) &cm->credential_id);
-        CHECK_CBOR_RET(ret);
-        cm->parsed_params |= PARAM_CREDENTIAL_ID;
-        break;
-
-      case CM_PARAM_USER:
-        DBG_MSG("user found\n");
-        ret = parse_user(&cm->user, &map);
-        CHECK_CBOR_RET(ret);
-        cm->parsed_params |= PARAM_USER;
-        break;
-
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
+    const parse_field *field = NULL;
+    for (size_t j = 0; j < n_fields && field == NULL; ++j)
+      if (fields[j].key == key) field = &fields[j];
+    if (field != NULL) {
+      DBG_MSG("key %d found\n", key);
+      ret = parse_field_value(field, req, &map);
+      CHECK_PARSER_RET(ret);
+      *parsed_params |= field->param;
+    } else {
+      DBG_MSG("Unknown key: %d\n", key);
     }
 
     ret = cbor_value_advance(&map);
     CHECK_CBOR_RET(ret);
   }
 
-  *total_length = map.source.ptr - val->source.ptr;
+  if (end) *end = map.source.ptr;
   return 0;
 }
 
-uint8_t parse_make_credential(CborParser *parser, CTAP_make_credential *mc, const uint8_t *buf, size_t len) {
-  CborValue it, map;
-  size_t map_length;
-  int key, pin_uv_auth_protocol;
-  memset(mc, 0, sizeof(CTAP_make_credential));
-
-  // options are absent by default
-  mc->options.rk = OPTION_ABSENT;
-  mc->options.uv = OPTION_ABSENT;
-  mc->options.up = OPTION_ABSENT;
-
+static uint8_t parse_request(CborParser *parser, const uint8_t *buf, size_t len, const parse_field *fields,
+                             size_t n_fields, void *req) {
+  CborValue it;
   int ret = cbor_parser_init(buf, len, 0, parser, &it);
   CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&it) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  ret = cbor_value_enter_container(&it, &map);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_value_get_map_length(&it, &map_length);
-  CHECK_CBOR_RET(ret);
-
-  for (size_t i = 0; i < map_length; ++i) {
-    if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-    ret = cbor_value_get_int_checked(&map, &key);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-
-    switch (key) {
-      case MC_REQ_CLIENT_DATA_HASH:
-        DBG_MSG("client_data_hash found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        len = CLIENT_DATA_HASH_SIZE;
-        ret = cbor_value_copy_byte_string(&map, mc->client_data_hash, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        if (len != CLIENT_DATA_HASH_SIZE) return CTAP2_ERR_INVALID_CBOR;
-        DBG_MSG("client_data_hash: ");
-        PRINT_HEX(mc->client_data_hash, len);
-        mc->parsed_params |= PARAM_CLIENT_DATA_HASH;
-        break;
+  return parse_map(&it, fields, n_fields, req, NULL);
+}
 
-      case MC_REQ_RP:
-        DBG_MSG("rp_id found\n");
-        ret = parse_rp(mc, &map);
-        CHECK_PARSER_RET(ret);
-        DBG_MSG("rp_id_hash: ");
-        PRINT_HEX(mc->rp_id_hash, len);
-        mc->parsed_params |= PARAM_RP;
-        break;
+static uint8_t parse_cm_credential_id(void *req, CborValue *val) {
+  CTAP_credential_management *cm = req;
+  return parse_credential_descriptor(val, (uint8_t *) &cm->credential_id) ? CTAP2_ERR_INVALID_CBOR : 0;
+}
 
-      case MC_REQ_USER:
-        DBG_MSG("user found\n");
-        ret = parse_user(&mc->user, &map);
-        CHECK_PARSER_RET(ret);
-        mc->parsed_params |= PARAM_USER;
-        break;
+static uint8_t parse_cm_user(void *req, CborValue *val) {
+  CTAP_credential_management *cm = req;
+  return parse_user(&cm->user, val) ? CTAP2_ERR_INVALID_CBOR : 0;
+}
 
-      case MC_REQ_PUB_KEY_CRED_PARAMS:
-        DBG_MSG("pubKeyCredParams found\n");
-        ret = parse_verify_pub_key_cred_params(&map, &mc->alg_type);
-        CHECK_PARSER_RET(ret);
-        if (mc->alg_type == COSE_ALG_ES256) DBG_MSG("EcDSA found\n");
-        else if (mc->alg_type == COSE_ALG_EDDSA) DBG_MSG("EdDSA found\n");
-        else if (mc->alg_type == ctap_sm2_attr.algo_id) DBG_MSG("SM2 found\n");
-        else
-          DBG_MSG("Found other algorithm\n");
-        mc->parsed_params |= PARAM_PUB_KEY_CRED_PARAMS;
-        break;
+static const parse_field cm_param_fields[] = {
+    {.key = CM_PARAM_RP_ID_HASH, .type = FIELD_BYTES, .err = CTAP2_ERR_INVALID_CBOR,
+     .offset = offsetof(CTAP_credential_management, rp_id_hash), .min = SHA256_DIGEST_LENGTH,
+     .max = SHA256_DIGEST_LENGTH, .param = PARAM_RP},
+    CUSTOM_FIELD(CM_PARAM_CREDENTIAL_ID, parse_cm_credential_id, PARAM_CREDENTIAL_ID),
+    CUSTOM_FIELD(CM_PARAM_USER, parse_cm_user, PARAM_USER),
+};
 
-      case MC_REQ_EXCLUDE_LIST:
-        DBG_MSG("exclude_list found\n");
-        ret = parse_public_key_credential_list(&map);
-        CHECK_PARSER_RET(ret);
-        ret = cbor_value_enter_container(&map, &mc->exclude_list);
-        CHECK_CBOR_RET(ret);
-        ret = cbor_value_get_array_length(&map, &mc->exclude_list_size);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("exclude_list size: %d\n", (int) mc->exclude_list_size);
-        break;
-
-      case MC_REQ_EXTENSIONS:
-        DBG_MSG("extensions found\n");
-        ret = parse_mc_extensions(mc, &map);
-        CHECK_PARSER_RET(ret);
-        mc->parsed_params |= PARAM_EXTENSIONS;
-        break;
+uint8_t parse_cm_params(CTAP_credential_management *cm, CborValue *val, size_t *total_length) {
+  const uint8_t *end = val->source.ptr;
+  uint8_t ret = parse_map(val, cm_param_fields, sizeof(cm_param_fields) / sizeof(cm_param_fields[0]), cm, &end);
+  *total_length = end - val->source.ptr;
+  return ret;
+}
 
-      case MC_REQ_OPTIONS:
-        DBG_MSG("options found\n");
-        ret = parse_options(&mc->options, &map);
-        CHECK_PARSER_RET(ret);
-        mc->parsed_params |= PARAM_OPTIONS;
-        break;
+static uint8_t parse_mc_user(void *req, CborValue *val) {
+  CTAP_make_credential *mc = req;
+  return parse_user(&mc->user, val);
+}
 
-      case MC_REQ_PIN_UV_AUTH_PARAM:
-        DBG_MSG("pin_uv_auth_param found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &mc->pin_uv_auth_param_len);
-        CHECK_CBOR_RET(ret);
-        if (mc->pin_uv_auth_param_len > SHA256_DIGEST_LENGTH) {
-          DBG_MSG("pin_uv_auth_param is too long\n");
-          return CTAP2_ERR_PIN_AUTH_INVALID;
-        }
-        if (mc->pin_uv_auth_param_len > 0) {
-          ret = cbor_value_copy_byte_string(&map, mc->pin_uv_auth_param, &mc->pin_uv_auth_param_len, NULL);
-          CHECK_CBOR_RET(ret);
-          DBG_MSG("pin_uv_auth_param: ");
-          PRINT_HEX(mc->pin_uv_auth_param, mc->pin_uv_auth_param_len);
-        }
-        mc->parsed_params |= PARAM_PIN_UV_AUTH_PARAM;
-        break;
+static uint8_t parse_mc_pub_key_cred_params(void *req, CborValue *val) {
+  CTAP_make_credential *mc = req;
+  uint8_t ret = parse_verify_pub_key_cred_params(val, &mc->alg_type);
+  CHECK_PARSER_RET(ret);
+  if (mc->alg_type == COSE_ALG_ES256) DBG_MSG("EcDSA found\n");
+  else if (mc->alg_type == COSE_ALG_EDDSA) DBG_MSG("EdDSA found\n");
+  else if (mc->alg_type == ctap_sm2_attr.algo_id) DBG_MSG("SM2 found\n");
+  else
+    DBG_MSG("Found other algorithm\n");
+  return 0;
+}
 
-      case MC_REQ_PIN_PROTOCOL:
-        DBG_MSG("pin_uv_auth_protocol found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &pin_uv_auth_protocol);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pin_uv_auth_protocol: %d\n", pin_uv_auth_protocol);
-        if (pin_uv_auth_protocol != 1 && pin_uv_auth_protocol != 2) {
-          DBG_MSG("Unknown pin_uv_auth_protocol\n");
-          return CTAP1_ERR_INVALID_PARAMETER;
-        }
-        mc->pin_uv_auth_protocol = pin_uv_auth_protocol;
-        mc->parsed_params |= PARAM_PIN_UV_AUTH_PROTOCOL;
-        break;
+static uint8_t parse_mc_ext(void *req, CborValue *val) { return parse_mc_extensions(req, val); }
+
+static const parse_field mc_fields[] = {
+    {.key = MC_REQ_CLIENT_DATA_HASH, .type = FIELD_BYTES, .err = CTAP2_ERR_INVALID_CBOR,
+     .offset = offsetof(CTAP_make_credential, client_data_hash), .min = CLIENT_DATA_HASH_SIZE,
+     .max = CLIENT_DATA_HASH_SIZE, .param = PARAM_CLIENT_DATA_HASH},
+    CUSTOM_FIELD(MC_REQ_RP, parse_rp, PARAM_RP),
+    CUSTOM_FIELD(MC_REQ_USER, parse_mc_user, PARAM_USER),
+    CUSTOM_FIELD(MC_REQ_PUB_KEY_CRED_PARAMS, parse_mc_pub_key_cred_params, PARAM_PUB_KEY_CRED_PARAMS),
+    {.key = MC_REQ_EXCLUDE_LIST, .type = FIELD_CREDENTIAL_LIST, .offset = offsetof(CTAP_make_credential, exclude_list),
+     .len_offset = offsetof(CTAP_make_credential, exclude_list_size)},
+    CUSTOM_FIELD(MC_REQ_EXTENSIONS, parse_mc_ext, PARAM_EXTENSIONS),
+    {.key = MC_REQ_OPTIONS, .type = FIELD_OPTIONS, .offset = offsetof(CTAP_make_credential, options),
+     .param = PARAM_OPTIONS},
+    PIN_UV_AUTH_PARAM_FIELD(CTAP_make_credential, MC_REQ_PIN_UV_AUTH_PARAM, 0,
+                            offsetof(CTAP_make_credential, pin_uv_auth_param_len)),
+    PIN_UV_AUTH_PROTOCOL_FIELD(CTAP_make_credential, MC_REQ_PIN_PROTOCOL),
+    // TODO: parse enterpriseAttestation
+    {.key = MC_REQ_ENTERPRISE_ATTESTATION, .type = FIELD_FLAG, .param = PARAM_ENTERPRISE_ATTESTATION},
+};
 
-      case MC_REQ_ENTERPRISE_ATTESTATION:
-        DBG_MSG("enterpriseAttestation found\n");
-        mc->parsed_params |= PARAM_ENTERPRISE_ATTESTATION;
-        // TODO: parse enterpriseAttestation
-        break;
+uint8_t parse_make_credential(CborParser *parser, CTAP_make_credential *mc, const uint8_t *buf, size_t len) {
+  memset(mc, 0, sizeof(CTAP_make_credential));
 
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
-    }
+  // options are absent by default
+  mc->options.rk = OPTION_ABSENT;
+  mc->options.uv = OPTION_ABSENT;
+  mc->options.up = OPTION_ABSENT;
 
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-  }
+  uint8_t ret = parse_request(parser, buf, len, mc_fields, sizeof(mc_fields) / sizeof(mc_fields[0]), mc);
+  CHECK_PARSER_RET(ret);
 
   if ((mc->parsed_params & MC_REQUIRED_MASK) != MC_REQUIRED_MASK) {
     DBG_MSG("Missing required params\n");
@@ -763,11 +836,24 @@ uint8_t parse_make_credential(CborParser *parser, CTAP_make_credential *mc, cons
   return 0;
 }
 
+static uint8_t parse_ga_ext(void *req, CborValue *val) { return parse_ga_extensions(req, val); }
+
+static const parse_field ga_fields[] = {
+    {.key = GA_REQ_RP_ID, .type = FIELD_RP_ID, .offset = offsetof(CTAP_get_assertion, rp_id_hash), .param = PARAM_RP},
+    {.key = GA_REQ_CLIENT_DATA_HASH, .type = FIELD_BYTES, .err = CTAP2_ERR_INVALID_CBOR,
+     .offset = offsetof(CTAP_get_assertion, client_data_hash), .min = CLIENT_DATA_HASH_SIZE,
+     .max = CLIENT_DATA_HASH_SIZE, .param = PARAM_CLIENT_DATA_HASH},
+    {.key = GA_REQ_ALLOW_LIST, .type = FIELD_CREDENTIAL_LIST, .offset = offsetof(CTAP_get_assertion, allow_list),
+     .len_offset = offsetof(CTAP_get_assertion, allow_list_size)},
+    CUSTOM_FIELD(GA_REQ_EXTENSIONS, parse_ga_ext, 0),
+    {.key = GA_REQ_OPTIONS, .type = FIELD_OPTIONS, .offset = offsetof(CTAP_get_assertion, options),
+     .param = PARAM_OPTIONS},
+    PIN_UV_AUTH_PARAM_FIELD(CTAP_get_assertion, GA_REQ_PIN_UV_AUTH_PARAM, 0,
+                            offsetof(CTAP_get_assertion, pin_uv_auth_param_len)),
+    PIN_UV_AUTH_PROTOCOL_FIELD(CTAP_get_assertion, GA_REQ_PIN_UV_AUTH_PROTOCOL),
+};
+
 uint8_t parse_get_assertion(CborParser *parser, CTAP_get_assertion *ga, const uint8_t *buf, size_t len) {
-  CborValue it, map;
-  size_t map_length;
-  int key, pin_uv_auth_protocol;
-  char domain[DOMAIN_NAME_MAX_SIZE];
   memset(ga, 0, sizeof(CTAP_get_assertion));
 
   // options are absent by default
@@ -775,253 +861,79 @@ uint8_t parse_get_assertion(CborParser *parser, CTAP_get_assertion *ga, const ui
   ga->options.uv = OPTION_ABSENT;
   ga->options.up = OPTION_ABSENT;
 
-  int ret = cbor_parser_init(buf, len, 0, parser, &it);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&it) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  ret = cbor_value_enter_container(&it, &map);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_value_get_map_length(&it, &map_length);
-  CHECK_CBOR_RET(ret);
-
-  for (size_t i = 0; i < map_length; ++i) {
-    if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-    ret = cbor_value_get_int_checked(&map, &key);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-
-    switch (key) {
-      case GA_REQ_RP_ID:
-        DBG_MSG("rp_id found\n");
-        if (cbor_value_get_type(&map) != CborTextStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        len = DOMAIN_NAME_MAX_SIZE;
-        ret = cbor_value_copy_text_string(&map, domain, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        domain[DOMAIN_NAME_MAX_SIZE - 1] = 0;
-        DBG_MSG("rp_id: %s; hash: ", domain);
-        sha256_raw((uint8_t *) domain, len, ga->rp_id_hash);
-        PRINT_HEX(ga->rp_id_hash, SHA256_DIGEST_LENGTH);
-        ga->parsed_params |= PARAM_RP;
-        break;
-
-      case GA_REQ_CLIENT_DATA_HASH:
-        DBG_MSG("client_data_hash found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        len = CLIENT_DATA_HASH_SIZE;
-        ret = cbor_value_copy_byte_string(&map, ga->client_data_hash, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        if (len != CLIENT_DATA_HASH_SIZE) return CTAP2_ERR_INVALID_CBOR;
-        DBG_MSG("client_data_hash: ");
-        PRINT_HEX(ga->client_data_hash, len);
-        ga->parsed_params |= PARAM_CLIENT_DATA_HASH;
-        break;
-
-      case GA_REQ_ALLOW_LIST:
-        DBG_MSG("allow_list found\n");
-        ret = parse_public_key_credential_list(&map);
-        CHECK_PARSER_RET(ret);
-        ret = cbor_value_enter_container(&map, &ga->allow_list);
-        CHECK_CBOR_RET(ret);
-        ret = cbor_value_get_array_length(&map, &ga->allow_list_size);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("allow_list size: %d\n", (int) ga->allow_list_size);
-        break;
-
-      case GA_REQ_EXTENSIONS:
-        DBG_MSG("extensions found\n");
-        ret = parse_ga_extensions(ga, &map);
-        CHECK_PARSER_RET(ret);
-        break;
-
-      case GA_REQ_OPTIONS:
-        DBG_MSG("options found\n");
-        ret = parse_options(&ga->options, &map);
-        CHECK_PARSER_RET(ret);
-        ga->parsed_params |= PARAM_OPTIONS;
-        break;
-
-      case GA_REQ_PIN_UV_AUTH_PARAM:
-        DBG_MSG("pin_uv_auth_param found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &ga->pin_uv_auth_param_len);
-        CHECK_CBOR_RET(ret);
-        if (ga->pin_uv_auth_param_len > SHA256_DIGEST_LENGTH)
-          return CTAP2_ERR_PIN_AUTH_INVALID;
-        if (ga->pin_uv_auth_param_len > 0) {
-          ret = cbor_value_copy_byte_string(&map, ga->pin_uv_auth_param, &ga->pin_uv_auth_param_len, NULL);
-          CHECK_CBOR_RET(ret);
-          DBG_MSG("pin_uv_auth_param: ");
-          PRINT_HEX(ga->pin_uv_auth_param, ga->pin_uv_auth_param_len);
-        }
-        ga->parsed_params |= PARAM_PIN_UV_AUTH_PARAM;
-        break;
-
-      case GA_REQ_PIN_UV_AUTH_PROTOCOL:
-        DBG_MSG("pin_uv_auth_protocol found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &pin_uv_auth_protocol);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pin_uv_auth_protocol: %d\n", pin_uv_auth_protocol);
-        if (pin_uv_auth_protocol != 1 && pin_uv_auth_protocol != 2) {
-          DBG_MSG("Unknown pin_uv_auth_protocol\n");
-          return CTAP1_ERR_INVALID_PARAMETER;
-        }
-        ga->pin_uv_auth_protocol = pin_uv_auth_protocol;
-        ga->parsed_params |= PARAM_PIN_UV_AUTH_PROTOCOL;
-        break;
-
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
-    }
-
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-  }
+  uint8_t ret = parse_request(parser, buf, len, ga_fields, sizeof(ga_fields) / sizeof(ga_fields[0]), ga);
+  CHECK_PARSER_RET(ret);
 
   if ((ga->parsed_params & GA_REQUIRED_MASK) != GA_REQUIRED_MASK) return CTAP2_ERR_MISSING_PARAMETER;
   return 0;
 }
 
-uint8_t parse_client_pin(CborParser *parser, CTAP_client_pin *cp, const uint8_t *buf, size_t len) {
-  CborValue it, map;
-  size_t map_length;
-  int key;
-  char domain[DOMAIN_NAME_MAX_SIZE + 1];
-  memset(cp, 0, sizeof(CTAP_client_pin));
+static uint8_t parse_cp_key_agreement(void *req, CborValue *val) {
+  CTAP_client_pin *cp = req;
+  return parse_cose_key(val, cp->key_agreement);
+}
 
-  int ret = cbor_parser_init(buf, len, 0, parser, &it);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&it) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  ret = cbor_value_enter_container(&it, &map);
+// the length of newPinEnc and pinHashEnc depends on the pinUvAuthProtocol, which comes first in a canonical map
+static uint8_t parse_cp_enc(CborValue *val, uint8_t *target, size_t len_p1, size_t len_p2, uint8_t protocol) {
+  size_t len;
+  if (cbor_value_get_type(val) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+  int ret = cbor_value_get_string_length(val, &len);
   CHECK_CBOR_RET(ret);
-  ret = cbor_value_get_map_length(&it, &map_length);
+  if ((protocol == 1 && len != len_p1) || (protocol == 2 && len != len_p2)) {
+    ERR_MSG("Invalid length of the encrypted PIN\n");
+    return CTAP2_ERR_INVALID_CBOR;
+  }
+  ret = cbor_value_copy_byte_string(val, target, &len, NULL);
   CHECK_CBOR_RET(ret);
+  PRINT_HEX(target, len);
+  return 0;
+}
 
-  for (size_t i = 0; i < map_length; ++i) {
-    if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-    ret = cbor_value_get_int_checked(&map, &key);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-
-    switch (key) {
-      case CP_REQ_PIN_UV_AUTH_PROTOCOL:
-        DBG_MSG("pinProtocol found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &key);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pinProtocol: %d\n", key);
-        if (key != 1 && key != 2) {
-          ERR_MSG("Invalid pinProtocol\n");
-          return CTAP1_ERR_INVALID_PARAMETER;
-        }
-        cp->pin_uv_auth_protocol = key;
-        cp->parsed_params |= PARAM_PIN_UV_AUTH_PROTOCOL;
-        break;
-
-      case CP_REQ_SUB_COMMAND:
-        DBG_MSG("sub_command found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &key);
-        CHECK_CBOR_RET(ret);
-        cp->sub_command = key;
-        DBG_MSG("sub_command: %d\n", cp->sub_command);
-        cp->parsed_params |= PARAM_SUB_COMMAND;
-        break;
-
-      case CP_REQ_KEY_AGREEMENT:
-        DBG_MSG("key_agreement found\n");
-        ret = parse_cose_key(&map, cp->key_agreement);
-        CHECK_PARSER_RET(ret);
-        DBG_MSG("key_agreement: ");
-        PRINT_HEX(cp->key_agreement, PUB_KEY_SIZE);
-        cp->parsed_params |= PARAM_KEY_AGREEMENT;
-        break;
-
-      case CP_REQ_PIN_UV_AUTH_PARAM:
-        DBG_MSG("pin_uv_auth_param found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if (len == 0 || len > SHA256_DIGEST_LENGTH) return CTAP2_ERR_PIN_AUTH_INVALID;
-        ret = cbor_value_copy_byte_string(&map, cp->pin_uv_auth_param, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pin_uv_auth_param: ");
-        PRINT_HEX(cp->pin_uv_auth_param, len);
-        cp->parsed_params |= PARAM_PIN_UV_AUTH_PARAM;
-        break;
-
-      case CP_REQ_NEW_PIN_ENC:
-        DBG_MSG("new_pin_enc found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if ((cp->pin_uv_auth_protocol == 1 && len != PIN_ENC_SIZE_P1) ||
-            (cp->pin_uv_auth_protocol == 2 && len != PIN_ENC_SIZE_P2)) {
-          ERR_MSG("Invalid new_pin_enc length\n");
-          return CTAP2_ERR_INVALID_CBOR;
-        }
-        ret = cbor_value_copy_byte_string(&map, cp->new_pin_enc, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("new_pin_enc: ");
-        PRINT_HEX(cp->new_pin_enc, len);
-        cp->parsed_params |= PARAM_NEW_PIN_ENC;
-        break;
+static uint8_t parse_cp_new_pin_enc(void *req, CborValue *val) {
+  CTAP_client_pin *cp = req;
+  return parse_cp_enc(val, cp->new_pin_enc, PIN_ENC_SIZE_P1, PIN_ENC_SIZE_P2, cp->pin_uv_auth_protocol);
+}
 
-      case CP_REQ_PIN_HASH_ENC:
-        DBG_MSG("pin_hash_enc found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if ((cp->pin_uv_auth_protocol == 1 && len != PIN_HASH_SIZE_P1) ||
-            (cp->pin_uv_auth_protocol == 2 && len != PIN_HASH_SIZE_P2)) {
-          ERR_MSG("Invalid pin_hash_enc length\n");
-          return CTAP2_ERR_INVALID_CBOR;
-        }
-        ret = cbor_value_copy_byte_string(&map, cp->pin_hash_enc, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        cp->parsed_params |= PARAM_PIN_HASH_ENC;
-        break;
+static uint8_t parse_cp_pin_hash_enc(void *req, CborValue *val) {
+  CTAP_client_pin *cp = req;
+  return parse_cp_enc(val, cp->pin_hash_enc, PIN_HASH_SIZE_P1, PIN_HASH_SIZE_P2, cp->pin_uv_auth_protocol);
+}
 
-      case CP_REQ_PERMISSIONS:
-        DBG_MSG("permissions found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &key);
-        CHECK_CBOR_RET(ret);
-        cp->permissions = key;
-        DBG_MSG("permissions: %d\n", cp->permissions);
-        if (cp->permissions == 0) {
-          ERR_MSG("Invalid permissions\n");
-          return CTAP1_ERR_INVALID_PARAMETER;
-        }
-        if (cp->permissions & (CP_PERMISSION_BE | CP_PERMISSION_ACFG)) {
-          DBG_MSG("Unsupported permissions\n");
-          return CTAP2_ERR_UNAUTHORIZED_PERMISSION;
-        }
-        cp->parsed_params |= PARAM_PERMISSIONS;
-        break;
+static uint8_t parse_cp_permissions(void *req, CborValue *val) {
+  CTAP_client_pin *cp = req;
+  int permissions;
+  if (cbor_value_get_type(val) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+  int ret = cbor_value_get_int_checked(val, &permissions);
+  CHECK_CBOR_RET(ret);
+  cp->permissions = permissions;
+  DBG_MSG("permissions: %d\n", cp->permissions);
+  if (cp->permissions == 0) {
+    ERR_MSG("Invalid permissions\n");
+    return CTAP1_ERR_INVALID_PARAMETER;
+  }
+  if (cp->permissions & (CP_PERMISSION_BE | CP_PERMISSION_ACFG)) {
+    DBG_MSG("Unsupported permissions\n");
+    return CTAP2_ERR_UNAUTHORIZED_PERMISSION;
+  }
+  return 0;
+}
 
-      case CP_REQ_RP_ID:
-        DBG_MSG("rp id found\n");
-        if (cbor_value_get_type(&map) != CborTextStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        len = DOMAIN_NAME_MAX_SIZE;
-        ret = cbor_value_copy_text_string(&map, domain, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        domain[len] = 0;
-        DBG_MSG("rp_id: %s\n", domain);
-        sha256_raw((uint8_t *) domain, len, cp->rp_id_hash);
-        cp->parsed_params |= PARAM_RP;
-        break;
+static const parse_field cp_fields[] = {
+    PIN_UV_AUTH_PROTOCOL_FIELD(CTAP_client_pin, CP_REQ_PIN_UV_AUTH_PROTOCOL),
+    SUB_COMMAND_FIELD(CTAP_client_pin, CP_REQ_SUB_COMMAND),
+    CUSTOM_FIELD(CP_REQ_KEY_AGREEMENT, parse_cp_key_agreement, PARAM_KEY_AGREEMENT),
+    PIN_UV_AUTH_PARAM_FIELD(CTAP_client_pin, CP_REQ_PIN_UV_AUTH_PARAM, 1, 0),
+    CUSTOM_FIELD(CP_REQ_NEW_PIN_ENC, parse_cp_new_pin_enc, PARAM_NEW_PIN_ENC),
+    CUSTOM_FIELD(CP_REQ_PIN_HASH_ENC, parse_cp_pin_hash_enc, PARAM_PIN_HASH_ENC),
+    CUSTOM_FIELD(CP_REQ_PERMISSIONS, parse_cp_permissions, PARAM_PERMISSIONS),
+    {.key = CP_REQ_RP_ID, .type = FIELD_RP_ID, .offset = offsetof(CTAP_client_pin, rp_id_hash), .param = PARAM_RP},
+};
 
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
-    }
+uint8_t parse_client_pin(CborParser *parser, CTAP_client_pin *cp, const uint8_t *buf, size_t len) {
+  memset(cp, 0, sizeof(CTAP_client_pin));
 
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-  }
+  uint8_t ret = parse_request(parser, buf, len, cp_fields, sizeof(cp_fields) / sizeof(cp_fields[0]), cp);
+  CHECK_PARSER_RET(ret);
 
   if ((cp->parsed_params & CP_REQUIRED_MASK) != CP_REQUIRED_MASK) return CTAP2_ERR_MISSING_PARAMETER;
 
@@ -1063,79 +975,28 @@ uint8_t parse_client_pin(CborParser *parser, CTAP_client_pin *cp, const uint8_t
   return 0;
 }
 
+static uint8_t parse_cm_sub_command_params(void *req, CborValue *val) {
+  CTAP_credential_management *cm = req;
+  cm->sub_command_params_ptr = (uint8_t *) val->source.ptr;
+  uint8_t ret = parse_cm_params(cm, val, &cm->param_len);
+  DBG_MSG("sub_command_params (%zu): ", cm->param_len);
+  PRINT_HEX(cm->sub_command_params_ptr, cm->param_len);
+  return ret ? CTAP2_ERR_INVALID_CBOR : 0;
+}
+
+static const parse_field cm_fields[] = {
+    SUB_COMMAND_FIELD(CTAP_credential_management, CM_REQ_SUB_COMMAND),
+    CUSTOM_FIELD(CM_REQ_SUB_COMMAND_PARAMS, parse_cm_sub_command_params, 0),
+    PIN_UV_AUTH_PROTOCOL_FIELD(CTAP_credential_management, CM_REQ_PIN_UV_AUTH_PROTOCOL),
+    PIN_UV_AUTH_PARAM_FIELD(CTAP_credential_management, CM_REQ_PIN_UV_AUTH_PARAM, 1, 0),
+};
+
 uint8_t
 parse_credential_management(CborParser *parser, CTAP_credential_management *cm, const uint8_t *buf, size_t len) {
-  CborValue it, map;
-  size_t map_length;
-  int key, tmp;
   memset(cm, 0, sizeof(CTAP_credential_management));
 
-  int ret = cbor_parser_init(buf, len, 0, parser, &it);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&it) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  ret = cbor_value_enter_container(&it, &map);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_value_get_map_length(&it, &map_length);
-  CHECK_CBOR_RET(ret);
-
-  for (size_t i = 0; i < map_length; ++i) {
-    if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-    ret = cbor_value_get_int_checked(&map, &key);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-
-    switch (key) {
-      case CM_REQ_SUB_COMMAND:
-        DBG_MSG("sub_command found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        cm->sub_command = tmp;
-        DBG_MSG("sub_command: %d\n", cm->sub_command);
-        cm->parsed_params |= PARAM_SUB_COMMAND;
-        break;
-
-      case CM_REQ_SUB_COMMAND_PARAMS:
-        DBG_MSG("subCommandParams found\n");
-        cm->sub_command_params_ptr = (uint8_t *) map.source.ptr;
-        ret = parse_cm_params(cm, &map, &cm->param_len);
-        DBG_MSG("sub_command_params (%zu): ", cm->param_len);
-        PRINT_HEX(cm->sub_command_params_ptr, cm->param_len);
-        CHECK_CBOR_RET(ret);
-        break;
-
-      case CM_REQ_PIN_UV_AUTH_PROTOCOL:
-        DBG_MSG("pin_uv_auth_protocol found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pin_uv_auth_protocol: %d\n", tmp);
-        if (tmp != 1 && tmp != 2) return CTAP1_ERR_INVALID_PARAMETER;
-        cm->pin_uv_auth_protocol = tmp;
-        cm->parsed_params |= PARAM_PIN_UV_AUTH_PROTOCOL;
-        break;
-
-      case CM_REQ_PIN_UV_AUTH_PARAM:
-        DBG_MSG("pin_uv_auth_param found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if (len == 0 || len > SHA256_DIGEST_LENGTH) return CTAP2_ERR_PIN_AUTH_INVALID;
-        ret = cbor_value_copy_byte_string(&map, cm->pin_uv_auth_param, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        PRINT_HEX(cm->pin_uv_auth_param, len);
-        cm->parsed_params |= PARAM_PIN_UV_AUTH_PARAM;
-        break;
-
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
-    }
-
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-  }
+  uint8_t ret = parse_request(parser, buf, len, cm_fields, sizeof(cm_fields) / sizeof(cm_fields[0]), cm);
+  CHECK_PARSER_RET(ret);
 
   if ((cm->parsed_params & CM_REQUIRED_MASK) != CM_REQUIRED_MASK) return CTAP2_ERR_MISSING_PARAMETER;
 
@@ -1163,107 +1024,33 @@ parse_credential_management(CborParser *parser, CTAP_credential_management *cm,
   return 0;
 }
 
-uint8_t parse_large_blobs(CborParser *parser, CTAP_large_blobs *lb, const uint8_t *buf, size_t len) {
-  CborValue it, map;
-  size_t map_length;
-  int key, tmp;
-  memset(lb, 0, sizeof(CTAP_large_blobs));
-
-  int ret = cbor_parser_init(buf, len, 0, parser, &it);
-  CHECK_CBOR_RET(ret);
-  if (cbor_value_get_type(&it) != CborMapType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-  ret = cbor_value_enter_container(&it, &map);
+static uint8_t parse_lb_set(void *req, CborValue *val) {
+  CTAP_large_blobs *lb = req;
+  if (cbor_value_get_type(val) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+  int ret = cbor_value_get_string_length(val, &lb->set_len);
   CHECK_CBOR_RET(ret);
-  ret = cbor_value_get_map_length(&it, &map_length);
-  CHECK_CBOR_RET(ret);
-
-  for (size_t i = 0; i < map_length; ++i) {
-    if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-    ret = cbor_value_get_int_checked(&map, &key);
-    CHECK_CBOR_RET(ret);
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-
-    switch (key) {
-      case LB_REQ_GET:
-        DBG_MSG("get found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("get: %d\n", tmp);
-        if (tmp < 0) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE; // should be unsigned integer
-        if (tmp > UINT16_MAX) tmp = UINT16_MAX;
-        lb->get = tmp;
-        lb->parsed_params |= PARAM_GET;
-        break;
-
-      case LB_REQ_SET:
-        DBG_MSG("set found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &lb->set_len);
-        CHECK_CBOR_RET(ret);
-        lb->set = (uint8_t *) map.source.ptr + 1;
-        if (lb->set_len >= 24) ++lb->set;
-        if (lb->set_len >= 256) ++lb->set;
-        DBG_MSG("set(%zuB): ", lb->set_len);
-        PRINT_HEX(lb->set, lb->set_len < 17 ? lb->set_len : 17);
-        lb->parsed_params |= PARAM_SET;
-        break;
-
-      case LB_REQ_OFFSET:
-        DBG_MSG("offset found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("offset: %d\n", tmp);
-        if (tmp < 0) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE; // should be unsigned integer
-        if (tmp > UINT16_MAX) tmp = UINT16_MAX;
-        lb->offset = tmp;
-        lb->parsed_params |= PARAM_OFFSET;
-        break;
-
-      case LB_REQ_LENGTH:
-        DBG_MSG("length found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("length: %d\n", tmp);
-        if (tmp < 0) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE; // should be unsigned integer
-        if (tmp > UINT16_MAX) tmp = UINT16_MAX;
-        lb->length = tmp;
-        lb->parsed_params |= PARAM_LENGTH;
-        break;
-
-      case LB_REQ_PIN_UV_AUTH_PROTOCOL:
-        DBG_MSG("pin_uv_auth_protocol found\n");
-        if (cbor_value_get_type(&map) != CborIntegerType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_int_checked(&map, &tmp);
-        CHECK_CBOR_RET(ret);
-        DBG_MSG("pin_uv_auth_protocol: %d\n", tmp);
-        if (tmp != 1 && tmp != 2) return CTAP1_ERR_INVALID_PARAMETER;
-        lb->pin_uv_auth_protocol = tmp;
-        lb->parsed_params |= PARAM_PIN_UV_AUTH_PROTOCOL;
-        break;
+  lb->set = (uint8_t *) val->source.ptr + 1;
+  if (lb->set_len >= 24) ++lb->set;
+  if (lb->set_len >= 256) ++lb->set;
+  DBG_MSG("set(%zuB): ", lb->set_len);
+  PRINT_HEX(lb->set, lb->set_len < 17 ? lb->set_len : 17);
+  return 0;
+}
 
-      case LB_REQ_PIN_UV_AUTH_PARAM:
-        DBG_MSG("pin_uv_auth_param found\n");
-        if (cbor_value_get_type(&map) != CborByteStringType) return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
-        ret = cbor_value_get_string_length(&map, &len);
-        CHECK_CBOR_RET(ret);
-        if (len == 0 || len > SHA256_DIGEST_LENGTH) return CTAP2_ERR_PIN_AUTH_INVALID;
-        ret = cbor_value_copy_byte_string(&map, lb->pin_uv_auth_param, &len, NULL);
-        CHECK_CBOR_RET(ret);
-        lb->parsed_params |= PARAM_PIN_UV_AUTH_PARAM;
-        break;
+static const parse_field lb_fields[] = {
+    UINT16_FIELD(CTAP_large_blobs, LB_REQ_GET, get, PARAM_GET),
+    CUSTOM_FIELD(LB_REQ_SET, parse_lb_set, PARAM_SET),
+    UINT16_FIELD(CTAP_large_blobs, LB_REQ_OFFSET, offset, PARAM_OFFSET),
+    UINT16_FIELD(CTAP_large_blobs, LB_REQ_LENGTH, length, PARAM_LENGTH),
+    PIN_UV_AUTH_PROTOCOL_FIELD(CTAP_large_blobs, LB_REQ_PIN_UV_AUTH_PROTOCOL),
+    PIN_UV_AUTH_PARAM_FIELD(CTAP_large_blobs, LB_REQ_PIN_UV_AUTH_PARAM, 1, 0),
+};
 
-      default:
-        DBG_MSG("Unknown key: %d\n", key);
-        break;
-    }
+uint8_t parse_large_blobs(CborParser *parser, CTAP_large_blobs *lb, const uint8_t *buf, size_t len) {
+  memset(lb, 0, sizeof(CTAP_large_blobs));
 
-    ret = cbor_value_advance(&map);
-    CHECK_CBOR_RET(ret);
-  }
+  uint8_t ret = parse_request(parser, buf, len, lb_fields, sizeof(lb_fields) / sizeof(lb_fields[0]), lb);
+  CHECK_PARSER_RET(ret);
 
   if (!(lb->parsed_params & PARAM_OFFSET)) return CTAP1_ERR_INVALID_PARAMETER;
   if (!((lb->parsed_params & PARAM_GET) ^ (lb->parsed_params & PARAM_SET))) return CTAP1_ERR_INVALID_PARAMETER;
@@ -3,6 +3,7 @@
 #include "ctap-errors.h"
 #include "ctap-internal.h"
 #include "ctap-parser.h"
+#include "dc-index.h"
 #include "secret.h"
 #include "u2f.h"
 #include <block-cipher.h>
@@ -15,6 +16,7 @@
 #include <hmac.h>
 #include <memzero.h>
 #include <rand.h>
+#include <store.h>
 
 #define CHECK_PARSER_RET(ret)                                                                                          \
   do {                                                                                                                 \
@@ -62,28 +64,493 @@ static uint8_t consecutive_pin_counter, last_cmd;
 static ctap_src_t current_cmd_src;
 // SM2 attr
 CTAP_sm2_attr ctap_sm2_attr;
+// The response of GetInfo, encoded by the first call after ctap_install or a change of the SM2 config.
+// Only the value of the clientPin option may change in between, which is patched at get_info_pin_pos.
+#define GET_INFO_CACHE_SIZE 320
+static uint8_t get_info_cache[GET_INFO_CACHE_SIZE];
+static uint16_t get_info_len, get_info_pin_pos; // get_info_len is 0 if not cached
+
+static void drop_get_info_cache(void) { get_info_len = 0; }
+
+static int dc_legacy_live(const void *record) { return !((const CTAP_discoverable_credential *) record)->deleted; }
+static int legacy_meta_live(const void *record) { return ((const CTAP_legacy_rp_meta *) record)->slots != 0; }
+static const uint8_t dc_keep_attrs[] = {DC_GENERAL_ATTR};
+// The DCs are kept in pages of DC_PAGE_CAPACITY, the DC of index i in the slot i % DC_PAGE_CAPACITY of the page
+// i / DC_PAGE_CAPACITY. A page is a store of CTAP_dc_header with a user file, to which the encoded users are
+// appended. Only the first dc_page_count pages exist.
+static store_t dc_pages[MAX_DC_PAGES];
+#define DC_PAGE_PATH_SIZE (sizeof(DC_PAGE_FILE_TMP) + 2)
+static char dc_page_paths[MAX_DC_PAGES][DC_PAGE_PATH_SIZE], dc_page_tmp_paths[MAX_DC_PAGES][DC_PAGE_PATH_SIZE];
+static char dc_user_paths[MAX_DC_PAGES][DC_PAGE_PATH_SIZE], dc_user_tmp_paths[MAX_DC_PAGES][DC_PAGE_PATH_SIZE];
+static uint32_t dc_user_size[MAX_DC_PAGES], dc_user_live[MAX_DC_PAGES]; // bytes in a user file, and of live DCs
+static uint8_t dc_page_count;
+static uint32_t dc_created; // the highest CTAP_dc_header.created
+static store_t rp_store = {.path = RP_FILE, .record_size = sizeof(CTAP_rp_meta), .capacity = MAX_RP_NUM};
+// {new file, file} of the header and user files of each page, RP_FILE, and the legacy files, swapped through
+// DC_SWAP_FILE
+static const char *dc_swap_files[2 * MAX_DC_PAGES + 3][2];
+#define RP_SWAP_FILES     (2 * MAX_DC_PAGES)
+#define DC_SWAP_FILE_NUM  (2 * MAX_DC_PAGES + 3)
+#define DC_USER_MAX_SIZE  (3 + USER_ID_MAX_SIZE + USER_NAME_LIMIT - 1 + DISPLAY_NAME_LIMIT - 1 + MAX_CRED_BLOB_LENGTH)
+#define DC_INDEX_NONE     0xFFFF // in CTAP_dc_general_attr.index, a pending operation without a DC to roll back
+_Static_assert(MAX_DC_PAGES <= 100, "too many DC pages for dc_page_paths");
+_Static_assert(DC_USER_MAX_SIZE <= UINT8_MAX, "CTAP_dc_header.user_len overflow");
+
+// base followed by the page number unless it is 0, e.g. ctap_dp12
+static void dc_page_path(char *path, const char *base, int page) {
+  size_t len = strlen(base);
+  memcpy(path, base, len);
+  if (page >= 10) path[len++] = (char) ('0' + page / 10);
+  if (page > 0) path[len++] = (char) ('0' + page % 10);
+  path[len] = '\0';
+}
+
+static void dc_pages_init(void) {
+  for (int i = 0; i < MAX_DC_PAGES; ++i) {
+    store_t *page = &dc_pages[i];
+    dc_page_path(dc_page_paths[i], DC_PAGE_FILE, i);
+    dc_page_path(dc_page_tmp_paths[i], DC_PAGE_FILE_TMP, i);
+    dc_page_path(dc_user_paths[i], DC_USER_FILE, i);
+    dc_page_path(dc_user_tmp_paths[i], DC_USER_FILE_TMP, i);
+    page->path = dc_page_paths[i];
+    page->record_size = sizeof(CTAP_dc_header);
+    page->capacity = (uint8_t) MIN(DC_PAGE_CAPACITY, MAX_DC_NUM - i * DC_PAGE_CAPACITY);
+    dc_swap_files[2 * i][0] = dc_page_tmp_paths[i];
+    dc_swap_files[2 * i][1] = dc_page_paths[i];
+    dc_swap_files[2 * i + 1][0] = dc_user_tmp_paths[i];
+    dc_swap_files[2 * i + 1][1] = dc_user_paths[i];
+  }
+  dc_swap_files[RP_SWAP_FILES][0] = RP_FILE_TMP;
+  dc_swap_files[RP_SWAP_FILES][1] = RP_FILE;
+  dc_swap_files[RP_SWAP_FILES + 1][0] = DC_META_FILE_TMP;
+  dc_swap_files[RP_SWAP_FILES + 1][1] = DC_META_FILE;
+  dc_swap_files[RP_SWAP_FILES + 2][0] = DC_FILE_TMP;
+  dc_swap_files[RP_SWAP_FILES + 2][1] = DC_FILE;
+}
+
+static int dc_swap(int first, int n) {
+  return store_swap(DC_SWAP_FILE, (const char *const(*)[2]) &dc_swap_files[first], n);
+}
+
+static int dc_pages_open(CTAP_dc_header *header) {
+  dc_page_count = 0;
+  for (int i = 0; i < MAX_DC_PAGES; ++i) {
+    int err = store_open(&dc_pages[i], header);
+    if (err == LFS_ERR_NOENT && i > 0) break; // pages are added in order
+    if (err < 0) return err;
+    err = get_file_size(dc_user_paths[i]);
+    if (err == LFS_ERR_NOENT) err = 0;
+    if (err < 0) return err;
+    dc_user_size[i] = (uint32_t) err;
+    dc_page_count = (uint8_t) (i + 1);
+  }
+  return 0;
+}
+
+static int remove_if_exists(const char *path) {
+  const int err = fs_remove(path);
+  return err == LFS_ERR_NOENT ? 0 : err;
+}
+
+// drop all pages, leaving an empty first one
+static int dc_pages_format(void) {
+  for (int i = 0; i < MAX_DC_PAGES; ++i) {
+    int err = remove_if_exists(dc_user_paths[i]);
+    if (err >= 0 && i > 0) err = remove_if_exists(dc_page_paths[i]);
+    if (err < 0) return err;
+    dc_user_size[i] = 0;
+    dc_user_live[i] = 0;
+  }
+  dc_page_count = 1;
+  return store_format(&dc_pages[0]);
+}
+
+// id_size | id | name length | name | display name length | display name | cred blob, return the length
+static uint8_t dc_encode_user(const CTAP_discoverable_credential *dc, uint8_t *buf) {
+  uint8_t len = 0;
+  buf[len++] = dc->user.id_size;
+  memcpy(buf + len, dc->user.id, dc->user.id_size);
+  len += dc->user.id_size;
+  buf[len] = (uint8_t) strnlen(dc->user.name, USER_NAME_LIMIT - 1);
+  memcpy(buf + len + 1, dc->user.name, buf[len]);
+  len += 1 + buf[len];
+  buf[len] = (uint8_t) strnlen(dc->user.display_name, DISPLAY_NAME_LIMIT - 1);
+  memcpy(buf + len + 1, dc->user.display_name, buf[len]);
+  len += 1 + buf[len];
+  memcpy(buf + len, dc->cred_blob, dc->cred_blob_len);
+  return len + dc->cred_blob_len;
+}
+
+static int dc_decode_user(const uint8_t *buf, uint8_t len, CTAP_discoverable_credential *dc) {
+  uint8_t pos = 0;
+  memzero(&dc->user, sizeof(dc->user));
+  if (pos + 1 > len || buf[pos] > USER_ID_MAX_SIZE || pos + 1 + buf[pos] > len) return LFS_ERR_CORRUPT;
+  dc->user.id_size = buf[pos];
+  memcpy(dc->user.id, buf + pos + 1, buf[pos]);
+  pos += 1 + buf[pos];
+  if (pos + 1 > len || buf[pos] >= USER_NAME_LIMIT || pos + 1 + buf[pos] > len) return LFS_ERR_CORRUPT;
+  memcpy(dc->user.name, buf + pos + 1, buf[pos]);
+  pos += 1 + buf[pos];
+  if (pos + 1 > len || buf[pos] >= DISPLAY_NAME_LIMIT || pos + 1 + buf[pos] > len) return LFS_ERR_CORRUPT;
+  memcpy(dc->user.display_name, buf + pos + 1, buf[pos]);
+  pos += 1 + buf[pos];
+  if (dc->cred_blob_len > MAX_CRED_BLOB_LENGTH || pos + dc->cred_blob_len != len) return LFS_ERR_CORRUPT;
+  memcpy(dc->cred_blob, buf + pos, dc->cred_blob_len);
+  return 0;
+}
+
+static int dc_read_header(int index, CTAP_dc_header *header) {
+  if (index < 0 || index >= dc_page_count * DC_PAGE_CAPACITY) return LFS_ERR_NOENT;
+  return store_read(&dc_pages[index / DC_PAGE_CAPACITY], index % DC_PAGE_CAPACITY, header);
+}
+
+// fill the fields of dc kept in the header
+static void dc_from_header(const CTAP_dc_header *header, CTAP_discoverable_credential *dc) {
+  memcpy(&dc->credential_id, &header->credential_id, sizeof(credential_id));
+  dc->deleted = false;
+  dc->has_large_blob_key = header->has_large_blob_key;
+  dc->cred_blob_len = header->cred_blob_len;
+}
+
+// decode the DC of index whose header is already read
+static int dc_read_user(int index, const CTAP_dc_header *header, CTAP_discoverable_credential *dc) {
+  dc_from_header(header, dc);
+  uint8_t buf[DC_USER_MAX_SIZE];
+  const int err = read_file(dc_user_paths[index / DC_PAGE_CAPACITY], buf, header->user_off, header->user_len);
+  if (err < 0) return err;
+  if (err != header->user_len) return LFS_ERR_CORRUPT;
+  return dc_decode_user(buf, header->user_len, dc);
+}
+
+static int dc_read(int index, CTAP_discoverable_credential *dc) {
+  CTAP_dc_header header;
+  const int err = dc_read_header(index, &header);
+  if (err < 0) return err;
+  return dc_read_user(index, &header, dc);
+}
+
+// append the user of dc to the user file of the page of index, and fill the header
+static int dc_append_user(int index, const CTAP_discoverable_credential *dc, CTAP_dc_header *header) {
+  const int page = index / DC_PAGE_CAPACITY;
+  uint8_t buf[DC_USER_MAX_SIZE];
+  memcpy(&header->credential_id, &dc->credential_id, sizeof(credential_id));
+  header->has_large_blob_key = dc->has_large_blob_key;
+  header->cred_blob_len = dc->cred_blob_len;
+  header->user_len = dc_encode_user(dc, buf);
+  header->user_off = dc_user_size[page];
+  const int err = append_file(dc_user_paths[page], buf, header->user_len);
+  if (err < 0) return err;
+  dc_user_size[page] += header->user_len;
+  return 0;
+}
+
+// replace the DC of index, which becomes the newest of its RP if renew
+static int dc_write(int index, const CTAP_discoverable_credential *dc, bool renew) {
+  CTAP_dc_header header;
+  int err = dc_read_header(index, &header); // the live one, whose user becomes garbage
+  if (err < 0) return err;
+  const uint8_t old_len = header.user_len;
+  if (renew) header.created = ++dc_created;
+  err = dc_append_user(index, dc, &header);
+  if (err < 0) return err;
+  err = store_write(&dc_pages[index / DC_PAGE_CAPACITY], index % DC_PAGE_CAPACITY, &header);
+  if (err < 0) return err;
+  dc_user_live[index / DC_PAGE_CAPACITY] += header.user_len - old_len;
+  return 0;
+}
+
+static int dc_delete(int index) {
+  CTAP_dc_header header;
+  int err = dc_read_header(index, &header);
+  if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) header.user_len = 0;
+  else if (err < 0) return err;
+  if (index < 0 || index >= dc_page_count * DC_PAGE_CAPACITY) return 0;
+  err = store_delete(&dc_pages[index / DC_PAGE_CAPACITY], index % DC_PAGE_CAPACITY);
+  if (err < 0) return err;
+  dc_user_live[index / DC_PAGE_CAPACITY] -= header.user_len;
+  return 0;
+}
+
+// the index which the next dc_alloc will use, or LFS_ERR_NOSPC
+static int dc_next_index(void) {
+  for (int i = 0; i < dc_page_count; ++i) {
+    const int slot = store_next_index(&dc_pages[i]);
+    if (slot >= 0) return i * DC_PAGE_CAPACITY + slot;
+  }
+  if (dc_page_count < MAX_DC_PAGES) return dc_page_count * DC_PAGE_CAPACITY;
+  return LFS_ERR_NOSPC;
+}
+
+static int dc_alloc(const CTAP_discoverable_credential *dc) {
+  const int index = dc_next_index();
+  if (index < 0) return index;
+  const int page = index / DC_PAGE_CAPACITY;
+  if (page == dc_page_count) {
+    int err = write_file(dc_user_paths[page], NULL, 0, 0, 1); // may be left by an interrupted compaction
+    if (err >= 0) err = store_format(&dc_pages[page]);
+    if (err < 0) return err;
+    dc_user_size[page] = 0;
+    dc_user_live[page] = 0;
+    ++dc_page_count;
+  }
+  CTAP_dc_header header;
+  header.created = ++dc_created;
+  int err = dc_append_user(index, dc, &header);
+  if (err < 0) return err;
+  err = store_alloc(&dc_pages[page], &header);
+  if (err < 0) return err;
+  dc_user_live[page] += header.user_len;
+  return index;
+}
+
+// The number of DCs which may still be added: at most MAX_DC_NUM in total, and no more than the free blocks hold if
+// each one takes a header and a user of the max length. Two blocks are kept for the copy-on-write of the appended
+// files. It is an estimate, since the metadata of littlefs and a new RP take some more flash.
+static int dc_remaining(int numbers) {
+  const int remaining = MAX_DC_NUM - numbers;
+  const int used = get_fs_used_blocks();
+  if (used < 0) return remaining;
+  const int free_blocks = get_fs_block_count() - used - 2;
+  if (free_blocks <= 0) return 0;
+  const int fit = free_blocks * get_fs_block_size() / (int) (sizeof(CTAP_dc_header) + UINT8_MAX);
+  return fit < remaining ? fit : remaining;
+}
+
+// the slot of the meta of an RP + 1, 0 if not found, or a negative error code
+static int rp_find(const uint8_t *rp_id_hash, CTAP_rp_meta *meta) {
+  for (int rp = dc_index_next_rp(0, rp_id_hash); rp >= 0; rp = dc_index_next_rp(rp + 1, rp_id_hash)) {
+    const int err = store_read(&rp_store, rp, meta);
+    if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) continue;
+    if (err < 0) return err;
+    if (memcmp_s(meta->rp_id_hash, rp_id_hash, SHA256_DIGEST_LENGTH) == 0) return rp + 1;
+  }
+  return 0;
+}
+
+// read the first live meta from the slot from on, return its slot + 1, 0 if none, or a negative error code
+static int rp_read_next(int from, CTAP_rp_meta *meta) {
+  for (int rp = dc_index_next_rp(from, NULL); rp >= 0; rp = dc_index_next_rp(rp + 1, NULL)) {
+    const int err = store_read(&rp_store, rp, meta);
+    if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) continue;
+    if (err < 0) return err;
+    return rp + 1;
+  }
+  return 0;
+}
+
+static int dc_index_add_rp(int index, void *record, void *user) {
+  UNUSED(user);
+  dc_index_set_rp(index, ((const CTAP_rp_meta *) record)->rp_id_hash);
+  return 0;
+}
+
+static int dc_index_add(int index, void *record, void *user) {
+  const CTAP_dc_header *header = record;
+  const int page = *(const int *) user;
+  const uint8_t *rp_id_hash = header->credential_id.rp_id_hash;
+  dc_created = MAX(dc_created, header->created);
+  // the meta of a DC always exists, so it is only read when the tag is ambiguous
+  int rp = dc_index_next_rp(0, rp_id_hash);
+  if (rp >= 0 && dc_index_next_rp(rp + 1, rp_id_hash) >= 0) {
+    CTAP_rp_meta meta;
+    rp = rp_find(rp_id_hash, &meta);
+    if (rp < 0) return rp;
+    --rp;
+  }
+  if (rp < 0) { // left by an interrupted MakeCredential, dropped by ctap_consistency_check
+    DBG_MSG("No meta for the DC at %d\n", page * DC_PAGE_CAPACITY + index);
+    return 0;
+  }
+  dc_index_set(page * DC_PAGE_CAPACITY + index, rp, &header->credential_id);
+  dc_user_live[page] += header->user_len;
+  return 0;
+}
+
+static int dc_index_build(CTAP_dc_header *header) {
+  dc_index_clear();
+  dc_created = 0;
+  _Static_assert(sizeof(CTAP_rp_meta) <= sizeof(*header), "CTAP_rp_meta buffer overflow");
+  int err = store_foreach(&rp_store, 0, header, dc_index_add_rp, NULL);
+  if (err < 0) return err;
+  for (int i = 0; i < dc_page_count; ++i) {
+    dc_user_live[i] = 0;
+    err = store_foreach(&dc_pages[i], 0, header, dc_index_add, &i);
+    if (err < 0) return err;
+  }
+  return 0;
+}
+
+// store_foreach visitor of a legacy page, moves a DC into the pages
+static int migrate_legacy_dc(int index, void *record, void *user) {
+  UNUSED(index);
+  UNUSED(user);
+  const int err = dc_alloc(record);
+  return err < 0 ? err : 0;
+}
+
+// store_foreach visitor, copies a legacy meta of any DC into rp_store
+static int migrate_legacy_meta(int index, void *record, void *user) {
+  UNUSED(index);
+  UNUSED(user);
+  const CTAP_legacy_rp_meta *legacy = record;
+  CTAP_rp_meta meta;
+  if (legacy->slots == 0) return 0;
+  memcpy(meta.rp_id_hash, legacy->rp_id_hash, SHA256_DIGEST_LENGTH);
+  memcpy(meta.rp_id, legacy->rp_id, MAX_STORED_RPID_LENGTH);
+  meta.rp_id_len = (uint8_t) MIN(legacy->rp_id_len, MAX_STORED_RPID_LENGTH);
+  const int err = store_alloc(&rp_store, &meta);
+  return err < 0 ? err : 0;
+}
+
+// the legacy DCs are full records in DC_FILE, and in ctap_dc1, ctap_dc2, ... of the first paged layout
+static void legacy_dc_page(store_t *store, char *path, int page) {
+  memset(store, 0, sizeof(store_t));
+  dc_page_path(path, DC_FILE, page);
+  store->path = path;
+  store->record_size = sizeof(CTAP_discoverable_credential);
+  store->capacity = DC_PAGE_CAPACITY;
+  if (page == 0) {
+    store->legacy_live = dc_legacy_live;
+    store->keep_attrs = dc_keep_attrs;
+    store->keep_attr_count = sizeof(dc_keep_attrs);
+  }
+}
+
+// drop the files of the legacy layout, DC_FILE last since it marks them
+static int remove_legacy_dc_files(void) {
+  char path[DC_PAGE_PATH_SIZE];
+  int err = remove_if_exists(DC_META_FILE);
+  for (int i = 1; err >= 0 && i < MAX_DC_PAGES; ++i) {
+    dc_page_path(path, DC_FILE, i);
+    err = remove_if_exists(path);
+  }
+  if (err < 0) return err;
+  return write_file(DC_FILE, NULL, 0, 0, 1);
+}
+
+static int dc_files_format(void) {
+  int err = dc_pages_format();
+  if (err < 0) return err;
+  err = remove_legacy_dc_files();
+  if (err < 0) return err;
+  const CTAP_dc_general_attr attr = {0};
+  err = write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr));
+  if (err < 0) return err;
+  return store_format(&rp_store);
+}
+
+// Move the DCs of the legacy layout into the pages, and the RP metas of DC_META_FILE into RP_FILE. The first page
+// is built under its temporary name and renamed last, so an interrupted migration starts over.
+static int migrate_legacy_dcs(CTAP_discoverable_credential *dc) {
+  static store_t legacy_meta_store = {.path = DC_META_FILE,
+                                      .record_size = sizeof(CTAP_legacy_rp_meta),
+                                      .capacity = DC_PAGE_CAPACITY,
+                                      .legacy_live = legacy_meta_live};
+  _Static_assert(sizeof(CTAP_legacy_rp_meta) <= sizeof(*dc), "CTAP_legacy_rp_meta buffer overflow");
+  char path[DC_PAGE_PATH_SIZE];
+  store_t legacy;
+  int err = fs_exists(DC_PAGE_FILE);
+  if (err < 0) return err;
+  if (err > 0) { // migrated, maybe without the cleanup
+    err = get_file_size(DC_FILE);
+    return err > 0 ? remove_legacy_dc_files() : err;
+  }
+  DBG_MSG("Migrating the legacy DC layout\n");
+  // drop the DC of a pending operation from the legacy layout, whose rollback then only releases the RP
+  CTAP_dc_general_attr attr = {0};
+  err = read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr));
+  if (err < 0) return err;
+  const bool legacy_attr = err == sizeof(CTAP_legacy_dc_general_attr);
+  if (legacy_attr) {
+    CTAP_legacy_dc_general_attr legacy_general;
+    memcpy(&legacy_general, &attr, sizeof(legacy_general));
+    memset(&attr, 0, sizeof(attr));
+    attr.numbers = legacy_general.numbers;
+    attr.index = legacy_general.index;
+    attr.pending_add = legacy_general.pending_add;
+    attr.pending_delete = legacy_general.pending_delete;
+  }
+  if ((attr.pending_add || attr.pending_delete) && attr.index != DC_INDEX_NONE) {
+    legacy_dc_page(&legacy, path, attr.index / DC_PAGE_CAPACITY);
+    err = store_open(&legacy, dc);
+    if (err >= 0 && legacy_attr && store_read(&legacy, attr.index % DC_PAGE_CAPACITY, dc) == 0)
+      memcpy(attr.rp_id_hash, dc->credential_id.rp_id_hash, SHA256_DIGEST_LENGTH);
+    if (err >= 0) err = store_delete(&legacy, attr.index % DC_PAGE_CAPACITY);
+    if (err < 0 && err != LFS_ERR_NOENT) return err;
+    attr.index = DC_INDEX_NONE;
+  }
+  err = write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr));
+  if (err < 0) return err;
+  // rebuild the pages
+  dc_pages[0].path = dc_page_tmp_paths[0];
+  err = dc_pages_format();
+  for (int i = 0; err >= 0 && i < MAX_DC_PAGES; ++i) {
+    legacy_dc_page(&legacy, path, i);
+    err = store_open(&legacy, dc);
+    if (err == LFS_ERR_NOENT) { // no more pages
+      err = 0;
+      break;
+    }
+    if (err >= 0) err = store_foreach(&legacy, 0, dc, migrate_legacy_dc, NULL);
+  }
+  dc_pages[0].path = dc_page_paths[0];
+  if (err < 0) return err;
+  // and the metas
+  err = fs_exists(DC_META_FILE);
+  if (err > 0) {
+    err = store_open(&legacy_meta_store, dc);
+    if (err >= 0) err = store_format(&rp_store);
+    if (err >= 0) err = store_foreach(&legacy_meta_store, 0, dc, migrate_legacy_meta, NULL);
+  }
+  if (err < 0) return err;
+  err = fs_rename(DC_PAGE_FILE_TMP, DC_PAGE_FILE);
+  if (err < 0) return err;
+  return remove_legacy_dc_files();
+}
 
 uint8_t ctap_install(uint8_t reset) {
   consecutive_pin_counter = 3;
   last_cmd = CTAP_INVALID_CMD;
   current_cmd_src = CTAP_SRC_NONE;
   cp_initialize();
-  if (!reset && get_file_size(LB_FILE) >= 0) {
+  drop_cached_secrets();
+  drop_counter_reservation();
+  drop_key_pool(); // generated with the old kh key
+  drop_pub_key_cache();
+  drop_get_info_cache();
+  dc_pages_init();
+  if (store_swap_recover(DC_SWAP_FILE, (const char *const(*)[2]) dc_swap_files, DC_SWAP_FILE_NUM) < 0)
+    return CTAP2_ERR_UNHANDLED_REQUEST;
+  if (!reset && fs_exists(LB_FILE) > 0) {
     if (read_attr(CTAP_CERT_FILE, SM2_ATTR, &ctap_sm2_attr, sizeof(ctap_sm2_attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    CTAP_discoverable_credential dc; // buffer for the migration of stores
+    _Static_assert(sizeof(CTAP_rp_meta) <= sizeof(dc), "CTAP_rp_meta buffer overflow");
+    if (migrate_legacy_dcs(&dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (dc_pages_open((CTAP_dc_header *) &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (store_open(&rp_store, &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (dc_index_build((CTAP_dc_header *) &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     DBG_MSG("CTAP initialized\n");
     return 0;
   }
-  uint8_t kh_key[KH_KEY_SIZE] = {0};
-  if (write_file(DC_FILE, NULL, 0, 0, 1) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_attr(DC_FILE, DC_GENERAL_ATTR, kh_key, sizeof(CTAP_dc_general_attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_file(DC_META_FILE, NULL, 0, 0, 1) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  uint8_t kh_key[KH_KEY_SIZE] = {0}, he_key[HE_KEY_SIZE];
+  if (dc_files_format() < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  dc_index_clear();
   if (write_file(CTAP_CERT_FILE, NULL, 0, 0, 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, kh_key, 4) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  random_buffer(kh_key, sizeof(kh_key));
-  if (write_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, sizeof(kh_key)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  const uint32_t sign_ctr = 0;
   random_buffer(kh_key, sizeof(kh_key));
-  if (write_attr(CTAP_CERT_FILE, HE_KEY_ATTR, kh_key, sizeof(kh_key)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  random_buffer(he_key, sizeof(he_key));
+  fs_txn_t txn;
+  fs_txn_begin(&txn, CTAP_CERT_FILE);
+  fs_txn_setattr(&txn, SIGN_CTR_ATTR, &sign_ctr, sizeof(sign_ctr));
+  fs_txn_setattr(&txn, PIN_ATTR, NULL, 0);
+  fs_txn_setattr(&txn, KH_KEY_ATTR, kh_key, sizeof(kh_key));
+  fs_txn_setattr(&txn, HE_KEY_ATTR, he_key, sizeof(he_key));
+  int err = fs_txn_commit(&txn);
+  memzero(he_key, sizeof(he_key));
+  if (err < 0) {
+    memzero(kh_key, sizeof(kh_key));
+    return CTAP2_ERR_UNHANDLED_REQUEST;
+  }
   memcpy(kh_key,
          (uint8_t[]) {0x80, 0x76, 0xbe, 0x8b, 0x52, 0x8d, 0x00, 0x75, 0xf7, 0xaa, 0xe9, 0x8d, 0x6f, 0xa5, 0x7a, 0x6d,
                       0x3c}, 17);
@@ -120,6 +587,7 @@ int ctap_write_sm2_config(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC != sizeof(ctap_sm2_attr)) EXCEPT(SW_WRONG_LENGTH);
   const int ret = write_attr(CTAP_CERT_FILE, SM2_ATTR, DATA, sizeof(ctap_sm2_attr));
   memcpy(&ctap_sm2_attr, DATA, sizeof(ctap_sm2_attr));
+  drop_get_info_cache();
   return ret;
 }
 
@@ -189,42 +657,130 @@ static int build_ed25519_cose_key(uint8_t *data) {
   return len;
 }
 
+// Record visitors of the DC pages and rp_store, see store_foreach.
+// A visitor returns index + 1 when the record wanted is found, leaving it in the record buffer.
+
+static int first_record(int index, void *record, void *user) {
+  UNUSED(record);
+  UNUSED(user);
+  return index + 1;
+}
+
+static int dc_match_credential_id(int index, void *record, void *user) {
+  const CTAP_dc_header *header = record;
+  return memcmp_s(&header->credential_id, user, sizeof(credential_id)) == 0 ? index + 1 : 0;
+}
+
+typedef struct {
+  const uint8_t *rp_id_hash;
+  const user_entity *user;
+  CTAP_discoverable_credential *dc; // holds the DC found
+} dc_user_search;
+
+static int dc_match_user(int index, void *record, void *user) {
+  const CTAP_dc_header *header = record;
+  const dc_user_search *search = user;
+  if (memcmp_s(search->rp_id_hash, header->credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) != 0) return 0;
+  const int err = dc_read_user(index, header, search->dc);
+  if (err == LFS_ERR_CORRUPT) return 0;
+  if (err < 0) return err;
+  const user_entity *found = &search->dc->user;
+  if (search->user->id_size == found->id_size && memcmp_s(search->user->id, found->id, found->id_size) == 0)
+    return index + 1;
+  return 0;
+}
+
+typedef struct {
+  const uint8_t *rp_id_hash;
+  const uint8_t *nonce;
+} dc_nonce_search;
+
+static int dc_match_nonce(int index, void *record, void *user) {
+  const CTAP_dc_header *header = record;
+  const dc_nonce_search *search = user;
+  if (memcmp_s(search->rp_id_hash, header->credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) == 0 &&
+      memcmp_s(search->nonce, header->credential_id.nonce, sizeof(header->credential_id.nonce)) == 0)
+    return index + 1;
+  return 0;
+}
+
+typedef struct {
+  const uint8_t *rp_id_hash;
+  bool uv;
+  uint16_t *list;
+  uint32_t created[MAX_DC_NUM_IN_ASSERTION]; // of the DCs in list
+  uint8_t count;
+} dc_assertion_search;
+
+// keep the newest MAX_DC_NUM_IN_ASSERTION DCs in list, the most recently created one first
+static int dc_collect_for_assertion(int index, void *record, void *user) {
+  CTAP_dc_header *header = record;
+  dc_assertion_search *search = user;
+  // Skip the credential which is protected
+  if (!check_credential_protect_requirements(&header->credential_id, false, search->uv)) return 0;
+  if (memcmp_s(search->rp_id_hash, header->credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) != 0) return 0;
+  int i = search->count;
+  if (i == MAX_DC_NUM_IN_ASSERTION) {
+    if (header->created <= search->created[i - 1]) return 0;
+    --i; // drop the oldest one
+  } else {
+    ++search->count;
+  }
+  for (; i > 0 && search->created[i - 1] < header->created; --i) {
+    search->list[i] = search->list[i - 1];
+    search->created[i] = search->created[i - 1];
+  }
+  search->list[i] = (uint16_t) index;
+  search->created[i] = header->created;
+  return 0;
+}
+
+// Like store_foreach on the DC pages, but only reads the headers of the DCs of the RP in slot rp from first_index
+// on, and whose nonce may match if not NULL. The header found is left in header, from which dc_read_user decodes
+// the DC without reading the header again.
+static int dc_foreach(int first_index, int rp, const uint8_t *nonce, CTAP_dc_header *header,
+                      fs_record_visitor visitor, void *user) {
+  for (int i = dc_index_next(first_index, rp, nonce); i >= 0; i = dc_index_next(i + 1, rp, nonce)) {
+    int err = dc_read_header(i, header);
+    if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) continue;
+    if (err < 0) return err;
+    err = visitor(i, header, user);
+    if (err != 0) return err;
+  }
+  return 0;
+}
+
+// like dc_foreach with dc_match_credential_id on the RP of id
+static int dc_find(const credential_id *id, CTAP_dc_header *header) {
+  CTAP_rp_meta meta;
+  const int rp = rp_find(id->rp_id_hash, &meta);
+  if (rp <= 0) return rp;
+  return dc_foreach(0, rp - 1, id->nonce, header, dc_match_credential_id, (void *) id);
+}
+
+// delete the meta of an RP without any DC left
+static int rp_release(const uint8_t *rp_id_hash) {
+  CTAP_rp_meta meta;
+  const int found = rp_find(rp_id_hash, &meta);
+  if (found <= 0 || dc_index_rp_count(found - 1) > 0) return found < 0 ? found : 0;
+  DBG_MSG("Delete the meta at %d\n", found - 1);
+  const int err = store_delete(&rp_store, found - 1);
+  if (err < 0) return err;
+  dc_index_remove_rp(found - 1);
+  return 0;
+}
+
 int ctap_consistency_check(void) {
   CTAP_dc_general_attr attr;
   if (read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   if (attr.pending_add || attr.pending_delete) {
     DBG_MSG("Rolling back credential operations\n");
-    if (get_file_size(DC_FILE) >= ((int) attr.index + 1) * (int) sizeof(CTAP_discoverable_credential)) {
-      CTAP_discoverable_credential dc;
-      if (read_file(DC_FILE, &dc, attr.index * (int) sizeof(CTAP_discoverable_credential),
-                    sizeof(CTAP_discoverable_credential)) < 0)
-        return CTAP2_ERR_UNHANDLED_REQUEST;
-      if (!dc.deleted) {
-        // delete the credential that had been written
-        DBG_MSG("Delete cred at %hhu\n", attr.index);
-        dc.deleted = true;
-        if (write_file(DC_FILE, &dc, attr.index * (int) sizeof(CTAP_discoverable_credential),
-                      sizeof(CTAP_discoverable_credential), 0) < 0)
-          return CTAP2_ERR_UNHANDLED_REQUEST;
-      }
-    }
+    // delete the credential that had been written
+    DBG_MSG("Delete cred at %hu\n", attr.index);
+    if (dc_delete(attr.index) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    dc_index_remove(attr.index);
     // delete the meta then
-    int nr_rp = get_file_size(DC_META_FILE);
-    if (nr_rp < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    nr_rp /= sizeof(CTAP_rp_meta);
-    for (int i = 0; i < nr_rp; ++i) {
-      CTAP_rp_meta meta;
-      int size = read_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      if ((meta.slots & (1ull << attr.index)) != 0) {
-        DBG_MSG("Orig slot bitmap: 0x%llx\n", meta.slots);
-        meta.slots &= ~(1ull << attr.index);
-        DBG_MSG("New slot bitmap: 0x%llx\n", meta.slots);
-        size = write_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta), 0);
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        break;
-      }
-    }
+    if (rp_release(attr.rp_id_hash) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     if (attr.pending_delete)
       attr.numbers--;
 
@@ -235,6 +791,94 @@ int ctap_consistency_check(void) {
   return 0;
 }
 
+typedef struct {
+  int page;
+  uint32_t size; // of the new user file
+} dc_user_move;
+
+// store_foreach visitor, appends the user of a DC to the new user file of its page, which is synced once
+static int dc_copy_user(int index, void *record, void *user) {
+  UNUSED(index);
+  const CTAP_dc_header *header = record;
+  dc_user_move *move = user;
+  uint8_t buf[DC_USER_MAX_SIZE];
+  int err = read_file(dc_user_paths[move->page], buf, header->user_off, header->user_len);
+  if (err < 0) return err;
+  if (err != header->user_len) return LFS_ERR_CORRUPT;
+  err = fs_append_nosync(dc_user_tmp_paths[move->page], buf, header->user_len);
+  if (err < 0) return err;
+  move->size += header->user_len;
+  return 0;
+}
+
+// store_compact fixup, points a DC to its user in the new user file, in the order dc_copy_user appended them
+static int dc_move_user(int index, void *record, void *user) {
+  UNUSED(index);
+  CTAP_dc_header *header = record;
+  dc_user_move *move = user;
+  header->user_off = move->size;
+  move->size += header->user_len;
+  return 0;
+}
+
+// rebuild a page and its user file, each of which is a single commit
+static int dc_page_compact(int page, CTAP_dc_header *header) {
+  dc_user_move move = {.page = page, .size = 0};
+  // the users first, so that each pass keeps only two files open
+  int err = write_file(dc_user_tmp_paths[page], NULL, 0, 0, 1);
+  if (err >= 0) err = store_foreach(&dc_pages[page], 0, header, dc_copy_user, &move);
+  if (err >= 0) err = fs_sync(dc_user_tmp_paths[page]);
+  if (err >= 0) err = get_file_size(dc_user_tmp_paths[page]);
+  if (err >= 0 && (uint32_t) err != move.size) err = LFS_ERR_CORRUPT;
+  if (err < 0) return err;
+  const uint32_t size = move.size;
+  move.size = 0;
+  err = store_compact(&dc_pages[page], dc_page_tmp_paths[page], header, NULL, dc_move_user, &move);
+  if (err < 0) return err;
+  if (move.size != size) return LFS_ERR_CORRUPT; // a DC became unreadable between the passes
+  return 0;
+}
+
+static bool dc_page_wasteful(int page) {
+  return store_free_count(&dc_pages[page]) >= STORE_COMPACT_MIN_FREE ||
+         dc_user_size[page] - dc_user_live[page] >= DC_USER_COMPACT_MIN_GARBAGE;
+}
+
+int ctap_compact(void) {
+  // one page or RP_FILE at a time
+  int page = 0;
+  while (page < dc_page_count && !dc_page_wasteful(page))
+    ++page;
+  if (page == dc_page_count) {
+    if (store_free_count(&rp_store) < STORE_COMPACT_MIN_FREE) return 0;
+    page = -1;
+  }
+  // settle pending operations, whose index is not remapped
+  if (ctap_consistency_check() != 0) return -1;
+  CTAP_dc_header header;
+  int err;
+  if (page >= 0) {
+    DBG_MSG("Compacting page %d\n", page);
+    err = dc_page_compact(page, &header);
+    if (err >= 0) err = dc_swap(2 * page, 2);
+    if (err >= 0) err = store_open(&dc_pages[page], &header);
+    if (err >= 0) err = get_file_size(dc_user_paths[page]);
+    if (err >= 0) dc_user_size[page] = (uint32_t) err;
+    if (err >= 0) err = dc_index_build(&header);
+  } else {
+    DBG_MSG("Compacting %d free RPs\n", store_free_count(&rp_store));
+    uint8_t remap[MAX_RP_NUM];
+    const int n = store_count(&rp_store);
+    err = store_compact(&rp_store, RP_FILE_TMP, &header, remap, NULL, NULL);
+    if (err >= 0) err = dc_swap(RP_SWAP_FILES, 1);
+    if (err >= 0) err = store_open(&rp_store, &header);
+    if (err >= 0) dc_index_remap_rp(remap, n);
+  }
+  // the old indices kept for GetNextAssertion and enumerations are invalid now
+  last_cmd = CTAP_INVALID_CMD;
+  return err < 0 ? -1 : 1;
+}
+
 uint8_t ctap_make_auth_data(uint8_t *rp_id_hash, uint8_t *buf, uint8_t flags, const uint8_t *extension,
                             size_t extension_size, size_t *len, int32_t alg_type, bool dc, uint8_t cred_protect) {
   // See https://www.w3.org/TR/webauthn/#sec-authenticator-data
@@ -592,31 +1236,21 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
   CTAP_discoverable_credential dc = {0};
   if (mc.options.rk == OPTION_TRUE) {
     DBG_MSG("Processing discoverable credential\n");
-    int size = get_file_size(DC_FILE);
-    if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    int n_dc = size / (int) sizeof(CTAP_discoverable_credential), pos, first_deleted = MAX_DC_NUM;
-    for (pos = 0; pos != n_dc; ++pos) {
-      if (read_file(DC_FILE, &dc, pos * (int) sizeof(CTAP_discoverable_credential),
-                    sizeof(CTAP_discoverable_credential)) < 0) {
-        ERR_MSG("Unable to read DC_FILE\n");
-        return CTAP2_ERR_UNHANDLED_REQUEST;
-      }
-      if (dc.deleted) {
-        if (first_deleted == MAX_DC_NUM) first_deleted = pos;
-        continue;
-      }
-      // b
-      if (memcmp_s(mc.rp_id_hash, dc.credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) == 0 &&
-          mc.user.id_size == dc.user.id_size && memcmp_s(mc.user.id, dc.user.id, mc.user.id_size) == 0)
-        break;
+    dc_user_search search = {.rp_id_hash = mc.rp_id_hash, .user = &mc.user, .dc = &dc};
+    // the meta is added with the first DC of an RP
+    CTAP_rp_meta meta;
+    CTAP_dc_header header;
+    int rp = rp_find(mc.rp_id_hash, &meta) - 1;
+    int pos = rp >= 0 ? dc_foreach(0, rp, NULL, &header, dc_match_user, &search) : 0; // b
+    if (rp < -1 || pos < 0) {
+      ERR_MSG("Unable to read DC_FILE\n");
+      return CTAP2_ERR_UNHANDLED_REQUEST;
     }
+    const bool overwrite = pos > 0;
     // d
-    if (pos == n_dc && first_deleted != MAX_DC_NUM) {
-      DBG_MSG("Use slot %d\n", first_deleted);
-      pos = first_deleted;
-    }
+    pos = overwrite ? pos - 1 : dc_next_index();
     DBG_MSG("Finally use slot %d\n", pos);
-    if (pos >= MAX_DC_NUM) {
+    if (pos < 0 || (rp < 0 && store_next_index(&rp_store) < 0)) {
       DBG_MSG("Storage full\n");
       return CTAP2_ERR_KEY_STORE_FULL;
     }
@@ -633,43 +1267,24 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
     CTAP_dc_general_attr attr;
     if (read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     attr.pending_add = 1;
-    attr.index = (uint8_t)pos;
+    attr.index = (uint16_t) pos;
+    memcpy(attr.rp_id_hash, mc.rp_id_hash, SHA256_DIGEST_LENGTH);
     if (write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    if (write_file(DC_FILE, &dc, pos * (int) sizeof(CTAP_discoverable_credential),
-                   sizeof(CTAP_discoverable_credential), 0) < 0)
-      return CTAP2_ERR_UNHANDLED_REQUEST;
 
-    // Process metadata
-    size = get_file_size(DC_META_FILE);
-    if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    int n_rp = size / (int) sizeof(CTAP_rp_meta), meta_pos;
-    CTAP_rp_meta meta;
-    first_deleted = MAX_DC_NUM;
-    for (meta_pos = 0; meta_pos != n_rp; ++meta_pos) {
-      size = read_file(DC_META_FILE, &meta, meta_pos * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      if (meta.slots == 0) { // deleted
-        if (first_deleted == MAX_DC_NUM) first_deleted = meta_pos;
-        continue;
-      }
-      if (memcmp_s(mc.rp_id_hash, meta.rp_id_hash, SHA256_DIGEST_LENGTH) == 0) break;
-    }
-    if (meta_pos == n_rp) {
-      meta.slots = 0; // a new entry's slot should be empty
-      if (first_deleted != MAX_DC_NUM) {
-        DBG_MSG("Use deleted slot %d for meta\n", first_deleted);
-        meta_pos = first_deleted;
-      }
+    // Process metadata first, which the index of the DC refers to
+    if (rp < 0) {
+      DBG_MSG("Finally use slot %d for meta\n", store_next_index(&rp_store));
+      memcpy(meta.rp_id_hash, mc.rp_id_hash, SHA256_DIGEST_LENGTH);
+      memcpy(meta.rp_id, mc.rp_id, MAX_STORED_RPID_LENGTH);
+      meta.rp_id_len = (uint8_t) mc.rp_id_len;
+      rp = store_alloc(&rp_store, &meta);
+      if (rp < 0) return rp == LFS_ERR_NOSPC ? CTAP2_ERR_KEY_STORE_FULL : CTAP2_ERR_UNHANDLED_REQUEST;
+      dc_index_set_rp(rp, mc.rp_id_hash);
     }
-    DBG_MSG("Finally use slot %d for meta\n", meta_pos);
-    memcpy(meta.rp_id_hash, mc.rp_id_hash, SHA256_DIGEST_LENGTH);
-    memcpy(meta.rp_id, mc.rp_id, MAX_STORED_RPID_LENGTH);
-    meta.rp_id_len = mc.rp_id_len;
-    meta.slots |= 1ull << pos;
-    DBG_MSG("New meta.slots =  %llu\n", meta.slots);
-    if (write_file(DC_META_FILE, &meta, meta_pos * (int) sizeof(CTAP_rp_meta),
-                   sizeof(CTAP_rp_meta), 0) < 0)
-      return CTAP2_ERR_UNHANDLED_REQUEST;
+    ret = overwrite ? dc_write(pos, &dc, true) : dc_alloc(&dc);
+    if (ret < 0) return ret == LFS_ERR_NOSPC ? CTAP2_ERR_KEY_STORE_FULL : CTAP2_ERR_UNHANDLED_REQUEST;
+    if (!overwrite) pos = ret; // the slot taken, which the pending attr above only predicted
+    dc_index_set(pos, rp, &dc.credential_id);
     attr.pending_add = 0;
     ++attr.numbers;
     if (write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
@@ -755,11 +1370,13 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
 static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t len, bool in_get_next_assertion) {
   // https://fidoalliance.org/specs/fido-v2.1-ps-20210615/fido-client-to-authenticator-protocol-v2.1-ps-20210615.html#sctn-getAssert-authnr-alg
   static CTAP_get_assertion ga;
-  static uint8_t credential_list[MAX_DC_NUM], number_of_credentials, credential_counter;
+  static uint16_t credential_list[MAX_DC_NUM_IN_ASSERTION];
+  static uint8_t number_of_credentials, credential_counter;
   static bool uv, up, user_details;
   static uint32_t timer;
 
   CTAP_discoverable_credential dc = {0}; // We use dc to store the selected credential
+  CTAP_dc_header header;
   uint8_t data_buf[sizeof(CTAP_auth_data) + CLIENT_DATA_HASH_SIZE];
   ecc_key_t key;  // TODO: cleanup
   CborParser parser;
@@ -917,8 +1534,10 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
   //    c) Update the response to include the selected credential’s publicKeyCredentialUserEntity information.
   //       User identifiable information (name, DisplayName, icon) inside the publicKeyCredentialUserEntity
   //       MUST NOT be returned if user verification is not done by the authenticator.
+  CTAP_rp_meta meta;
   if (ga.allow_list_size > 0) { // Step 11
     size_t i;
+    int rp = -2; // the slot of the meta, looked up with the first DC in the list
     for (i = 0; i < ga.allow_list_size; ++i) {
       parse_credential_descriptor(&ga.allow_list, (uint8_t *) &dc.credential_id);
       // compare the rp_id first
@@ -931,26 +1550,13 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
         if (!check_credential_protect_requirements(&dc.credential_id, true, uv)) goto next;
         if (dc.credential_id.nonce[CREDENTIAL_NONCE_DC_POS]) { // Verify if it's a valid dc.
           memcpy(data_buf, dc.credential_id.nonce, sizeof(dc.credential_id.nonce)); // use data_buf to store the nonce temporarily
-          int size = get_file_size(DC_FILE);
-          if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-          int n_dc = (int) (size / sizeof(CTAP_discoverable_credential));
-          bool found = false;
-          DBG_MSG("%d discoverable credentials\n", n_dc);
-          for (int j = 0; j < n_dc; ++j) {
-            if (read_file(DC_FILE, &dc, j * (int) sizeof(CTAP_discoverable_credential),
-                          sizeof(CTAP_discoverable_credential)) < 0)
-              return CTAP2_ERR_UNHANDLED_REQUEST;
-            if (dc.deleted) {
-              DBG_MSG("Skipped DC at %d\n", j);
-              continue;
-            }
-            if (memcmp_s(ga.rp_id_hash, dc.credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) == 0 &&
-                memcmp_s(data_buf, dc.credential_id.nonce, sizeof(dc.credential_id.nonce)) == 0) {
-              found = true;
-              break;
-            }
-          }
+          dc_nonce_search search = {.rp_id_hash = ga.rp_id_hash, .nonce = data_buf};
+          if (rp == -2) rp = rp_find(ga.rp_id_hash, &meta) - 1;
+          if (rp < -1) return CTAP2_ERR_UNHANDLED_REQUEST;
+          int found = dc_foreach(0, rp, data_buf, &header, dc_match_nonce, &search);
+          if (found < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
           DBG_MSG("matching credential_id%s found\n", (found ? "" : " not"));
+          if (found && dc_read_user(found - 1, &header, &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
           if (found) break;
           // if (!found) return CTAP2_ERR_NO_CREDENTIALS;
         } else { // not DC
@@ -968,32 +1574,17 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
     }
     number_of_credentials = 1;
   } else { // Step 12
-    int size;
     if (credential_counter == 0) {
-      size = get_file_size(DC_FILE);
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      int n_dc = (int) (size / sizeof(CTAP_discoverable_credential));
-      number_of_credentials = 0;
-      for (int i = n_dc - 1; i >= 0; --i) {  // 12-b-1
-        if (read_file(DC_FILE, &dc, i * (int) sizeof(CTAP_discoverable_credential),
-                      sizeof(CTAP_discoverable_credential)) < 0)
-          return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (dc.deleted) {
-          DBG_MSG("Skipped DC at %d\n", i);
-          continue;
-        }
-        // Skip the credential which is protected
-        if (!check_credential_protect_requirements(&dc.credential_id, false, uv)) continue;
-        if (memcmp_s(ga.rp_id_hash, dc.credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) == 0)
-          credential_list[number_of_credentials++] = i;
-      }
+      dc_assertion_search search = {.rp_id_hash = ga.rp_id_hash, .uv = uv, .list = credential_list, .count = 0};
+      const int rp = rp_find(ga.rp_id_hash, &meta) - 1;
+      if (rp < -1 || dc_foreach(0, rp, NULL, &header, dc_collect_for_assertion, &search) < 0)
+        return CTAP2_ERR_UNHANDLED_REQUEST;
+      number_of_credentials = search.count; // 12-b-1, the most recently created one first
       // 7-f
       if (number_of_credentials == 0) return CTAP2_ERR_NO_CREDENTIALS;
     }
     // fetch dc and get private key
-    if (read_file(DC_FILE, &dc, credential_list[credential_counter] * (int) sizeof(CTAP_discoverable_credential),
-                  sizeof(CTAP_discoverable_credential)) < 0)
-      return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (dc_read(credential_list[credential_counter], &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     if (verify_key_handle(&dc.credential_id, &key) != 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   }
 
@@ -1157,7 +1748,7 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
   memcpy(data_buf + len, ga.client_data_hash, CLIENT_DATA_HASH_SIZE);
   DBG_MSG("Message: ");
   PRINT_HEX(data_buf, len + CLIENT_DATA_HASH_SIZE);
-  len = sign_with_private_key(dc.credential_id.alg_type, &key, data_buf, len + CLIENT_DATA_HASH_SIZE, data_buf);
+  len = sign_with_private_key(&dc.credential_id, &key, data_buf, len + CLIENT_DATA_HASH_SIZE, data_buf);
   if (len < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   DBG_MSG("Signature: ");
   PRINT_HEX(data_buf, len);
@@ -1222,8 +1813,9 @@ static uint8_t ctap_get_next_assertion(CborEncoder *encoder) {
   return ctap_get_assertion(encoder, NULL, 0, true);
 }
 
-static uint8_t ctap_get_info(CborEncoder *encoder) {
+static uint8_t encode_get_info(CborEncoder *encoder) {
   // https://fidoalliance.org/specs/fido-v2.1-ps-20210615/fido-client-to-authenticator-protocol-v2.1-ps-20210615.html#authenticatorGetInfo
+  const uint8_t *start = encoder->data.ptr;
   CborEncoder map, sub_map;
   int ret = cbor_encoder_create_map(encoder, &map, 13);
   CHECK_CBOR_RET(ret);
@@ -1286,6 +1878,7 @@ static uint8_t ctap_get_info(CborEncoder *encoder) {
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_text_stringz(&option_map, "clientPin");
     CHECK_CBOR_RET(ret);
+    get_info_pin_pos = (uint16_t) (option_map.data.ptr - start);
     ret = cbor_encode_boolean(&option_map, has_pin());
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_text_stringz(&option_map, "largeBlobs");
@@ -1425,6 +2018,26 @@ static uint8_t ctap_get_info(CborEncoder *encoder) {
   return 0;
 }
 
+static uint8_t ctap_get_info(CborEncoder *encoder) {
+  uint8_t *start = encoder->data.ptr;
+  if (get_info_len == 0) {
+    const uint8_t ret = encode_get_info(encoder);
+    if (ret != 0) return ret;
+    const size_t len = encoder->data.ptr - start;
+    if (len <= sizeof(get_info_cache)) {
+      memcpy(get_info_cache, start, len);
+      get_info_len = (uint16_t) len;
+    }
+    return 0;
+  }
+  // to save time, we copy the encoded map manually
+  if (encoder->end - start < get_info_len) return CTAP2_ERR_INVALID_CBOR;
+  memcpy(start, get_info_cache, get_info_len);
+  start[get_info_pin_pos] = has_pin() ? 0xF5 : 0xF4; // CBOR true or false
+  encoder->data.ptr += get_info_len;
+  return 0;
+}
+
 static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size_t len) {
   CborParser parser;
   CTAP_client_pin cp;
@@ -1623,21 +2236,6 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
   return 0;
 }
 
-static int get_next_slot(uint64_t *slots, uint8_t *numbers) {
-  int idx = -1;
-  uint64_t val = *slots;
-  *numbers = 0;
-  for (int i = 0; i < 64; ++i) {
-    if (val & 1) {
-      ++*numbers;
-      if (idx == -1) idx = i;
-    }
-    val >>= 1;
-  }
-  if (idx != -1) *slots &= ~(1ull << idx);
-  return idx;
-}
-
 static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *params, size_t len) {
   static uint8_t last_cm_cmd;
 
@@ -1648,13 +2246,14 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
   ret = ctap_consistency_check();
   CHECK_PARSER_RET(ret);
 
-  static int idx, n_rp; // for rp enumeration
-  static uint64_t slots; // for credential enumeration
+  static int idx; // for rp and credential enumeration
+  static int enum_rp; // the slot of the meta for credential enumeration
   int size, counter;
   CborEncoder map, sub_map;
-  uint8_t numbers = 0;
+  uint16_t numbers = 0;
   CTAP_rp_meta meta;
   CTAP_discoverable_credential dc;
+  CTAP_dc_header header;
   bool include_numbers;
 
   if (cm.sub_command == CM_CMD_GET_CREDS_METADATA ||
@@ -1692,7 +2291,7 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
       CHECK_CBOR_RET(ret);
       ret = cbor_encode_int(&map, CM_RESP_MAX_POSSIBLE_REMAINING_RESIDENT_CREDENTIALS_COUNT);
       CHECK_CBOR_RET(ret);
-      ret = cbor_encode_int(&map, MAX_DC_NUM - numbers);
+      ret = cbor_encode_int(&map, dc_remaining(numbers));
       CHECK_CBOR_RET(ret);
       ret = cbor_encoder_close_container(encoder, &map);
       CHECK_CBOR_RET(ret);
@@ -1701,20 +2300,11 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
     case CM_CMD_ENUMERATE_RPS_BEGIN:
       if (cp_has_associated_rp_id()) return CTAP2_ERR_PIN_AUTH_INVALID;
       if (numbers == 0) return CTAP2_ERR_NO_CREDENTIALS;
-      size = get_file_size(DC_META_FILE), counter = 0;
-      n_rp = size / (int) sizeof(CTAP_rp_meta);
-      KEEPALIVE();
-      for (int i = n_rp - 1; i >= 0; --i) {
-        size = read_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (meta.slots > 0) {
-          idx = i;
-          ++counter;
-        }
-      }
+      counter = store_live_count(&rp_store);
       DBG_MSG("%d RPs found\n", counter);
-      size = read_file(DC_META_FILE, &meta, idx * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      size = rp_read_next(0, &meta);
+      if (size <= 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      idx = size - 1;
       ret = cbor_encoder_create_map(encoder, &map, 3);
       CHECK_CBOR_RET(ret);
       ret = cbor_encode_int(&map, CM_RESP_RP);
@@ -1746,14 +2336,11 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
         return CTAP2_ERR_NOT_ALLOWED;
       }
       last_cm_cmd = cm.sub_command;
-      for (int i = idx + 1; i < n_rp; ++i) {
-        size = read_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (meta.slots > 0) {
-          DBG_MSG("Fetch RP at %d\n", i);
-          idx = i;
-          break;
-        }
+      size = rp_read_next(idx + 1, &meta);
+      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (size > 0) {
+        idx = size - 1;
+        DBG_MSG("Fetch RP at %d\n", idx);
       }
       ret = cbor_encoder_create_map(encoder, &map, 2);
       CHECK_CBOR_RET(ret);
@@ -1779,28 +2366,21 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
       if (!cp_verify_rp_id(cm.rp_id_hash)) return CTAP2_ERR_PIN_AUTH_INVALID;
       if (numbers == 0) return CTAP2_ERR_NO_CREDENTIALS;
       include_numbers = true;
-      size = get_file_size(DC_META_FILE);
-      n_rp = size / (int) sizeof(CTAP_rp_meta);
       KEEPALIVE();
-      for (idx = 0; idx < n_rp; ++idx) {
-        size = read_file(DC_META_FILE, &meta, idx * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (meta.slots == 0) continue;
-        if (memcmp_s(meta.rp_id_hash, cm.rp_id_hash, SHA256_DIGEST_LENGTH) == 0) break;
-      }
-      if (idx == n_rp) {
+      enum_rp = rp_find(cm.rp_id_hash, &meta) - 1;
+      if (enum_rp < -1) return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (dc_index_rp_count(enum_rp) == 0) {
         DBG_MSG("Specified RP not found\n");
         return CTAP2_ERR_NO_CREDENTIALS;
       }
-      DBG_MSG("Use meta at slot %d: ", idx);
-      PRINT_HEX((const uint8_t *) &meta, sizeof(meta));
-      slots = meta.slots;
+      numbers = (uint16_t) dc_index_rp_count(enum_rp);
+      idx = -1;
     generate_credential_response:
-      DBG_MSG("Current slot bitmap: 0x%llx\n", slots);
-      idx = get_next_slot(&slots, &numbers);
-      size = read_file(DC_FILE, &dc, idx * (int) sizeof(CTAP_discoverable_credential),
-                       sizeof(CTAP_discoverable_credential));
+      size = dc_foreach(idx + 1, enum_rp, NULL, &header, first_record, NULL);
       if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (size == 0) return CTAP2_ERR_NO_CREDENTIALS;
+      idx = size - 1;
+      if (dc_read_user(idx, &header, &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       DBG_MSG("Slot %d printed\n", idx);
       ret = cbor_encoder_create_map(encoder, &map, 4 + (uint8_t)include_numbers + (uint8_t)dc.has_large_blob_key);
       CHECK_CBOR_RET(ret);
@@ -1845,10 +2425,7 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
       ret = verify_key_handle(&dc.credential_id, &key);
       if (ret != 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       key_type_t key_type = cose_alg_to_key_type(dc.credential_id.alg_type);
-      if (ecc_complete_key(key_type, &key) < 0) {
-        ERR_MSG("Failed to complete key\n");
-        return -1;
-      }
+      if (complete_credential_key(&dc.credential_id, &key, NULL) < 0) return -1;
       uint8_t *ptr = sub_map.data.ptr - 1;
       memcpy(ptr, key.pub, PUBLIC_KEY_LENGTH[key_type]);
       if (dc.credential_id.alg_type == COSE_ALG_ES256) {
@@ -1898,52 +2475,27 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
     case CM_CMD_DELETE_CREDENTIAL:
       if (!cp_verify_rp_id(cm.credential_id.rp_id_hash)) return CTAP2_ERR_PIN_AUTH_INVALID;
       if (numbers == 0) return CTAP2_ERR_NO_CREDENTIALS;
-      size = get_file_size(DC_FILE);
+      size = dc_find(&cm.credential_id, &header);
       if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      numbers = size / sizeof(CTAP_discoverable_credential);
-      for (idx = 0; idx < numbers; ++idx) {
-        size = read_file(DC_FILE, &dc, idx * (int) sizeof(CTAP_discoverable_credential),
-                         sizeof(CTAP_discoverable_credential));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (dc.deleted) continue;
-        if (memcmp_s(&dc.credential_id, &cm.credential_id, sizeof(credential_id)) == 0) {
-          DBG_MSG("Found, credential_id: ");
-          PRINT_HEX((const uint8_t *) &dc.credential_id, sizeof(credential_id));
-          break;
-        }
-      }
-      if (idx == numbers) return CTAP2_ERR_NO_CREDENTIALS;
+      if (size == 0) return CTAP2_ERR_NO_CREDENTIALS;
+      idx = size - 1;
+      DBG_MSG("Found, credential_id: ");
+      PRINT_HEX((const uint8_t *) &header.credential_id, sizeof(credential_id));
 
       CTAP_dc_general_attr attr;
       if (read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      attr.index = (uint8_t)idx;
+      attr.index = (uint16_t) idx;
+      memcpy(attr.rp_id_hash, cm.credential_id.rp_id_hash, SHA256_DIGEST_LENGTH);
       attr.pending_delete = 1;
       if (write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
 
       // delete dc first
-      dc.deleted = true;
-      if (write_file(DC_FILE, &dc, idx * (int) sizeof(CTAP_discoverable_credential),
-                     sizeof(CTAP_discoverable_credential),
-                     0) < 0)
-        return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (dc_delete(idx) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      dc_index_remove(idx);
       DBG_MSG("Slot %d deleted\n", idx);
       // delete the meta then
-      size = get_file_size(DC_META_FILE);
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      numbers = size / sizeof(CTAP_rp_meta);
       KEEPALIVE();
-      for (int i = 0; i < numbers; ++i) {
-        size = read_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (memcmp_s(meta.rp_id_hash, cm.credential_id.rp_id_hash, SHA256_DIGEST_LENGTH) == 0) {
-          DBG_MSG("Orig slot bitmap: 0x%llx\n", meta.slots);
-          meta.slots &= ~(1ull << idx);
-          DBG_MSG("New slot bitmap: 0x%llx\n", meta.slots);
-          size = write_file(DC_META_FILE, &meta, i * (int) sizeof(CTAP_rp_meta), sizeof(CTAP_rp_meta), 0);
-          if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-          break;
-        }
-      }
+      if (rp_release(cm.credential_id.rp_id_hash) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       attr.numbers--;
       attr.pending_delete = 0;
       if (write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
@@ -1952,35 +2504,23 @@ static uint8_t ctap_credential_management(CborEncoder *encoder, const uint8_t *p
     case CM_CMD_UPDATE_USER_INFORMATION:
       if (!cp_verify_rp_id(cm.credential_id.rp_id_hash)) return CTAP2_ERR_PIN_AUTH_INVALID;
       if (numbers == 0) return CTAP2_ERR_NO_CREDENTIALS;
-      // TODO: refactor this
-      size = get_file_size(DC_FILE);
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      numbers = size / sizeof(CTAP_discoverable_credential);
       KEEPALIVE();
-      for (idx = 0; idx < numbers; ++idx) {
-        size = read_file(DC_FILE, &dc, idx * (int) sizeof(CTAP_discoverable_credential),
-                         sizeof(CTAP_discoverable_credential));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (dc.deleted) continue;
-        if (memcmp_s(&dc.credential_id, &cm.credential_id, sizeof(credential_id)) == 0) {
-          DBG_MSG("Found, credential_id: ");
-          PRINT_HEX((const uint8_t *) &dc.credential_id, sizeof(credential_id));
-          break;
-        }
-      }
-      if (idx == numbers) {
+      size = dc_find(&cm.credential_id, &header);
+      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (size == 0) {
         DBG_MSG("No matching credential\n");
         return CTAP2_ERR_NO_CREDENTIALS;
       }
+      idx = size - 1;
+      DBG_MSG("Found, credential_id: ");
+      PRINT_HEX((const uint8_t *) &header.credential_id, sizeof(credential_id));
+      if (dc_read_user(idx, &header, &dc) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       if (dc.user.id_size != cm.user.id_size || memcmp_s(&dc.user.id, &cm.user.id, dc.user.id_size) != 0) {
         DBG_MSG("Incorrect user id\n");
         return CTAP1_ERR_INVALID_PARAMETER;
       }
       memcpy(&dc.user, &cm.user, sizeof(user_entity));
-      if (write_file(DC_FILE, &dc, idx * (int) sizeof(CTAP_discoverable_credential),
-                     sizeof(CTAP_discoverable_credential),
-                     0) < 0)
-        return CTAP2_ERR_UNHANDLED_REQUEST;
+      if (dc_write(idx, &dc, false) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
       DBG_MSG("Slot %d updated\n", idx);
       break;
   }
@@ -2004,6 +2544,7 @@ static uint8_t ctap_reset_data(void) {
 
 static uint8_t ctap_large_blobs(CborEncoder *encoder, const uint8_t *params, size_t len) {
   static uint16_t expectedNextOffset, expectedLength;
+  _Static_assert(LARGE_BLOB_SIZE_LIMIT <= UINT16_MAX, "LARGE_BLOB_SIZE_LIMIT overflows the offsets");
 
   CborParser parser;
   CborEncoder map;
@@ -2127,7 +2668,8 @@ static uint8_t ctap_large_blobs(CborEncoder *encoder, const uint8_t *params, siz
     //    g) If the value of offset is zero, prepare a buffer to receive a new serialized large-blob array.
     //    h) Append the value of set to the buffer containing the pending serialized large-blob array.
     KEEPALIVE();
-    if (write_file(LB_FILE_TMP, lb.set, lb.offset, lb.set_len, lb.offset == 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    ret = write_file(LB_FILE_TMP, lb.set, lb.offset, lb.set_len, lb.offset == 0);
+    if (ret < 0) return ret == LFS_ERR_NOSPC ? CTAP2_ERR_LARGE_BLOB_STORAGE_FULL : CTAP2_ERR_UNHANDLED_REQUEST;
     //    i) Update expectedNextOffset to be the new length of the pending serialized large-blob array.
     expectedNextOffset += lb.set_len;
     //    j) If the length of the pending serialized large-blob array is equal to expectedLength:
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "dc-index.h"
+#include <store.h>
+
+#define DC_INDEX_NIL 0xFFFF
+
+_Static_assert(MAX_DC_NUM < DC_INDEX_NIL, "too many DCs for the index");
+_Static_assert(MAX_RP_NUM <= UINT8_MAX, "too many RPs for the index");
+
+typedef struct {
+  uint8_t rp;
+  uint16_t nonce_tag;
+  uint16_t next; // the next DC of the RP, in ascending order
+} dc_index_entry;
+
+typedef struct {
+  uint16_t tag;
+  uint16_t count;
+  uint16_t head; // the first DC of the RP
+} dc_index_rp;
+
+static dc_index_entry entries[MAX_DC_NUM];
+static dc_index_rp rps[MAX_RP_NUM];
+static uint8_t live[(MAX_DC_NUM + 7) / 8], rp_live[(MAX_RP_NUM + 7) / 8];
+
+static uint16_t tag(const uint8_t *data) { return (uint16_t) (data[0] << 8 | data[1]); }
+
+static bool is_live(int slot) { return live[slot / 8] & (1 << (slot % 8)); }
+
+static bool is_rp_live(int rp) { return rp_live[rp / 8] & (1 << (rp % 8)); }
+
+void dc_index_clear(void) {
+  memset(live, 0, sizeof(live));
+  memset(rp_live, 0, sizeof(rp_live));
+}
+
+void dc_index_set_rp(int rp, const uint8_t *rp_id_hash) {
+  if (rp < 0 || rp >= MAX_RP_NUM) return;
+  dc_index_remove_rp(rp);
+  rps[rp].tag = tag(rp_id_hash);
+  rps[rp].count = 0;
+  rps[rp].head = DC_INDEX_NIL;
+  rp_live[rp / 8] |= 1 << (rp % 8);
+}
+
+void dc_index_remove_rp(int rp) {
+  if (rp < 0 || rp >= MAX_RP_NUM || !is_rp_live(rp)) return;
+  for (uint16_t slot = rps[rp].head; slot != DC_INDEX_NIL; slot = entries[slot].next)
+    live[slot / 8] &= ~(1 << (slot % 8));
+  rp_live[rp / 8] &= ~(1 << (rp % 8));
+}
+
+int dc_index_next_rp(int from, const uint8_t *rp_id_hash) {
+  for (int rp = from < 0 ? 0 : from; rp < MAX_RP_NUM; ++rp)
+    if (is_rp_live(rp) && (rp_id_hash == NULL || rps[rp].tag == tag(rp_id_hash))) return rp;
+  return -1;
+}
+
+void dc_index_remap_rp(const uint8_t *remap, int n) {
+  // a compaction only moves the RPs downwards, so the ascending walk never overwrites one not moved yet
+  uint8_t moved[(MAX_RP_NUM + 7) / 8] = {0};
+  for (int rp = 0; rp < n && rp < MAX_RP_NUM; ++rp) {
+    if (!is_rp_live(rp) || remap[rp] == STORE_NIL) continue;
+    const int to = remap[rp];
+    rps[to] = rps[rp];
+    for (uint16_t slot = rps[to].head; slot != DC_INDEX_NIL; slot = entries[slot].next)
+      entries[slot].rp = (uint8_t) to;
+    moved[to / 8] |= 1 << (to % 8);
+  }
+  memcpy(rp_live, moved, sizeof(rp_live));
+}
+
+int dc_index_rp_count(int rp) {
+  if (rp < 0 || rp >= MAX_RP_NUM || !is_rp_live(rp)) return 0;
+  return rps[rp].count;
+}
+
+void dc_index_remove(int slot) {
+  if (slot < 0 || slot >= MAX_DC_NUM || !is_live(slot)) return;
+  dc_index_rp *rp = &rps[entries[slot].rp];
+  uint16_t *link = &rp->head;
+  while (*link != slot)
+    link = &entries[*link].next;
+  *link = entries[slot].next;
+  --rp->count;
+  live[slot / 8] &= ~(1 << (slot % 8));
+}
+
+void dc_index_set(int slot, int rp, const credential_id *id) {
+  if (slot < 0 || slot >= MAX_DC_NUM || rp < 0 || rp >= MAX_RP_NUM || !is_rp_live(rp)) return;
+  dc_index_remove(slot);
+  entries[slot].rp = (uint8_t) rp;
+  entries[slot].nonce_tag = tag(id->nonce);
+  uint16_t *link = &rps[rp].head;
+  while (*link != DC_INDEX_NIL && *link < slot)
+    link = &entries[*link].next;
+  entries[slot].next = *link;
+  *link = (uint16_t) slot;
+  ++rps[rp].count;
+  live[slot / 8] |= 1 << (slot % 8);
+}
+
+int dc_index_next(int from, int rp, const uint8_t *nonce) {
+  if (rp < 0 || rp >= MAX_RP_NUM || !is_rp_live(rp)) return -1;
+  if (from < 0) from = 0;
+  // continue after the slot returned last time, so that a walk through an RP is linear
+  uint16_t slot = rps[rp].head;
+  if (from > 0 && from <= MAX_DC_NUM && is_live(from - 1) && entries[from - 1].rp == rp) slot = entries[from - 1].next;
+  for (; slot != DC_INDEX_NIL; slot = entries[slot].next) {
+    if (slot < from) continue;
+    if (nonce != NULL && entries[slot].nonce_tag != tag(nonce)) continue;
+    return slot;
+  }
+  return -1;
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef CANOKEY_CORE_FIDO2_DC_INDEX_H_
+#define CANOKEY_CORE_FIDO2_DC_INDEX_H_
+
+#include "ctap-internal.h"
+
+/*
+ * A RAM index of the discoverable credentials and of the RPs they belong to.
+ * Each RP, keyed by its slot in RP_FILE, holds a 16-bit tag of its rp_id_hash,
+ * the number of its DCs and a list of them in ascending order. Each DC holds
+ * its RP and a 16-bit tag of its nonce. So an enumeration reads only the
+ * records it returns, and a lookup by nonce only reads the DCs whose tags
+ * match. Tags may collide, so the caller still compares the full record.
+ */
+
+void dc_index_clear(void);
+void dc_index_set_rp(int rp, const uint8_t *rp_id_hash);
+// also drops the DCs of the RP
+void dc_index_remove_rp(int rp);
+// the next live RP from `from` on whose tag matches rp_id_hash, or any if NULL; -1 if none
+int dc_index_next_rp(int from, const uint8_t *rp_id_hash);
+// move the RPs after a store_compact of RP_FILE, see its remap
+void dc_index_remap_rp(const uint8_t *remap, int n);
+int dc_index_rp_count(int rp);
+void dc_index_set(int slot, int rp, const credential_id *id);
+void dc_index_remove(int slot);
+// the next live slot from `from` on which belongs to rp and may have nonce, if not NULL; -1 if none
+int dc_index_next(int from, int rp, const uint8_t *nonce);
+
+#endif // CANOKEY_CORE_FIDO2_DC_INDEX_H_
@@ -16,8 +16,20 @@ extern CTAP_sm2_attr ctap_sm2_attr;
 
 static uint8_t pin_token[PIN_TOKEN_SIZE];
 static ecc_key_t ka_key;
+// the last shared secret of cp_decapsulate, valid until cp_regenerate or for CTAP_SHARED_SECRET_TIMEOUT ms
+static uint8_t shared_peer[PUB_KEY_SIZE], shared_secret[SHARED_SECRET_SIZE_P2];
+static uint8_t shared_protocol; // 0 if nothing cached
+static uint32_t shared_time;
 static uint8_t permissions_rp_id[SHA256_DIGEST_LENGTH + 1]; // the first byte indicates nullable (0: null, 1: not null)
 static uint8_t permissions;
+// KH_KEY_ATTR and HE_KEY_ATTR, read on first use and kept until ctap_install,
+// or until they have not been used for CTAP_SECRET_CACHE_TIMEOUT ms
+static uint8_t cached_kh_key[KH_KEY_SIZE], cached_he_key[HE_KEY_SIZE];
+static bool kh_key_cached, he_key_cached;
+static uint32_t secret_last_use;
+// the signature counter hands out sign_ctr_next..sign_ctr_limit from RAM, see increase_counter
+static uint32_t sign_ctr_next, sign_ctr_limit;
+static bool sign_ctr_loaded;
 static bool in_use;
 static bool user_verified;
 static bool user_present;
@@ -95,7 +107,13 @@ void cp_initialize(void) {
   cp_reset_pin_uv_auth_token();
 }
 
+static void drop_shared_secret(void) {
+  memzero(shared_secret, sizeof(shared_secret));
+  shared_protocol = 0;
+}
+
 void cp_regenerate(void) {
+  drop_shared_secret();
   ecc_generate(SECP256R1, &ka_key);
   DBG_MSG("Regenerate:\nPri: ");
   PRINT_HEX(ka_key.pri, PRIVATE_KEY_LENGTH[SECP256R1]);
@@ -113,6 +131,15 @@ void cp_get_public_key(uint8_t *buf) {
 }
 
 int cp_decapsulate(uint8_t *buf, int pin_protocol) {
+  const size_t secret_len = pin_protocol == 1 ? SHARED_SECRET_SIZE_P1 : SHARED_SECRET_SIZE_P2;
+  // a platform usually sends the same key agreement in all subcommands of one flow
+  if (shared_protocol == pin_protocol && device_get_tick() - shared_time < CTAP_SHARED_SECRET_TIMEOUT &&
+      memcmp_s(shared_peer, buf, sizeof(shared_peer)) == 0) {
+    memcpy(buf, shared_secret, secret_len);
+    return 0;
+  }
+  drop_shared_secret();
+  memcpy(shared_peer, buf, sizeof(shared_peer));
   int ret = ecdh(SECP256R1, ka_key.pri, buf, buf);
   DBG_MSG("ECDH: ");
   PRINT_HEX(buf, PUBLIC_KEY_LENGTH[SECP256R1]);
@@ -121,6 +148,9 @@ int cp_decapsulate(uint8_t *buf, int pin_protocol) {
     sha256_raw(buf, PRI_KEY_SIZE, buf);
   else
     cp2_kdf(buf, PRI_KEY_SIZE, buf);
+  memcpy(shared_secret, buf, secret_len);
+  shared_protocol = (uint8_t) pin_protocol;
+  shared_time = device_get_tick();
   return 0;
 }
 
@@ -221,36 +251,103 @@ key_type_t cose_alg_to_key_type(int alg) {
   }
 }
 
+typedef struct {
+  uint8_t nonce[CREDENTIAL_NONCE_SIZE + 2]; // including the dc and cp bytes, which the private key depends on
+  uint8_t pub[PUB_KEY_SIZE];
+  uint8_t key_type; // KEY_TYPE_PKC_END if unused
+} key_pool_entry;
+
+/*
+ * Nonces and public keys of credentials generated in idle time, so that the scalar multiplication is
+ * not done while the host waits for a registration. The private keys are derived again when an entry
+ * is taken, and the tag depends on the rp, so an entry holds no secret. Each key type is filled for
+ * the dc and cp bytes it was last requested with.
+ */
+static const key_type_t key_pool_types[] = {SECP256R1, ED25519, SM2};
+#define KEY_POOL_TYPES (sizeof(key_pool_types) / sizeof(key_pool_types[0]))
+#define KEY_POOL_SIZE  ((int) (KEY_POOL_TYPES * KEY_POOL_SIZE_PER_TYPE))
+static key_pool_entry key_pool[KEY_POOL_SIZE + 1]; // the extra entry is never used, and keeps the array non-empty
+static uint8_t key_pool_dc[KEY_POOL_TYPES], key_pool_cp[KEY_POOL_TYPES];
+static uint32_t key_pool_filled; // the tick of the last key generated in idle time
+
+static int key_pool_type_index(key_type_t key_type) {
+  for (size_t i = 0; i < KEY_POOL_TYPES; ++i)
+    if (key_pool_types[i] == key_type) return (int) i;
+  return -1;
+}
+
+void drop_key_pool(void) {
+  memzero(key_pool, sizeof(key_pool));
+  for (int i = 0; i < KEY_POOL_SIZE; ++i) key_pool[i].key_type = KEY_TYPE_PKC_END;
+  memset(key_pool_dc, 0, sizeof(key_pool_dc));
+  memset(key_pool_cp, CRED_PROTECT_VERIFICATION_OPTIONAL, sizeof(key_pool_cp));
+}
+
 static int read_device_pri_key(uint8_t *pri_key) {
   int ret = read_attr(CTAP_CERT_FILE, KEY_ATTR, pri_key, PRI_KEY_SIZE);
   if (ret < 0) return ret;
   return 0;
 }
 
-static int read_kh_key(uint8_t *kh_key) {
-  int ret = read_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, KH_KEY_SIZE);
-  if (ret < 0) return ret;
+void drop_cached_secrets(void) {
+  memzero(cached_kh_key, sizeof(cached_kh_key));
+  memzero(cached_he_key, sizeof(cached_he_key));
+  kh_key_cached = false;
+  he_key_cached = false;
+}
+
+void ctap_expire_secrets(void) {
+  if (shared_protocol != 0 && device_get_tick() - shared_time >= CTAP_SHARED_SECRET_TIMEOUT) drop_shared_secret();
+#if CTAP_SECRET_CACHE_TIMEOUT > 0
+  if ((kh_key_cached || he_key_cached) && device_get_tick() - secret_last_use >= CTAP_SECRET_CACHE_TIMEOUT)
+    drop_cached_secrets();
+#endif
+}
+
+static int read_cached_secret(uint8_t attr, uint8_t *cache, bool *cached, uint8_t *out, size_t len) {
+  ctap_expire_secrets();
+  if (!*cached) {
+    int ret = read_attr(CTAP_CERT_FILE, attr, cache, len);
+    if (ret < 0) return ret;
+    *cached = true;
+  }
+  secret_last_use = device_get_tick();
+  memcpy(out, cache, len);
   return 0;
 }
 
+static int read_kh_key(uint8_t *kh_key) {
+  return read_cached_secret(KH_KEY_ATTR, cached_kh_key, &kh_key_cached, kh_key, KH_KEY_SIZE);
+}
+
 static int read_he_key(uint8_t *he_key) {
-  int ret = read_attr(CTAP_CERT_FILE, HE_KEY_ATTR, he_key, HE_KEY_SIZE);
-  if (ret < 0) return ret;
-  return 0;
+  return read_cached_secret(HE_KEY_ATTR, cached_he_key, &he_key_cached, he_key, HE_KEY_SIZE);
 }
 
+void drop_counter_reservation(void) { sign_ctr_loaded = false; }
+
+// SIGN_CTR_ATTR holds the last value of the reserved block, any value up to it may have been handed out.
 int increase_counter(uint32_t *counter) {
-  int ret = read_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, counter, sizeof(uint32_t));
-  if (ret < 0) return ret;
-  ++*counter;
-  ret = write_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, counter, sizeof(uint32_t));
-  if (ret < 0) return ret;
+  if (!sign_ctr_loaded) {
+    int ret = read_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, &sign_ctr_limit, sizeof(uint32_t));
+    if (ret < 0) return ret;
+    sign_ctr_next = sign_ctr_limit + 1;
+    sign_ctr_loaded = true;
+  }
+  if (sign_ctr_next > sign_ctr_limit) {
+    const uint32_t limit =
+        sign_ctr_limit > UINT32_MAX - SIGN_CTR_RESERVATION ? UINT32_MAX : sign_ctr_limit + SIGN_CTR_RESERVATION;
+    if (limit == sign_ctr_limit) return -1; // exhausted
+    int ret = write_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, &limit, sizeof(uint32_t));
+    if (ret < 0) return ret;
+    sign_ctr_limit = limit;
+  }
+  *counter = sign_ctr_next++;
   return 0;
 }
 
-static void generate_credential_id_nonce_tag(credential_id *kh, uint8_t kh_key[KH_KEY_SIZE], ecc_key_t *key) {
+static void derive_credential_id_tag(credential_id *kh, uint8_t kh_key[KH_KEY_SIZE], ecc_key_t *key) {
   // works for ECC algorithms with a 256-bit private key
-  random_buffer(kh->nonce, CREDENTIAL_NONCE_SIZE);
   // private key = hmac-sha256(device private key, nonce)
   hmac_sha256(kh_key, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), key->pri);
   DBG_MSG("Device key: ");
@@ -264,6 +361,121 @@ static void generate_credential_id_nonce_tag(credential_id *kh, uint8_t kh_key[K
   memcpy(kh->tag, key->pub, sizeof(kh->tag));
 }
 
+static void generate_credential_id_nonce_tag(credential_id *kh, uint8_t kh_key[KH_KEY_SIZE], ecc_key_t *key) {
+  random_buffer(kh->nonce, CREDENTIAL_NONCE_SIZE);
+  derive_credential_id_tag(kh, kh_key, key);
+}
+
+// take a pooled nonce and public key for the key type and the dc and cp bytes in kh->nonce
+typedef struct {
+  uint8_t nonce[CREDENTIAL_NONCE_SIZE + 2];
+  uint8_t pub[PUB_KEY_SIZE];
+  uint8_t z[SM3_DIGEST_LENGTH]; // for SM2
+  uint8_t key_type; // KEY_TYPE_PKC_END if unused
+  uint32_t last_use;
+} pub_key_cache_entry;
+
+/*
+ * Public keys of the credentials used last, so that the scalar multiplication to recover the public key, and
+ * for SM2 the Z value, is done once for repeated assertions. The private key is derived from the nonce only,
+ * so the nonce and the key type identify the public key.
+ */
+static pub_key_cache_entry pub_key_cache[PUB_KEY_CACHE_SIZE];
+static uint32_t pub_key_cache_clock;
+
+void drop_pub_key_cache(void) {
+  memzero(pub_key_cache, sizeof(pub_key_cache));
+  for (int i = 0; i < PUB_KEY_CACHE_SIZE; ++i) pub_key_cache[i].key_type = KEY_TYPE_PKC_END;
+}
+
+int complete_credential_key(const credential_id *kh, ecc_key_t *key, uint8_t *z) {
+  const key_type_t key_type = cose_alg_to_key_type(kh->alg_type);
+  if (key_type == KEY_TYPE_PKC_END) return -1;
+  pub_key_cache_entry *entry = &pub_key_cache[0];
+  for (int i = 0; i < PUB_KEY_CACHE_SIZE; ++i) {
+    pub_key_cache_entry *e = &pub_key_cache[i];
+    if (e->key_type == key_type && memcmp(e->nonce, kh->nonce, sizeof(e->nonce)) == 0) {
+      e->last_use = ++pub_key_cache_clock;
+      memcpy(key->pub, e->pub, PUBLIC_KEY_LENGTH[key_type]);
+      if (z != NULL) memcpy(z, e->z, SM3_DIGEST_LENGTH);
+      return 0;
+    }
+    if (entry->key_type != KEY_TYPE_PKC_END && (e->key_type == KEY_TYPE_PKC_END || e->last_use < entry->last_use))
+      entry = e; // an unused entry, or else the least recently used one
+  }
+  if (ecc_complete_key(key_type, key) < 0) {
+    ERR_MSG("Failed to complete key\n");
+    return -1;
+  }
+  memzero(entry, sizeof(pub_key_cache_entry));
+  if (key_type == SM2) sm2_z(SM2_ID_DEFAULT, key, entry->z);
+  memcpy(entry->nonce, kh->nonce, sizeof(entry->nonce));
+  memcpy(entry->pub, key->pub, PUBLIC_KEY_LENGTH[key_type]);
+  entry->key_type = key_type;
+  entry->last_use = ++pub_key_cache_clock;
+  if (z != NULL) memcpy(z, entry->z, SM3_DIGEST_LENGTH);
+  return 0;
+}
+
+static bool key_pool_take(key_type_t key_type, credential_id *kh, uint8_t *pubkey) {
+  const int t = key_pool_type_index(key_type);
+  if (t < 0) return false;
+  key_pool_dc[t] = kh->nonce[CREDENTIAL_NONCE_DC_POS];
+  key_pool_cp[t] = kh->nonce[CREDENTIAL_NONCE_CP_POS];
+  for (int i = 0; i < KEY_POOL_SIZE; ++i) {
+    key_pool_entry *entry = &key_pool[i];
+    if (entry->key_type != key_type || entry->nonce[CREDENTIAL_NONCE_DC_POS] != key_pool_dc[t] ||
+        entry->nonce[CREDENTIAL_NONCE_CP_POS] != key_pool_cp[t])
+      continue;
+    memcpy(kh->nonce, entry->nonce, sizeof(kh->nonce));
+    memcpy(pubkey, entry->pub, PUBLIC_KEY_LENGTH[key_type]);
+    memzero(entry, sizeof(key_pool_entry));
+    entry->key_type = KEY_TYPE_PKC_END;
+    return true;
+  }
+  return false;
+}
+
+int ctap_fill_key_pool(void) {
+  // one scalar multiplication per interval, so that a host coming back does not wait for a whole refill
+  if (device_get_tick() - key_pool_filled < KEY_POOL_REFILL_INTERVAL) return 0;
+  for (size_t t = 0; t < KEY_POOL_TYPES; ++t) {
+    const key_type_t key_type = key_pool_types[t];
+    if (key_type == SM2 && !ctap_sm2_attr.enabled) continue;
+    // reuse a free entry, or one generated for other dc and cp bytes of this type
+    int count = 0, slot = -1;
+    for (int i = 0; i < KEY_POOL_SIZE; ++i) {
+      const key_pool_entry *entry = &key_pool[i];
+      if (entry->key_type == key_type && entry->nonce[CREDENTIAL_NONCE_DC_POS] == key_pool_dc[t] &&
+          entry->nonce[CREDENTIAL_NONCE_CP_POS] == key_pool_cp[t])
+        ++count;
+      else if (entry->key_type == KEY_TYPE_PKC_END || entry->key_type == key_type)
+        slot = i;
+    }
+    if (count >= KEY_POOL_SIZE_PER_TYPE || slot < 0) continue;
+
+    // the kh key is read directly, so that the idle work does not keep the cached one alive
+    uint8_t kh_key[KH_KEY_SIZE];
+    if (read_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, KH_KEY_SIZE) < 0) return -1;
+    credential_id kh = {0};
+    ecc_key_t key;
+    kh.nonce[CREDENTIAL_NONCE_DC_POS] = key_pool_dc[t];
+    kh.nonce[CREDENTIAL_NONCE_CP_POS] = key_pool_cp[t];
+    do {
+      generate_credential_id_nonce_tag(&kh, kh_key, &key);
+    } while (ecc_complete_key(key_type, &key) < 0);
+    memzero(kh_key, sizeof(kh_key));
+    key_pool_entry *entry = &key_pool[slot];
+    memcpy(entry->nonce, kh.nonce, sizeof(entry->nonce));
+    memcpy(entry->pub, key.pub, PUBLIC_KEY_LENGTH[key_type]);
+    entry->key_type = key_type;
+    memzero(&key, sizeof(key));
+    key_pool_filled = device_get_tick();
+    return 1;
+  }
+  return 0;
+}
+
 bool check_credential_protect_requirements(credential_id *kh, bool with_cred_list, bool uv) {
   DBG_MSG("credProtect: %hhu\n", kh->nonce[CREDENTIAL_NONCE_CP_POS]);
   if (kh->nonce[CREDENTIAL_NONCE_CP_POS] == CRED_PROTECT_VERIFICATION_OPTIONAL_WITH_CREDENTIAL_ID_LIST) {
@@ -296,12 +508,17 @@ int generate_key_handle(credential_id *kh, uint8_t *pubkey, int32_t alg_type, ui
 
   const int ret = read_kh_key(kh_key);
   if (ret < 0) return ret;
-  do {
-    generate_credential_id_nonce_tag(kh, kh_key, &key);
-  } while (ecc_complete_key(key_type, &key) < 0);
-  memzero(kh_key, KH_KEY_SIZE);
+  if (key_pool_take(key_type, kh, pubkey)) {
+    derive_credential_id_tag(kh, kh_key, &key);
+    memzero(kh_key, KH_KEY_SIZE);
+  } else {
+    do {
+      generate_credential_id_nonce_tag(kh, kh_key, &key);
+    } while (ecc_complete_key(key_type, &key) < 0);
+    memzero(kh_key, KH_KEY_SIZE);
+    memcpy(pubkey, key.pub, PUBLIC_KEY_LENGTH[key_type]);
+  }
 
-  memcpy(pubkey, key.pub, PUBLIC_KEY_LENGTH[key_type]);
   DBG_MSG("Public: ");
   PRINT_HEX(pubkey, PUBLIC_KEY_LENGTH[key_type]);
   memzero(&key, sizeof(key));
@@ -340,8 +557,8 @@ size_t sign_with_device_key(const uint8_t *input, size_t input_len, uint8_t *sig
   return ecdsa_sig2ansi(PRI_KEY_SIZE, sig, sig);
 }
 
-int sign_with_private_key(int32_t alg_type, ecc_key_t *key, const uint8_t *input, size_t len, uint8_t *sig) {
-  const key_type_t key_type = cose_alg_to_key_type(alg_type);
+int sign_with_private_key(const credential_id *kh, ecc_key_t *key, const uint8_t *input, size_t len, uint8_t *sig) {
+  const key_type_t key_type = cose_alg_to_key_type(kh->alg_type);
   DBG_MSG("Sign key type: %d, private key: ", key_type);
   PRINT_HEX(key->pri, PRIVATE_KEY_LENGTH[key_type]);
   if (key_type == KEY_TYPE_PKC_END) {
@@ -350,10 +567,7 @@ int sign_with_private_key(int32_t alg_type, ecc_key_t *key, const uint8_t *input
   }
 
   if (key_type == ED25519) {
-    if (ecc_complete_key(key_type, key) < 0) {
-      ERR_MSG("Failed to complete key\n");
-      return -1;
-    }
+    if (complete_credential_key(kh, key, NULL) < 0) return -1;
     if (ecc_sign(key_type, key, input, len, sig) < 0) {
       ERR_MSG("Failed to sign\n");
       return -1;
@@ -361,12 +575,8 @@ int sign_with_private_key(int32_t alg_type, ecc_key_t *key, const uint8_t *input
     return SIGNATURE_LENGTH[key_type];
   }
   if (key_type == SM2) {
-    if (ecc_complete_key(key_type, key) < 0) {  // Compute Z requiring the public key
-      ERR_MSG("Failed to complete key\n");
-      return -1;
-    }
     uint8_t z[SM3_DIGEST_LENGTH];
-    sm2_z(SM2_ID_DEFAULT, key, z);
+    if (complete_credential_key(kh, key, z) < 0) return -1;
     sm3_init();
     sm3_update(z, SM3_DIGEST_LENGTH);
     sm3_update(input, len);
@@ -399,16 +609,17 @@ bool has_pin(void) {
 }
 
 int set_pin(uint8_t *buf, uint8_t length) {
-  int err;
+  const uint8_t ctr = 8;
+  fs_txn_t txn;
+  fs_txn_begin(&txn, CTAP_CERT_FILE);
   if (length == 0) {
-    err = write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0);
+    fs_txn_setattr(&txn, PIN_ATTR, NULL, 0);
   } else {
     sha256_raw(buf, length, buf);
-    err = write_attr(CTAP_CERT_FILE, PIN_ATTR, buf, PIN_HASH_SIZE_P1); // We only compare the first 16 bytes
+    fs_txn_setattr(&txn, PIN_ATTR, buf, PIN_HASH_SIZE_P1); // We only compare the first 16 bytes
   }
-  if (err < 0) return err;
-  uint8_t ctr = 8;
-  return write_attr(CTAP_CERT_FILE, PIN_CTR_ATTR, &ctr, 1);
+  fs_txn_setattr(&txn, PIN_CTR_ATTR, &ctr, 1);
+  return fs_txn_commit(&txn);
 }
 
 int verify_pin_hash(uint8_t *buf) {
@@ -34,10 +34,16 @@ bool cp_verify_rp_id(const uint8_t *rp_id_hash);
 void cp_associate_rp_id(const uint8_t *rp_id_hash);
 key_type_t cose_alg_to_key_type(int alg);
 
+void drop_cached_secrets(void);
+void drop_counter_reservation(void);
+void drop_key_pool(void);
+void drop_pub_key_cache(void);
 int increase_counter(uint32_t *counter);
 int generate_key_handle(credential_id *kh, uint8_t *pubkey, int32_t alg_type, uint8_t dc, uint8_t cp);
 size_t sign_with_device_key(const uint8_t *input, size_t input_len, uint8_t *sig);
-int sign_with_private_key(int32_t alg_type, ecc_key_t *key, const uint8_t *input, size_t len, uint8_t *sig);
+int sign_with_private_key(const credential_id *kh, ecc_key_t *key, const uint8_t *input, size_t len, uint8_t *sig);
+// fill the public key of a credential, and the SM2 Z value if z is not NULL
+int complete_credential_key(const credential_id *kh, ecc_key_t *key, uint8_t *z);
 int verify_key_handle(const credential_id *kh, ecc_key_t *key);
 bool check_credential_protect_requirements(credential_id *kh, bool with_cred_list, bool uv);
 int get_cert(uint8_t *buf);
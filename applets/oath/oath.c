@@ -8,10 +8,18 @@
 #include <oath.h>
 #include <pass.h>
 #include <rand.h>
+#include <store.h>
 #include <string.h>
 
 #define OATH_FILE "oath"
+#define OATH_FILE_TMP "oatht"
+#define PASS_FILE_TMP "passt"
+#define OATH_SWAP_FILE "oaths"
 #define MAX_RECORDS 100
+// store_foreach stops on any non-zero return of a visitor, and the errors of lfs are negative
+#define VISIT_STOP_FULL 1
+#define VISIT_STOP_DUP_NAME 2
+#define VISIT_STOP_NOT_INCREASING 3
 
 static enum {
   REMAINING_NONE,
@@ -22,6 +30,19 @@ static enum {
 
 static uint8_t auth_challenge[MAX_CHALLENGE_LEN], record_idx, is_validated;
 
+static int oath_legacy_live(const void *record) { return ((const OATH_RECORD *) record)->name_len != 0; }
+static const uint8_t oath_keep_attrs[] = {ATTR_KEY, ATTR_HANDLE};
+// pass.c refers to a record by its index * sizeof(OATH_RECORD), named file_offset for history
+static store_t oath_store = {.path = OATH_FILE,
+                             .record_size = sizeof(OATH_RECORD),
+                             .capacity = MAX_RECORDS,
+                             .legacy_live = oath_legacy_live,
+                             .keep_attrs = oath_keep_attrs,
+                             .keep_attr_count = sizeof(oath_keep_attrs)};
+
+// pass.c keeps the offsets of OATH records, so the pass file is rebuilt along with the records
+static const char *const oath_swap_files[][2] = {{OATH_FILE_TMP, OATH_FILE}, {PASS_FILE_TMP, PASS_FILE}};
+
 void oath_poweroff(void) {
   oath_remaining_type = REMAINING_NONE;
   is_validated = false;
@@ -29,8 +50,13 @@ void oath_poweroff(void) {
 
 int oath_install(const uint8_t reset) {
   oath_poweroff();
-  if (!reset && get_file_size(OATH_FILE) >= 0) return 0;
-  if (write_file(OATH_FILE, NULL, 0, 0, 1) < 0) return -1;
+  // before pass_install reads the pass file
+  if (store_swap_recover(OATH_SWAP_FILE, oath_swap_files, 2) < 0) return -1;
+  if (!reset && fs_exists(OATH_FILE) > 0) {
+    OATH_RECORD record; // buffer for the migration
+    return store_open(&oath_store, &record) < 0 ? -1 : 0;
+  }
+  if (store_format(&oath_store) < 0) return -1;
   if (write_attr(OATH_FILE, ATTR_KEY, NULL, 0) < 0) return -1;
   uint8_t handle[HANDLE_LEN];
   random_buffer(handle, sizeof(handle));
@@ -38,6 +64,54 @@ int oath_install(const uint8_t reset) {
   return 0;
 }
 
+int oath_compact(void) {
+  if (store_free_count(&oath_store) < STORE_COMPACT_MIN_FREE) return 0;
+  DBG_MSG("Compacting %d free records\n", store_free_count(&oath_store));
+  OATH_RECORD record;
+  uint8_t remap[MAX_RECORDS];
+  int err = store_compact(&oath_store, OATH_FILE_TMP, &record, remap, NULL, NULL);
+  if (err >= 0) err = pass_write_oath_remapped(PASS_FILE_TMP, remap, store_count(&oath_store));
+  if (err >= 0) err = store_swap(OATH_SWAP_FILE, oath_swap_files, 2);
+  // the old indices of an ongoing listing are invalid now
+  oath_remaining_type = REMAINING_NONE;
+  if (err >= 0) err = store_open(&oath_store, &record);
+  if (err >= 0) err = pass_install(0);
+  memzero(&record, sizeof(record));
+  return err < 0 ? -1 : 1;
+}
+
+typedef struct {
+  uint8_t name_len;
+  const uint8_t *name;
+} oath_name;
+
+// store_foreach visitor, returns index + 1 of the record with the name
+static int oath_match_name(int index, void *record, void *user) {
+  const OATH_RECORD *r = record;
+  const oath_name *name = user;
+  return r->name_len == name->name_len && memcmp(r->name, name->name, name->name_len) == 0 ? index + 1 : 0;
+}
+
+static int oath_find_record(uint8_t name_len, const uint8_t *name, OATH_RECORD *record) {
+  oath_name target = {.name_len = name_len, .name = name};
+  return store_foreach(&oath_store, 0, record, oath_match_name, &target);
+}
+
+typedef struct {
+  oath_name dup; // the name should not exist
+  oath_name target; // the name to find, if not empty
+  int found; // the index of target
+} oath_slot_search;
+
+// store_foreach visitor, returns VISIT_STOP_DUP_NAME if the dup name exists
+static int oath_find_slot(int index, void *record, void *user) {
+  oath_slot_search *search = user;
+  if (oath_match_name(index, record, &search->dup)) return VISIT_STOP_DUP_NAME;
+  if (search->found < 0 && search->target.name_len > 0 && oath_match_name(index, record, &search->target) != 0)
+    search->found = index;
+  return 0;
+}
+
 static int oath_select(const CAPDU *capdu, RAPDU *rapdu) {
   if (P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
 
@@ -115,25 +189,17 @@ static int oath_put(const CAPDU *capdu, RAPDU *rapdu) {
 
   if (LC != offset) EXCEPT(SW_WRONG_LENGTH);
 
-  // find an empty slot to save the record
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  const size_t n_records = size / sizeof(OATH_RECORD);
+  // check the name, then find an empty slot to save the record
   OATH_RECORD record;
-  size_t unoccupied = n_records; // append by default
-  for (size_t i = 0; i != n_records; ++i) {
-    if (read_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
-    // duplicated name found
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) {
-      DBG_MSG("dup name\n");
-      EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
-    }
-    // empty slot found
-    if (record.name_len == 0 && unoccupied == n_records) unoccupied = i;
+  oath_slot_search search = {.dup = {name_len, name_ptr}, .target = {0, NULL}, .found = -1};
+  const int ret = store_foreach(&oath_store, 0, &record, oath_find_slot, &search);
+  if (ret == VISIT_STOP_DUP_NAME) { // duplicated name found
+    DBG_MSG("dup name\n");
+    EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
   }
-  DBG_MSG("unoccupied=%zu n_records=%zu\n", unoccupied, n_records);
-  if (unoccupied == n_records &&  // empty slot not found
-      unoccupied >= MAX_RECORDS) // number of records exceeded the limit
+  if (ret < 0) return -1;
+  DBG_MSG("unoccupied=%d\n", store_next_index(&oath_store));
+  if (store_next_index(&oath_store) < 0) // number of records exceeded the limit
     EXCEPT(SW_NOT_ENOUGH_SPACE);
 
   record.name_len = name_len;
@@ -142,7 +208,7 @@ static int oath_put(const CAPDU *capdu, RAPDU *rapdu) {
   memcpy(record.key, key_ptr, key_len);
   record.prop = prop;
   memcpy(record.challenge, chal, MAX_CHALLENGE_LEN);
-  return write_file(OATH_FILE, &record, unoccupied * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
+  return store_alloc(&oath_store, &record) < 0 ? -1 : 0;
 }
 
 static int oath_delete(const CAPDU *capdu, RAPDU *rapdu) {
@@ -158,19 +224,13 @@ static int oath_delete(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find and delete the record
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  const size_t n_records = size / sizeof(OATH_RECORD);
   OATH_RECORD record;
-  for (size_t i = 0; i != n_records; ++i) {
-    if (read_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) {
-      if (pass_delete_oath(i * sizeof(OATH_RECORD)) < 0) return -1;
-      record.name_len = 0;
-      return write_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
-    }
-  }
-  EXCEPT(SW_DATA_INVALID);
+  const int found = oath_find_record(name_len, name_ptr, &record);
+  if (found < 0) return -1;
+  if (found == 0) EXCEPT(SW_DATA_INVALID);
+  const size_t file_offset = (found - 1) * sizeof(OATH_RECORD);
+  if (pass_delete_oath(file_offset) < 0) return -1;
+  return store_delete(&oath_store, found - 1);
 }
 
 static int oath_rename(const CAPDU *capdu, RAPDU *rapdu) {
@@ -192,27 +252,22 @@ static int oath_rename(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  const uint32_t n_records = size / sizeof(OATH_RECORD);
-  uint32_t i, idx_old;
   OATH_RECORD record;
-  for (i = 0, idx_old = n_records; i < n_records; ++i) {
-    const uint32_t file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (idx_old == n_records && record.name_len == old_name_len && memcmp(record.name, old_name_ptr, old_name_len) == 0) idx_old = i;
-    if (record.name_len == new_name_len && memcmp(record.name, new_name_ptr, new_name_len) == 0) {
-      DBG_MSG("dup name\n");
-      EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
-    }
+  oath_slot_search search = {.dup = {new_name_len, new_name_ptr}, .target = {old_name_len, old_name_ptr}, .found = -1};
+  const int ret = store_foreach(&oath_store, 0, &record, oath_find_slot, &search);
+  if (ret == VISIT_STOP_DUP_NAME) {
+    DBG_MSG("dup name\n");
+    EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
   }
-  if (idx_old == n_records) EXCEPT(SW_DATA_INVALID);
+  if (ret < 0) return -1;
+  if (search.found < 0) EXCEPT(SW_DATA_INVALID);
+  const int idx_old = search.found;
 
   // update the name
-  if (read_file(OATH_FILE, &record, idx_old * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
+  if (store_read(&oath_store, idx_old, &record) < 0) return -1;
   record.name_len = new_name_len;
   memcpy(record.name, new_name_ptr, new_name_len);
-  return write_file(OATH_FILE, &record, idx_old * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
+  return store_write(&oath_store, idx_old, &record);
 }
 
 static int oath_set_code(const CAPDU *capdu, RAPDU *rapdu) {
@@ -294,52 +349,65 @@ static int oath_validate(const CAPDU *capdu, RAPDU *rapdu) {
   return 0;
 }
 
+typedef struct {
+  const CAPDU *capdu;
+  RAPDU *rapdu;
+  size_t off;
+  uint8_t *challenge; // for calculate all
+  uint8_t challenge_len;
+} oath_response_builder;
+
+// store_foreach visitor, returns 1 when the response is full
+static int oath_list_record(int index, void *record, void *user) {
+  const OATH_RECORD *r = record;
+  oath_response_builder *builder = user;
+  const CAPDU *capdu = builder->capdu;
+  RAPDU *rapdu = builder->rapdu;
+
+  if (builder->off + 3 + r->name_len > LE) { // tag (1) + name_len (1) + algo (1) + name
+    // shouldn't increase the record_idx in this case
+    SW = 0x61FF;
+    return 1;
+  }
+  record_idx = index + 1;
+
+  RDATA[builder->off++] = OATH_TAG_NAME_LIST;
+  RDATA[builder->off++] = r->name_len + 1;
+  RDATA[builder->off++] = r->key[0];
+  memcpy(RDATA + builder->off, r->name, r->name_len);
+  builder->off += r->name_len;
+  return 0;
+}
+
 static int oath_list(const CAPDU *capdu, RAPDU *rapdu) {
   if (P1 != 0x00 || P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
 
   oath_remaining_type = REMAINING_LIST;
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
   OATH_RECORD record;
-  const size_t n_records = size / sizeof(OATH_RECORD);
-  size_t off = 0;
-
-  while (record_idx < n_records) {
-    if (read_file(OATH_FILE, &record, record_idx * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
-    if (off + 3 + record.name_len > LE) { // tag (1) + name_len (1) + algo (1) + name
-      // shouldn't increase the record_idx in this case
-      SW = 0x61FF;
-      break;
-    }
-    record_idx++;
-    if (record.name_len == 0) continue;
-
-    RDATA[off++] = OATH_TAG_NAME_LIST;
-    RDATA[off++] = record.name_len + 1;
-    RDATA[off++] = record.key[0];
-    memcpy(RDATA + off, record.name, record.name_len);
-    off += record.name_len;
-  }
-  if (record_idx >= n_records) {
+  oath_response_builder builder = {.capdu = capdu, .rapdu = rapdu, .off = 0};
+
+  const int ret = store_foreach(&oath_store, record_idx, &record, oath_list_record, &builder);
+  if (ret < 0) return -1;
+  if (ret == 0) { // all records are listed
     oath_remaining_type = REMAINING_NONE;
   }
-  LL = off;
+  LL = builder.off;
 
   return 0;
 }
 
-static int oath_update_challenge_field(const OATH_RECORD *record, const size_t file_offset) {
-  return write_file(OATH_FILE, record->challenge, file_offset + (size_t) & ((OATH_RECORD *)0)->challenge,
-                    sizeof(record->challenge), 0);
+static int oath_update_challenge_field(const OATH_RECORD *record, const int index) {
+  // the whole record is written since it is checksummed
+  return store_write(&oath_store, index, record);
 }
 
-static int oath_enforce_increasing(OATH_RECORD *record, const size_t file_offset, const uint8_t challenge_len, uint8_t challenge[MAX_CHALLENGE_LEN]) {
+static int oath_enforce_increasing(OATH_RECORD *record, const int index, const uint8_t challenge_len, uint8_t challenge[MAX_CHALLENGE_LEN]) {
   if (record->prop & OATH_PROP_INC) {
     if (challenge_len != sizeof(record->challenge)) return -1;
     DBG_MSG("challenge_len=%u %hhu %hhu\n", challenge_len, record->challenge[7], challenge[7]);
     if (memcmp(record->challenge, challenge, sizeof(record->challenge)) > 0) return -2;
     memcpy(record->challenge, challenge, sizeof(record->challenge));
-    oath_update_challenge_field(record, file_offset);
+    oath_update_challenge_field(record, index);
     return 0;
   }
   return 0;
@@ -378,24 +446,23 @@ static uint8_t *oath_digest(const OATH_RECORD *record, uint8_t buffer[SHA512_DIG
 
 int oath_calculate_by_offset(size_t file_offset, uint8_t result[4]) {
   if (file_offset % sizeof(OATH_RECORD) != 0) return -2;
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0 || file_offset >= (size_t)size) return -2;
+  const int index = (int) (file_offset / sizeof(OATH_RECORD));
   uint8_t challenge_len;
   uint8_t challenge[MAX_CHALLENGE_LEN];
   OATH_RECORD record;
-  if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-
-  if (record.name_len == 0) {
+  const int err = store_read(&oath_store, index, &record);
+  if (err == LFS_ERR_NOENT) {
     ERR_MSG("Record deleted\n");
     return -2;
   }
+  if (err < 0) return -1;
   if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_TOTP) {
     ERR_MSG("TOTP is not supported\n");
     return -1;
   }
   if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
     if (oath_increase_counter(&record) < 0) return -1;
-    oath_update_challenge_field(&record, file_offset);
+    oath_update_challenge_field(&record, index);
 
     challenge_len = sizeof(record.challenge);
     memcpy(challenge, record.challenge, challenge_len);
@@ -422,18 +489,11 @@ static int oath_set_default(const CAPDU *capdu, RAPDU *rapdu) {
   if (offset > LC) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  const uint32_t n_records = size / sizeof(OATH_RECORD);
-  uint32_t i;
-  uint32_t file_offset = 0;
   OATH_RECORD record;
-  for (i = 0; i != n_records; ++i) {
-    file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) break;
-  }
-  if (i == n_records) EXCEPT(SW_DATA_INVALID);
+  const int found = oath_find_record(name_len, name_ptr, &record);
+  if (found < 0) return -1;
+  if (found == 0) EXCEPT(SW_DATA_INVALID);
+  const uint32_t file_offset = (found - 1) * sizeof(OATH_RECORD);
   if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_TOTP) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
 
   return pass_update_oath(P1 -1, file_offset, record.name_len, record.name, P2);
@@ -451,18 +511,11 @@ static int oath_calculate(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  const size_t n_records = size / sizeof(OATH_RECORD);
-  size_t i;
-  size_t file_offset = 0;
   OATH_RECORD record;
-  for (i = 0; i != n_records; ++i) {
-    file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, DATA + 2, name_len) == 0) break;
-  }
-  if (i == n_records) EXCEPT(SW_DATA_INVALID);
+  const int found = oath_find_record(name_len, DATA + 2, &record);
+  if (found < 0) return -1;
+  if (found == 0) EXCEPT(SW_DATA_INVALID);
+  const int index = found - 1;
 
   if (record.prop & OATH_PROP_TOUCH) {
     if (!is_nfc()) {
@@ -490,11 +543,11 @@ static int oath_calculate(const CAPDU *capdu, RAPDU *rapdu) {
     offset += challenge_len;
     if (offset > LC) EXCEPT(SW_WRONG_LENGTH);
 
-    if (oath_enforce_increasing(&record, file_offset, challenge_len, challenge) < 0)
+    if (oath_enforce_increasing(&record, index, challenge_len, challenge) < 0)
       EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
   } else if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
     if (oath_increase_counter(&record) < 0) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
-    oath_update_challenge_field(&record, file_offset);
+    oath_update_challenge_field(&record, index);
 
     challenge_len = sizeof(record.challenge);
     memcpy(challenge, record.challenge, challenge_len);
@@ -518,15 +571,66 @@ static int oath_calculate(const CAPDU *capdu, RAPDU *rapdu) {
   return 0;
 }
 
+// store_foreach visitor, returns VISIT_STOP_FULL when the response is full,
+// or VISIT_STOP_NOT_INCREASING if the challenge is not increasing
+static int oath_calculate_record(int index, void *record, void *user) {
+  OATH_RECORD *r = record;
+  oath_response_builder *builder = user;
+  const CAPDU *capdu = builder->capdu;
+  RAPDU *rapdu = builder->rapdu;
+  size_t off_out = builder->off;
+
+  const size_t estimated_len = 2 + r->name_len + 2 + 1 + (oath_remaining_type == REMAINING_CALC_TRUNC ? 4 : SHA512_DIGEST_LENGTH);
+  if (estimated_len + off_out > LE) {
+    // shouldn't increase the record_idx in this case
+    SW = 0x61FF; // more data available
+    return VISIT_STOP_FULL;
+  }
+  record_idx = index + 1;
+
+  RDATA[off_out++] = OATH_TAG_NAME;
+  RDATA[off_out++] = r->name_len;
+  memcpy(RDATA + off_out, r->name, r->name_len);
+  off_out += r->name_len;
+
+  if ((r->key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
+    RDATA[off_out++] = OATH_TAG_NO_RESP;
+    RDATA[off_out++] = 1;
+    RDATA[off_out++] = r->key[1];
+  } else if (r->prop & OATH_PROP_TOUCH) {
+    RDATA[off_out++] = OATH_TAG_REQ_TOUCH;
+    RDATA[off_out++] = 1;
+    RDATA[off_out++] = r->key[1];
+  } else {
+    if (oath_enforce_increasing(r, index, builder->challenge_len, builder->challenge) < 0)
+      return VISIT_STOP_NOT_INCREASING;
+
+    if (oath_remaining_type == REMAINING_CALC_TRUNC) {
+      RDATA[off_out++] = OATH_TAG_RESPONSE;
+      RDATA[off_out++] = 5;
+      RDATA[off_out++] = r->key[1];
+
+      uint8_t hash[SHA512_DIGEST_LENGTH];
+      memcpy(RDATA + off_out, oath_digest(r, hash, builder->challenge_len, builder->challenge, true), 4);
+      off_out += 4;
+    } else {
+      uint8_t *hash = &RDATA[off_out + 3];
+      RDATA[off_out++] = OATH_TAG_FULL_RESPONSE;
+      RDATA[off_out++] = 1 + (uint8_t)(uintptr_t)oath_digest(r, hash, builder->challenge_len, builder->challenge, false);
+      RDATA[off_out] = r->key[1];
+      off_out += RDATA[off_out - 1];
+    }
+  }
+  builder->off = off_out;
+  return 0;
+}
+
 static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
   static uint8_t challenge_len;
   static uint8_t challenge[MAX_CHALLENGE_LEN];
 
   if (P2 != 0x00 && P2 != 0x01) EXCEPT(SW_WRONG_P1P2);
 
-  const int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-
   // store challenge in the first call
   if (record_idx == 0) {
     uint16_t off_in = 0;
@@ -545,60 +649,15 @@ static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
   }
 
   OATH_RECORD record;
-  const size_t n_records = size / sizeof(OATH_RECORD);
-  size_t off_out = 0;
-  while (record_idx < n_records) {
-    const size_t file_offset = record_idx * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    const size_t estimated_len = 2 + record.name_len + 2 + 1 + (oath_remaining_type == REMAINING_CALC_TRUNC ? 4 : SHA512_DIGEST_LENGTH);
-    if (estimated_len + off_out > LE) {
-      // shouldn't increase the record_idx in this case
-      SW = 0x61FF; // more data available
-      break;
-    }
-    record_idx++;
-    if (record.name_len == 0) continue;
-
-    RDATA[off_out++] = OATH_TAG_NAME;
-    RDATA[off_out++] = record.name_len;
-    memcpy(RDATA + off_out, record.name, record.name_len);
-    off_out += record.name_len;
-
-    if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-      RDATA[off_out++] = OATH_TAG_NO_RESP;
-      RDATA[off_out++] = 1;
-      RDATA[off_out++] = record.key[1];
-      continue;
-    }
-    if (record.prop & OATH_PROP_TOUCH) {
-      RDATA[off_out++] = OATH_TAG_REQ_TOUCH;
-      RDATA[off_out++] = 1;
-      RDATA[off_out++] = record.key[1];
-      continue;
-    }
-
-    if (oath_enforce_increasing(&record, file_offset, challenge_len, challenge) < 0) EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
-
-    if (oath_remaining_type == REMAINING_CALC_TRUNC) {
-      RDATA[off_out++] = OATH_TAG_RESPONSE;
-      RDATA[off_out++] = 5;
-      RDATA[off_out++] = record.key[1];
-
-      uint8_t hash[SHA512_DIGEST_LENGTH];
-      memcpy(RDATA + off_out, oath_digest(&record, hash, challenge_len, challenge, true), 4);
-      off_out += 4;
-    } else {
-      uint8_t *hash = &RDATA[off_out + 3];
-      RDATA[off_out++] = OATH_TAG_FULL_RESPONSE;
-      RDATA[off_out++] = 1 + (uint8_t)(uintptr_t)oath_digest(&record, hash, challenge_len, challenge, false);
-      RDATA[off_out] = record.key[1];
-      off_out += RDATA[off_out - 1];
-    }
-  }
-  if (record_idx >= n_records) {
+  oath_response_builder builder = {
+      .capdu = capdu, .rapdu = rapdu, .off = 0, .challenge = challenge, .challenge_len = challenge_len};
+  const int ret = store_foreach(&oath_store, record_idx, &record, oath_calculate_record, &builder);
+  if (ret == VISIT_STOP_NOT_INCREASING) EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
+  if (ret < 0) return -1;
+  if (ret == 0) { // all records are calculated
     oath_remaining_type = REMAINING_NONE;
   }
-  LL = off_out;
+  LL = builder.off;
 
   return 0;
 }
@@ -189,7 +189,7 @@ void openpgp_poweroff(void) {
 
 int openpgp_install(uint8_t reset) {
   openpgp_poweroff();
-  if (!reset && get_file_size(DATA_PATH) >= 0) return 0;
+  if (!reset && fs_exists(DATA_PATH) > 0) return 0;
 
   // Cardholder Data
   if (write_file(DATA_PATH, NULL, 0, 0, 1) < 0) return -1;
@@ -4,8 +4,8 @@
 #include <memzero.h>
 #include <oath.h>
 #include <pass.h>
+#include <store.h>
 
-#define PASS_FILE "pass"
 #define SLOT_SHORT 0
 #define SLOT_LONG  1
 
@@ -145,6 +145,23 @@ int pass_delete_oath(uint32_t file_offset) {
   return 0;
 }
 
+int pass_write_oath_remapped(const char *path, const uint8_t *oath_remap, int n) {
+  pass_slot_t remapped[2];
+  memcpy(remapped, slots, sizeof(slots));
+  for (int i = 0; i < 2; ++i) {
+    if (remapped[i].type != PASS_SLOT_OATH) continue;
+    const uint32_t old_index = remapped[i].oath_offset / sizeof(OATH_RECORD);
+    const uint8_t index = old_index < (uint32_t) n ? oath_remap[old_index] : STORE_NIL;
+    if (index == STORE_NIL) // the record is gone
+      remapped[i].type = PASS_SLOT_OFF;
+    else
+      remapped[i].oath_offset = index * sizeof(OATH_RECORD);
+  }
+  int err = write_file(path, remapped, 0, sizeof(remapped), 1);
+  memzero(remapped, sizeof(remapped));
+  return err;
+}
+
 static int oath_process_offset(uint32_t file_offset, char *output) {
   uint32_t otp_code;
   int ret = oath_calculate_by_offset(file_offset, (uint8_t *)&otp_code);
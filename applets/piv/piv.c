@@ -203,7 +203,7 @@ void piv_poweroff(void) {
 
 int piv_install(const uint8_t reset) {
   piv_poweroff();
-  if (!reset && get_file_size(ALGORITHM_EXT_CONFIG_PATH) >= 0) {
+  if (!reset && fs_exists(ALGORITHM_EXT_CONFIG_PATH) > 0) {
     if (read_file(ALGORITHM_EXT_CONFIG_PATH, &alg_ext_cfg, 0, sizeof(alg_ext_cfg)) < 0) return -1;
     return 0;
   }
@@ -34,6 +34,7 @@ extern ccid_bulkin_data_t bulkin_data;
 extern ccid_bulkout_data_t bulkout_data;
 static applet_process_t *process_func;
 static uint8_t setup_buffer[16];
+static uint8_t reset_each_input;
 
 static int EmulateUSBEnumeration() {
   uint8_t set_address[] = {0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
@@ -55,21 +56,26 @@ int LLVMFuzzerInitialize(int *argc, char ***argv) {
     if (idx >= 0 && idx < sizeof(applets) / sizeof(applets[0])) {
       process_func = applets[idx];
       printf("Applet %d Fuzzing Test\n", idx);
-      sprintf(lfs_root, "/tmp/fuzz_applet%d", idx);
+      sprintf(lfs_root, CARD_RAM_PREFIX "/tmp/fuzz_applet%d", idx);
     }
   }
   if (!process_func) {
     printf("CCID Fuzzing Test\n");
-    sprintf(lfs_root, "/tmp/fuzz_ccid");
+    sprintf(lfs_root, CARD_RAM_PREFIX "/tmp/fuzz_ccid");
   }
   usb_device_init();
   EmulateUSBEnumeration(); // required before any CCID transation
   set_nfc_state(1);
-  if (*argc > 2 && strcmp((*argv)[2], "--keep") == 0) { // keep data in littlefs
+  if (*argc > 2 && strcmp((*argv)[2], "--keep") == 0) { // start from the image kept by a previous run
     card_read(lfs_root);
   } else {
-    unlink(lfs_root);
+    unlink(lfs_root + strlen(CARD_RAM_PREFIX));
     card_fabrication_procedure(lfs_root);
+    card_fs_dump(NULL); // for later runs with --keep
+  }
+  if (*argc > 2 && strcmp((*argv)[2], "--reset") == 0) { // run every input on the freshly fabricated card
+    card_snapshot_save();
+    reset_each_input = 1;
   }
   printf("Finished initialization\n");
   return 0;
@@ -128,6 +134,7 @@ void EmulateUSBTrans(const uint8_t *buf, size_t len) {
 }
 
 int LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len) {
+  if (reset_each_input) card_snapshot_restore();
   if (!process_func) { // CCID Fuzzing Test
     // if (len > APDU_BUFFER_SIZE) len = APDU_BUFFER_SIZE;
     // memcpy(bulkout_data.abData, buf, len);
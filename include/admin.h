@@ -26,6 +26,7 @@
 #define ADMIN_INS_READ_CONFIG 0x42
 #define ADMIN_INS_READ_PASS_CONFIG 0x43
 #define ADMIN_INS_WRITE_PASS_CONFIG 0x44
+#define ADMIN_INS_FS_STATS 0x45
 #define ADMIN_INS_FACTORY_RESET 0x50
 #define ADMIN_INS_SELECT 0xA4
 #define ADMIN_INS_VENDOR_SPECIFIC 0xFF
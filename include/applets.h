@@ -4,5 +4,8 @@
 
 void applets_install(void);
 void applets_poweroff(void);
+// one step of background work such as compacting record files, run by device_loop when idle;
+// returns non-zero if more work is pending
+int applets_idle(void);
 
 #endif // APPLETS_H_
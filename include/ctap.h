@@ -22,5 +22,8 @@ static int ctap_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
     return ctap_process_apdu_with_src(capdu, rapdu, CTAP_SRC_CCID);
 }
 int ctap_wink(void);
+int ctap_compact(void);
+void ctap_expire_secrets(void);
+int ctap_fill_key_pool(void);
 
 #endif // CANOKEY_CORE_FIDO2_FIDO2_H_
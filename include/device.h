@@ -16,6 +16,9 @@
 #define WAIT_ENTRY_CCID 0
 #define WAIT_ENTRY_CTAPHID 1
 
+// milliseconds without any command before device_loop runs the idle work
+#define DEVICE_IDLE_TIME 10000
+
 typedef enum {
   FM_STATUS_OK = 0,
   FM_STATUS_NACK = 1,
@@ -98,6 +101,8 @@ uint8_t wait_for_user_presence(uint8_t entry);
 int strong_user_presence_test(void);
 int send_keepalive_during_processing(uint8_t entry);
 void device_loop(void);
+// postpone the idle work of device_loop, called on each command
+void device_mark_activity(void);
 uint8_t is_nfc(void);
 void set_nfc_state(uint8_t state);
 uint8_t get_touch_result(void);
@@ -6,17 +6,171 @@
 
 #define LFS_CACHE_SIZE 512
 
+/*
+ * The number of open file handles kept by fs.c. One more slot is reserved for opening a file before
+ * the least recently used one is closed. Each slot holds a cache buffer of LFS_CACHE_SIZE, an lfs_file_t,
+ * its config and a path of FS_PATH_MAX, i.e. about 600 bytes on a 32-bit MCU. The default costs
+ * about 2.4 KB of static RAM; lower it on parts with little RAM, at the price of more metadata walks.
+ */
+#ifndef FS_HANDLE_CACHE_SIZE
+#define FS_HANDLE_CACHE_SIZE 3
+#endif
+
+#ifndef FS_PATH_MAX
+#define FS_PATH_MAX 16
+#endif
+
+#define FS_TXN_MAX_ATTRS  4
+#define FS_TXN_MAX_WRITES 2
+
+// the buckets of I/O counters, one per path prefix plus the last one for other paths
+#define FS_STATS_BUCKETS 8
+
+typedef struct {
+  uint32_t block_reads;  // read calls to the block device
+  uint32_t block_progs;  // prog calls to the block device
+  uint32_t block_erases; // erase calls to the block device
+  uint32_t bytes_read;
+  uint32_t bytes_written; // file data and attrs
+  uint32_t commits;       // syncs, attr updates, renames and removals
+} fs_io_stats_t;
+
+typedef struct {
+  const void *buf;
+  lfs_soff_t off;
+  lfs_size_t len;
+} fs_txn_write_t;
+
+typedef struct {
+  const char *path;
+  struct lfs_attr attrs[FS_TXN_MAX_ATTRS];
+  uint8_t attr_count;
+  fs_txn_write_t writes[FS_TXN_MAX_WRITES];
+  uint8_t write_count;
+  lfs_soff_t truncate; // the size to truncate to before the writes, or -1
+} fs_txn_t;
+
 int fs_format(const struct lfs_config *cfg);
 int fs_mount(const struct lfs_config *cfg);
 int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len);
 int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc);
 int append_file(const char *path, const void *buf, lfs_size_t len);
 int truncate_file(const char *path, lfs_size_t len);
+
+/**
+ * Append to a file without committing, e.g. while a new file is written in one go.
+ * The data are committed by fs_sync, or when the cached handle is closed. A power loss drops them before.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int fs_append_nosync(const char *path, const void *buf, lfs_size_t len);
+
+/**
+ * Commit the data appended by fs_append_nosync.
+ * Check the size of the file afterwards, since a handle closed by the cache does not report errors.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int fs_sync(const char *path);
+/**
+ * Visitor of fs_read_records.
+ *
+ * @param index  The index of the record in the file.
+ * @param record The record just read.
+ * @param user   The user pointer passed to fs_read_records.
+ *
+ * @return 0 to continue, otherwise stop the walk and return the value from fs_read_records.
+ *         A common choice is index + 1 for the record found.
+ */
+typedef int (*fs_record_visitor)(int index, void *record, void *user);
+
+/**
+ * Walk through fixed-size records of a file with a single open handle.
+ *
+ * @param path        The file path.
+ * @param first_index The index of the first record to visit.
+ * @param count       The max number of records to visit, or -1 for all remaining records.
+ * @param record      The buffer of record_size bytes to hold the current record.
+ * @param record_size The size of a record.
+ * @param visitor     Called for each record.
+ * @param user        Passed to the visitor.
+ *
+ * @return 0 if all records are visited, the non-zero value returned by the visitor, or a negative error code.
+ */
+int fs_read_records(const char *path, int first_index, int count, void *record, lfs_size_t record_size,
+                    fs_record_visitor visitor, void *user);
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len);
 int write_attr(const char *path, uint8_t attr, const void *buf, lfs_size_t len);
 int get_file_size(const char *path);
+
+/**
+ * Check whether a file exists, without opening it.
+ *
+ * @return 1 if it exists, 0 if not, or a negative error code.
+ */
+int fs_exists(const char *path);
+
+/**
+ * Start a transaction of attribute updates and data writes on a file.
+ * The buffers passed to fs_txn_setattr and fs_txn_write must be valid until fs_txn_commit.
+ *
+ * @param txn  The transaction.
+ * @param path The file, which should exist.
+ */
+void fs_txn_begin(fs_txn_t *txn, const char *path);
+
+/**
+ * Add an attribute update to the transaction. Nothing is written until fs_txn_commit.
+ *
+ * @return 0 on success, LFS_ERR_NOSPC if there are more than FS_TXN_MAX_ATTRS updates.
+ */
+int fs_txn_setattr(fs_txn_t *txn, uint8_t attr, const void *buf, lfs_size_t len);
+
+/**
+ * Add a data write to the transaction. Nothing is written until fs_txn_commit.
+ *
+ * @return 0 on success, LFS_ERR_NOSPC if there are more than FS_TXN_MAX_WRITES writes.
+ */
+int fs_txn_write(fs_txn_t *txn, lfs_soff_t off, const void *buf, lfs_size_t len);
+
+/**
+ * Truncate the file before the data writes of the transaction, creating it if it does not exist.
+ * The creation of a missing file is a commit of its own, which leaves an empty file if the power is lost.
+ */
+void fs_txn_truncate(fs_txn_t *txn, lfs_size_t size);
+
+/**
+ * Apply all data writes and attribute updates of the transaction in a single metadata commit.
+ * Either all or none of them are applied if the power is lost.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int fs_txn_commit(fs_txn_t *txn);
 int fs_rename(const char *old, const char *new);
 
+/**
+ * Remove a file.
+ *
+ * @return 0 on success, LFS_ERR_NOENT if it does not exist, or a negative error code.
+ */
+int fs_remove(const char *path);
+
+/**
+ * Close all cached file handles.
+ * Call it before the underlying storage is accessed or unmounted by others.
+ *
+ * @return 0 on success, or the last error when closing the handles.
+ */
+int fs_flush(void);
+
+/**
+ * Close the cached handle of a file, if any.
+ * fs_rename, fs_format and fs_mount already do this for the affected files.
+ *
+ * @param path The file to drop.
+ */
+void fs_invalidate(const char *path);
+
 /**
  * Get the total size (in KiB) of the file system.
  *
@@ -31,4 +185,61 @@ int get_fs_size(void);
  */
 int get_fs_usage(void);
 
+/**
+ * Get the number of blocks in use. The result is cached until the file system is modified.
+ *
+ * @return The number of used blocks, or a negative error code.
+ */
+int get_fs_used_blocks(void);
+
+/**
+ * @return The number of blocks of the file system.
+ */
+int get_fs_block_count(void);
+
+/**
+ * @return The size of a block in bytes.
+ */
+int get_fs_block_size(void);
+
+/**
+ * Visitor of fs_list_files.
+ *
+ * @param index The index of the file in the listing.
+ * @param name  The file name.
+ * @param size  The file size in bytes.
+ * @param user  The user pointer passed to fs_list_files.
+ *
+ * @return 0 to continue, otherwise stop the listing and return the value from fs_list_files.
+ */
+typedef int (*fs_file_visitor)(int index, const char *name, lfs_size_t size, void *user);
+
+/**
+ * Walk through the regular files in the root directory.
+ *
+ * @param first_index The index of the first file to visit.
+ * @param visitor     Called for each file.
+ * @param user        Passed to the visitor.
+ *
+ * @return 0 if all files are visited, the non-zero value returned by the visitor, or a negative error code.
+ */
+int fs_list_files(int first_index, fs_file_visitor visitor, void *user);
+
+/**
+ * Copy the I/O counters collected since boot or the last fs_reset_io_stats.
+ *
+ * @param stats The counters of each bucket.
+ */
+void fs_get_io_stats(fs_io_stats_t stats[FS_STATS_BUCKETS]);
+
+/**
+ * @return The path prefix counted by a bucket, or "" for the last bucket of other paths.
+ */
+const char *fs_io_stats_prefix(int bucket);
+
+/**
+ * Clear the I/O counters.
+ */
+void fs_reset_io_stats(void);
+
 #endif // CANOKEY_CORE_INCLUDE_FS_H
@@ -66,5 +66,6 @@ void oath_poweroff(void);
 int oath_install(uint8_t reset);
 int oath_process_apdu(const CAPDU *capdu, RAPDU *rapdu);
 int oath_calculate_by_offset(size_t file_offset, uint8_t result[4]);
+int oath_compact(void);
 
 #endif // CANOKEY_CORE_OATH_OATH_H_
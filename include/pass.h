@@ -4,6 +4,7 @@
 
 #include <apdu.h>
 
+#define PASS_FILE                "pass"
 #define PASS_MAX_PASSWORD_LENGTH 32
 
 typedef enum {
@@ -18,5 +19,7 @@ int pass_write_config(const CAPDU *capdu, RAPDU *rapdu);
 int pass_handle_touch(uint8_t touch_type, char *output);
 int pass_update_oath(uint8_t slot_index, uint32_t file_offset, uint8_t name_len, const uint8_t *name, uint8_t with_enter);
 int pass_delete_oath(uint32_t file_offset);
+// Write the slots to path with each OATH record moved to oath_remap[index], or turned off if it is STORE_NIL
+int pass_write_oath_remapped(const char *path, const uint8_t *oath_remap, int n);
 
 #endif // CANOKEY_CORE_INCLUDE_PASS_H
@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef CANOKEY_CORE_INCLUDE_STORE_H
+#define CANOKEY_CORE_INCLUDE_STORE_H
+
+#include <common.h>
+#include <fs.h>
+
+/*
+ * A store keeps up to 254 fixed-size records in one file. Each record is
+ * prefixed with a slot header holding its state and CRC. Deleted slots are
+ * chained into a free-list whose head lives in the STORE_ATTR attribute of
+ * the file, so both allocation and deletion are O(1) and every update is a
+ * single littlefs commit.
+ */
+
+#define STORE_ATTR     0xF0 // reserved in the files of stores
+#define STORE_TMP_FILE "store_tmp"
+#define STORE_NIL      0xFF
+#define STORE_VERSION  1
+// store_compact is worth running once this many slots are free
+#define STORE_COMPACT_MIN_FREE 8
+
+typedef struct {
+  uint8_t version;
+  uint8_t free_head; // the first free slot, or STORE_NIL
+  uint8_t n_live;
+} __packed store_header_t;
+
+typedef struct {
+  const char *path;
+  uint16_t record_size;
+  uint8_t capacity; // max number of slots, < STORE_NIL
+  // liveness of a record in a file written before the store existed, which is migrated by store_open
+  int (*legacy_live)(const void *record);
+  // the other attrs of the file, carried over by the migration
+  const uint8_t *keep_attrs;
+  uint8_t keep_attr_count;
+  // loaded by store_open and store_format
+  store_header_t header;
+  uint8_t n_slots;
+} store_t;
+
+/**
+ * Load a store, migrating a legacy file of bare records if necessary.
+ *
+ * @param store  The store.
+ * @param record A buffer of record_size bytes used by the migration.
+ *
+ * @return 0 on success, LFS_ERR_NOENT if the file does not exist, or a negative error code.
+ */
+int store_open(store_t *store, void *record);
+
+/**
+ * Create an empty store, dropping the records if it exists.
+ * The other attrs of the file are kept.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int store_format(store_t *store);
+
+/**
+ * Get the slot which the next store_alloc will use.
+ *
+ * @return The index of the slot, or LFS_ERR_NOSPC if the store is full.
+ */
+int store_next_index(const store_t *store);
+
+/**
+ * Save a record into a free slot.
+ *
+ * @return The index of the record, LFS_ERR_NOSPC if the store is full, or a negative error code.
+ */
+int store_alloc(store_t *store, const void *record);
+
+/**
+ * Overwrite a live record.
+ *
+ * @return 0 on success, LFS_ERR_NOENT if the slot is not live, or a negative error code.
+ */
+int store_write(store_t *store, int index, const void *record);
+
+/**
+ * Read a live record and verify its checksum.
+ *
+ * @return 0 on success, LFS_ERR_NOENT if the slot is not live, LFS_ERR_CORRUPT if the checksum mismatches,
+ *         or a negative error code.
+ */
+int store_read(store_t *store, int index, void *record);
+
+/**
+ * Free the slot of a record. Deleting a free slot does nothing.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int store_delete(store_t *store, int index);
+
+/**
+ * Walk through the live records from the slot first_index, skipping the free and corrupted ones.
+ *
+ * @param store       The store.
+ * @param first_index The slot to start with.
+ * @param record      A buffer of record_size bytes to hold the current record.
+ * @param visitor     Called for each live record, see fs_record_visitor.
+ * @param user        Passed to the visitor.
+ *
+ * @return 0 if all records are visited, the non-zero value returned by the visitor, or a negative error code.
+ */
+int store_foreach(store_t *store, int first_index, void *record, fs_record_visitor visitor, void *user);
+
+/**
+ * Write the live records of a store packed into a new file, which has the same attrs but no free slots.
+ * The store itself is not modified; the new file replaces it with store_swap, after which store_open
+ * must be called again.
+ *
+ * @param store    The store.
+ * @param tmp_path The new file, overwritten if it exists.
+ * @param record   A buffer of record_size bytes.
+ * @param remap    If not NULL, receives the new index of each slot, or STORE_NIL if the slot is dropped.
+ *                 It must hold store_count(store) entries.
+ * @param fixup    If not NULL, called on each live record before it is written. It may modify the record,
+ *                 return a positive value to drop it, or a negative error code to abort.
+ * @param user     Passed to fixup.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int store_compact(store_t *store, const char *tmp_path, void *record, uint8_t *remap, fs_record_visitor fixup,
+                  void *user);
+
+/**
+ * Replace a group of files with their rebuilt versions, all or none.
+ * An interrupted swap is completed or discarded by store_swap_recover.
+ *
+ * @param journal A file marking that all new files are complete.
+ * @param files   The pairs of {new file, file to replace}.
+ * @param n       The number of pairs.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int store_swap(const char *journal, const char *const files[][2], int n);
+
+/**
+ * Complete the swap interrupted after its journal was written, or remove the new files left by an
+ * interrupted rebuild. Call it with the same arguments before the files are opened.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int store_swap_recover(const char *journal, const char *const files[][2], int n);
+
+/**
+ * @return The number of slots, live or free.
+ */
+static inline int store_count(const store_t *store) { return store->n_slots; }
+
+/**
+ * @return The number of live records.
+ */
+static inline int store_live_count(const store_t *store) { return store->header.n_live; }
+
+/**
+ * @return The number of free slots, which store_compact drops.
+ */
+static inline int store_free_count(const store_t *store) { return store->n_slots - store->header.n_live; }
+
+#endif // CANOKEY_CORE_INCLUDE_STORE_H
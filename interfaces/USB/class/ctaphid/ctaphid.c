@@ -6,9 +6,37 @@
 #include <usb_device.h>
 #include <usbd_ctaphid.h>
 
-static CTAPHID_FRAME frame;
-static CTAPHID_Channel channel;
-static volatile uint8_t has_frame;
+#define CTAP2_ERR_KEEPALIVE_CANCEL 0x2D // see ctap-errors.h
+
+#define TX_SEQ_INIT 0xFF
+// TX entries kept for the request being executed: a keepalive and its response
+#define TX_RESERVED 2
+
+typedef struct {
+  CTAPHID_Channel *owner; // whose buffer holds the data, released once they are copied out
+  const uint8_t *data;
+  uint32_t cid;
+  uint16_t len;
+  uint16_t off; // of the data not sent yet
+  uint8_t cmd;
+  uint8_t seq;  // of the next continuation report, or TX_SEQ_INIT before the init report
+  uint8_t byte; // the data of a one-byte message
+} CTAPHID_TxMessage;
+
+static CTAPHID_FRAME frame; // the report being sent
+// The responses waiting to be sent. tx_head is only written by the main loop, tx_tail by CTAPHID_Pump under tx_lock.
+static CTAPHID_TxMessage tx_queue[CTAPHID_TX_QUEUE_SIZE];
+static volatile uint8_t tx_head, tx_tail, tx_in_flight;
+static volatile uint32_t tx_lock;
+static CTAPHID_Channel channels[CTAPHID_CHANNEL_NUM];
+static CTAPHID_Channel *current; // the channel whose request is running
+// the channels in CHANNEL_READY, in the order their requests were completed
+static uint8_t queue[CTAPHID_CHANNEL_NUM], queue_head, queue_len;
+// A single-producer/single-consumer ring of the received reports. The indices run freely modulo 256:
+// rx_head is only written by CTAPHID_OutEvent in the USB ISR, rx_tail only by CTAPHID_Loop.
+static CTAPHID_FRAME rx_ring[CTAPHID_RX_RING_SIZE];
+static volatile uint8_t rx_head, rx_tail;
+static volatile uint32_t rx_overruns;
 static CAPDU apdu_cmd;
 static RAPDU apdu_resp;
 static uint8_t (*callback_send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
@@ -16,233 +44,391 @@ static uint8_t (*callback_send_report)(USBD_HandleTypeDef *pdev, uint8_t *report
 const uint16_t ISIZE = sizeof(frame.init.data);
 const uint16_t CSIZE = sizeof(frame.cont.data);
 
+_Static_assert((CTAPHID_TX_QUEUE_SIZE & (CTAPHID_TX_QUEUE_SIZE - 1)) == 0 && CTAPHID_TX_QUEUE_SIZE <= 128,
+               "CTAPHID_TX_QUEUE_SIZE must be a power of 2 up to 128");
+_Static_assert((CTAPHID_RX_RING_SIZE & (CTAPHID_RX_RING_SIZE - 1)) == 0 && CTAPHID_RX_RING_SIZE <= 128,
+               "CTAPHID_RX_RING_SIZE must be a power of 2 up to 128");
+_Static_assert(CTAPHID_TX_QUEUE_SIZE > TX_RESERVED, "CTAPHID_TX_QUEUE_SIZE leaves no room for the replies to reports");
+
 uint8_t CTAPHID_Init(uint8_t (*send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len)) {
   callback_send_report = send_report;
-  channel.state = CTAPHID_IDLE;
-  has_frame = 0;
+  for (int i = 0; i < CTAPHID_CHANNEL_NUM; ++i)
+    channels[i].state = CHANNEL_IDLE;
+  current = NULL;
+  queue_head = queue_len = 0;
+  rx_head = rx_tail = 0;
+  rx_overruns = 0;
+  tx_head = tx_tail = tx_in_flight = 0;
+  tx_lock = 0;
   return 0;
 }
 
 uint8_t CTAPHID_OutEvent(uint8_t *data) {
-  if (has_frame) {
+  const uint8_t head = rx_head;
+  if ((uint8_t)(head - rx_tail) == CTAPHID_RX_RING_SIZE) {
+    ++rx_overruns;
     ERR_MSG("overrun\n");
     return 0;
   }
-  memcpy(&frame, data, sizeof(frame));
-  has_frame = 1;
+  memcpy(&rx_ring[head % CTAPHID_RX_RING_SIZE], data, sizeof(CTAPHID_FRAME));
+  __sync_synchronize(); // the report must be complete before it is published
+  rx_head = head + 1;
   return 0;
 }
 
-static void CTAPHID_SendFrame(void) { callback_send_report(&usb_device, (uint8_t *)&frame, sizeof(CTAPHID_FRAME)); }
+uint32_t CTAPHID_GetOverruns(void) { return rx_overruns; }
 
-static void CTAPHID_SendResponse(uint32_t cid, uint8_t cmd, uint8_t *data, uint16_t len) {
-  uint16_t off = 0;
-  size_t copied;
-  uint8_t seq = 0;
+// Build the next report of the oldest message into frame, return the bytes of data it carries.
+// The message is left as is, so that a report refused by the endpoint is built again. Called with tx_lock held.
+static uint16_t CTAPHID_BuildReport(void) {
+  const CTAPHID_TxMessage *msg = &tx_queue[tx_tail % CTAPHID_TX_QUEUE_SIZE];
+  uint16_t copied;
 
   memset(&frame, 0, sizeof(frame));
-  frame.cid = cid;
-  frame.type = TYPE_INIT;
-  frame.init.cmd |= cmd;
-  frame.init.bcnth = (uint8_t)((len >> 8) & 0xFF);
-  frame.init.bcntl = (uint8_t)(len & 0xFF);
-
-  copied = MIN(len, ISIZE);
-  if (!data) return;
-  memcpy(frame.init.data, data, copied);
-  CTAPHID_SendFrame();
-  off += copied;
-
-  while (len > off) {
-    memset(&frame.cont, 0, sizeof(frame.cont));
-    frame.cont.seq = (uint8_t)seq++;
-    copied = MIN(len - off, CSIZE);
-    memcpy(frame.cont.data, data + off, copied);
-    CTAPHID_SendFrame();
-    off += copied;
+  frame.cid = msg->cid;
+  if (msg->seq == TX_SEQ_INIT) {
+    frame.type = TYPE_INIT;
+    frame.init.cmd |= msg->cmd;
+    frame.init.bcnth = (uint8_t)((msg->len >> 8) & 0xFF);
+    frame.init.bcntl = (uint8_t)(msg->len & 0xFF);
+    copied = MIN(msg->len, ISIZE);
+    memcpy(frame.init.data, msg->data, copied);
+  } else {
+    frame.cont.seq = msg->seq;
+    copied = MIN(msg->len - msg->off, CSIZE);
+    memcpy(frame.cont.data, msg->data + msg->off, copied);
   }
+  return copied;
+}
+
+// Advance the oldest message past the report just submitted. Called with tx_lock held.
+static void CTAPHID_ReportSent(uint16_t copied) {
+  CTAPHID_TxMessage *msg = &tx_queue[tx_tail % CTAPHID_TX_QUEUE_SIZE];
+  msg->seq = msg->seq == TX_SEQ_INIT ? 0 : msg->seq + 1;
+  msg->off += copied;
+
+  if (msg->off == msg->len) {
+    // the data have been copied out, so the channel may take the next request
+    if (msg->owner) msg->owner->state = CHANNEL_IDLE;
+    __sync_synchronize();
+    ++tx_tail;
+  }
+}
+
+// Submit the next report unless one is in flight. Both the main loop and the completion of the
+// previous report in the USB ISR call it; whoever finds the lock taken leaves the work to its holder.
+static void CTAPHID_Pump(void) {
+  while (!tx_in_flight && tx_tail != tx_head) {
+    if (device_spinlock_lock(&tx_lock, false) != 0) return;
+    uint8_t refused = 0;
+    if (!tx_in_flight && tx_tail != tx_head) {
+      const uint16_t copied = CTAPHID_BuildReport();
+      tx_in_flight = 1;
+      // a report refused by the endpoint, e.g. before the device is configured, is retried by CTAPHID_Loop
+      refused = callback_send_report(&usb_device, (uint8_t *)&frame, sizeof(CTAPHID_FRAME)) != USBD_OK;
+      if (refused)
+        tx_in_flight = 0;
+      else
+        CTAPHID_ReportSent(copied);
+    }
+    device_spinlock_unlock(&tx_lock);
+    if (refused) return;
+  }
+}
+
+void CTAPHID_InEvent(void) {
+  tx_in_flight = 0;
+  CTAPHID_Pump();
+}
+
+static uint8_t CTAPHID_TxFree(void) { return CTAPHID_TX_QUEUE_SIZE - (uint8_t)(tx_head - tx_tail); }
+
+// CTAPHID_Loop only takes a report while its reply fits besides TX_RESERVED, so that this never fails
+static CTAPHID_TxMessage *CTAPHID_TxAlloc(uint32_t cid, uint8_t cmd) {
+  if ((uint8_t)(tx_head - tx_tail) == CTAPHID_TX_QUEUE_SIZE) {
+    ERR_MSG("TX queue full\n");
+    return NULL;
+  }
+  CTAPHID_TxMessage *msg = &tx_queue[tx_head % CTAPHID_TX_QUEUE_SIZE];
+  memset(msg, 0, sizeof(CTAPHID_TxMessage));
+  msg->cid = cid;
+  msg->cmd = cmd;
+  msg->seq = TX_SEQ_INIT;
+  return msg;
+}
+
+static void CTAPHID_TxCommit(void) {
+  __sync_synchronize(); // the message must be complete before it is published
+  ++tx_head;
+  CTAPHID_Pump();
+}
+
+// Queue a response held in the buffer of ch, which stays in CHANNEL_SENDING until the data are copied out.
+static void CTAPHID_SendResponse(CTAPHID_Channel *ch, uint8_t cmd, uint16_t len) {
+  CTAPHID_TxMessage *msg = CTAPHID_TxAlloc(ch->cid, cmd);
+  if (msg == NULL) return;
+  msg->data = ch->data;
+  msg->len = len;
+  if (len > 0) {
+    msg->owner = ch;
+    ch->state = CHANNEL_SENDING;
+  }
+  CTAPHID_TxCommit();
+}
+
+static void CTAPHID_SendByte(uint32_t cid, uint8_t cmd, uint8_t byte) {
+  CTAPHID_TxMessage *msg = CTAPHID_TxAlloc(cid, cmd);
+  if (msg == NULL) return;
+  msg->byte = byte;
+  msg->data = &msg->byte;
+  msg->len = 1;
+  CTAPHID_TxCommit();
 }
 
 static void CTAPHID_SendErrorResponse(uint32_t cid, uint8_t code) {
   DBG_MSG("error code 0x%x\n", (int)code);
-  memset(&frame, 0, sizeof(frame));
-  frame.cid = cid;
-  frame.init.cmd = CTAPHID_ERROR;
-  frame.init.bcnth = 0;
-  frame.init.bcntl = 1;
-  frame.init.data[0] = code;
-  CTAPHID_SendFrame();
+  CTAPHID_SendByte(cid, CTAPHID_ERROR, code);
 }
 
-static void CTAPHID_Execute_Init(void) {
-  CTAPHID_INIT_RESP *resp = (CTAPHID_INIT_RESP *)channel.data;
+static void CTAPHID_Execute_Init(CTAPHID_Channel *ch) {
+  CTAPHID_INIT_RESP *resp = (CTAPHID_INIT_RESP *)ch->data;
   uint32_t resp_cid;
-  if (channel.cid == CID_BROADCAST)
+  if (ch->cid == CID_BROADCAST)
     random_buffer((uint8_t *)&resp_cid, 4);
   else
-    resp_cid = channel.cid;
+    resp_cid = ch->cid;
   resp->cid = resp_cid;
   resp->versionInterface = CTAPHID_IF_VERSION; // Interface version
   resp->versionMajor = 1;                      // Major version number
   resp->versionMinor = 0;                      // Minor version number
   resp->versionBuild = 0;                      // Build version number
   resp->capFlags = CAPABILITY_CBOR;            // Capabilities flags
-  CTAPHID_SendResponse(channel.cid, channel.cmd, (uint8_t *)resp, sizeof(CTAPHID_INIT_RESP));
+  CTAPHID_SendResponse(ch, ch->cmd, sizeof(CTAPHID_INIT_RESP));
 }
 
-static void CTAPHID_Execute_Msg(void) {
+static void CTAPHID_Execute_Msg(CTAPHID_Channel *ch) {
   CAPDU *capdu = &apdu_cmd;
   RAPDU *rapdu = &apdu_resp;
-  CLA = channel.data[0];
-  INS = channel.data[1];
-  P1 = channel.data[2];
-  P2 = channel.data[3];
-  LC = (channel.data[5] << 8) | channel.data[6];
-  DATA = &channel.data[7];
+  CLA = ch->data[0];
+  INS = ch->data[1];
+  P1 = ch->data[2];
+  P2 = ch->data[3];
+  LC = (ch->data[5] << 8) | ch->data[6];
+  DATA = &ch->data[7];
   LE = 0x10000;
-  RDATA = channel.data;
+  RDATA = ch->data;
   DBG_MSG("C: ");
-  PRINT_HEX(channel.data, channel.bcnt_total);
+  PRINT_HEX(ch->data, ch->bcnt_total);
   ctap_process_apdu_with_src(capdu, rapdu, CTAP_SRC_HID);
-  channel.data[LL] = HI(SW);
-  channel.data[LL + 1] = LO(SW);
+  ch->data[LL] = HI(SW);
+  ch->data[LL + 1] = LO(SW);
   DBG_MSG("R: ");
   PRINT_HEX(RDATA, LL + 2);
-  CTAPHID_SendResponse(channel.cid, channel.cmd, channel.data, LL + 2);
+  CTAPHID_SendResponse(ch, ch->cmd, LL + 2);
 }
 
-static void CTAPHID_Execute_Cbor(void) {
+static void CTAPHID_Execute_Cbor(CTAPHID_Channel *ch) {
   DBG_MSG("C: ");
-  PRINT_HEX(channel.data, channel.bcnt_total);
-  size_t len = sizeof(channel.data);
-  ctap_process_cbor_with_src(channel.data, channel.bcnt_total, channel.data, &len, CTAP_SRC_HID);
+  PRINT_HEX(ch->data, ch->bcnt_total);
+  size_t len = sizeof(ch->data);
+  ctap_process_cbor_with_src(ch->data, ch->bcnt_total, ch->data, &len, CTAP_SRC_HID);
   DBG_MSG("R: ");
-  PRINT_HEX(channel.data, len);
-  CTAPHID_SendResponse(channel.cid, CTAPHID_CBOR, channel.data, len);
+  PRINT_HEX(ch->data, len);
+  CTAPHID_SendResponse(ch, CTAPHID_CBOR, len);
 }
 
-uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
-  uint8_t ret = LOOP_SUCCESS;
-  if (channel.state == CTAPHID_BUSY && device_get_tick() > channel.expire) {
-    DBG_MSG("CTAP Timeout\n");
-    channel.state = CTAPHID_IDLE;
-    CTAPHID_SendErrorResponse(channel.cid, ERR_MSG_TIMEOUT);
+static CTAPHID_Channel *CTAPHID_FindChannel(uint32_t cid) {
+  for (int i = 0; i < CTAPHID_CHANNEL_NUM; ++i)
+    if (channels[i].state != CHANNEL_IDLE && channels[i].cid == cid) return &channels[i];
+  return NULL;
+}
+
+static CTAPHID_Channel *CTAPHID_AllocChannel(void) {
+  for (int i = 0; i < CTAPHID_CHANNEL_NUM; ++i)
+    if (channels[i].state == CHANNEL_IDLE) return &channels[i];
+  return NULL;
+}
+
+static void CTAPHID_Enqueue(CTAPHID_Channel *ch) {
+  ch->state = CHANNEL_READY;
+  queue[(queue_head + queue_len++) % CTAPHID_CHANNEL_NUM] = (uint8_t)(ch - channels);
+}
+
+static void CTAPHID_Dequeue(CTAPHID_Channel *ch) {
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < queue_len; ++i) {
+    const uint8_t index = queue[(queue_head + i) % CTAPHID_CHANNEL_NUM];
+    if (&channels[index] != ch) queue[(queue_head + kept++) % CTAPHID_CHANNEL_NUM] = index;
   }
+  queue_len = kept;
+  ch->state = CHANNEL_IDLE;
+}
 
-  if (!has_frame) return LOOP_SUCCESS;
+// A message is complete. The CBOR and MSG requests are queued, the others are answered at once,
+// even while another channel is waiting for the user.
+static void CTAPHID_Complete(CTAPHID_Channel *ch, uint8_t wait_for_user) {
+  ch->expire = UINT32_MAX;
+  switch (ch->cmd) {
+  case CTAPHID_MSG:
+    DBG_MSG("MSG\n");
+    if (ch->bcnt_total < 4) // APDU CLA...P2
+      CTAPHID_SendErrorResponse(ch->cid, ERR_INVALID_LEN);
+    else
+      CTAPHID_Enqueue(ch);
+    break;
+  case CTAPHID_CBOR:
+    DBG_MSG("CBOR\n");
+    if (ch->bcnt_total == 0)
+      CTAPHID_SendErrorResponse(ch->cid, ERR_INVALID_LEN);
+    else
+      CTAPHID_Enqueue(ch);
+    break;
+  case CTAPHID_INIT:
+    DBG_MSG("INIT\n");
+    CTAPHID_Execute_Init(ch);
+    break;
+  case CTAPHID_PING:
+    DBG_MSG("PING\n");
+    CTAPHID_SendResponse(ch, ch->cmd, ch->bcnt_total);
+    break;
+  case CTAPHID_WINK:
+    DBG_MSG("WINK\n");
+    if (!wait_for_user) ctap_wink();
+    CTAPHID_SendResponse(ch, ch->cmd, 0);
+    break;
+  case CTAPHID_CANCEL:
+    DBG_MSG("CANCEL with nothing pending\n");
+    break;
+  default:
+    DBG_MSG("Invalid CMD 0x%x\n", (int)ch->cmd);
+    CTAPHID_SendErrorResponse(ch->cid, ERR_INVALID_CMD);
+    break;
+  }
+  if (ch->state == CHANNEL_RECEIVING) ch->state = CHANNEL_IDLE;
+}
 
-  if (frame.cid == 0 || (frame.cid == CID_BROADCAST && frame.init.cmd != CTAPHID_INIT)) {
-    CTAPHID_SendErrorResponse(frame.cid, ERR_INVALID_CID);
-    goto consume_frame;
+// An init frame on a channel whose request is queued or running
+static uint8_t CTAPHID_HandlePending(const CTAPHID_FRAME *rx, CTAPHID_Channel *ch) {
+  switch (rx->init.cmd) {
+  case CTAPHID_CANCEL:
+    DBG_MSG("CANCEL\n");
+    if (ch->state == CHANNEL_EXECUTING) return LOOP_CANCEL;
+    if (ch->state == CHANNEL_SENDING) break; // too late
+    CTAPHID_Dequeue(ch);
+    if (ch->cmd == CTAPHID_CBOR) {
+      CTAPHID_SendByte(ch->cid, CTAPHID_CBOR, CTAP2_ERR_KEEPALIVE_CANCEL);
+    }
+    break;
+  case CTAPHID_WINK:
+    DBG_MSG("WINK\n");
+    CTAPHID_SendResponse(ch, CTAPHID_WINK, 0);
+    break;
+  default:
+    CTAPHID_SendErrorResponse(rx->cid, ERR_CHANNEL_BUSY);
+    break;
   }
-  if (channel.state == CTAPHID_BUSY && frame.cid != channel.cid) {
-    CTAPHID_SendErrorResponse(frame.cid, ERR_CHANNEL_BUSY);
-    goto consume_frame;
+  return LOOP_SUCCESS;
+}
+
+static uint8_t CTAPHID_HandleFrame(const CTAPHID_FRAME *rx, uint8_t wait_for_user) {
+  if (rx->cid == 0 || (rx->cid == CID_BROADCAST && rx->init.cmd != CTAPHID_INIT)) {
+    CTAPHID_SendErrorResponse(rx->cid, ERR_INVALID_CID);
+    return LOOP_SUCCESS;
   }
 
-  channel.cid = frame.cid;
-  
-  if (FRAME_TYPE(frame) == TYPE_INIT) {
-    // DBG_MSG("CTAP init frame, cmd=0x%x\n", (int)frame.init.cmd);
-    if (!wait_for_user && channel.state == CTAPHID_BUSY && frame.init.cmd != CTAPHID_INIT) { // self abort is ok
-      DBG_MSG("wait_for_user=%d, cmd=0x%x\n", (int)wait_for_user, (int)frame.init.cmd);
-      channel.state = CTAPHID_IDLE;
-      CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_SEQ);
-      goto consume_frame;
+  CTAPHID_Channel *ch = CTAPHID_FindChannel(rx->cid);
+  if (FRAME_TYPE(*rx) == TYPE_INIT) {
+    // DBG_MSG("CTAP init frame, cmd=0x%x\n", (int)rx->init.cmd);
+    if (ch != NULL && ch->state != CHANNEL_RECEIVING) return CTAPHID_HandlePending(rx, ch);
+    if (ch != NULL && rx->init.cmd != CTAPHID_INIT) { // self abort is ok
+      DBG_MSG("cmd=0x%x while receiving\n", (int)rx->init.cmd);
+      ch->state = CHANNEL_IDLE;
+      CTAPHID_SendErrorResponse(ch->cid, ERR_INVALID_SEQ);
+      return LOOP_SUCCESS;
+    }
+    if (ch == NULL) ch = CTAPHID_AllocChannel();
+    if (ch == NULL) {
+      CTAPHID_SendErrorResponse(rx->cid, ERR_CHANNEL_BUSY);
+      return LOOP_SUCCESS;
     }
-    channel.bcnt_total = (uint16_t)MSG_LEN(frame);
-    if (channel.bcnt_total > MAX_CTAP_BUFSIZE) {
-      DBG_MSG("bcnt_total=%hu exceeds MAX_CTAP_BUFSIZE\n", channel.bcnt_total);
-      CTAPHID_SendErrorResponse(frame.cid, ERR_INVALID_LEN);
-      goto consume_frame;
+    ch->bcnt_total = (uint16_t)MSG_LEN(*rx);
+    if (ch->bcnt_total > MAX_CTAP_BUFSIZE) {
+      DBG_MSG("bcnt_total=%hu exceeds MAX_CTAP_BUFSIZE\n", ch->bcnt_total);
+      ch->state = CHANNEL_IDLE;
+      CTAPHID_SendErrorResponse(rx->cid, ERR_INVALID_LEN);
+      return LOOP_SUCCESS;
     }
     uint16_t copied;
-    channel.bcnt_current = copied = MIN(channel.bcnt_total, ISIZE);
-    channel.state = CTAPHID_BUSY;
-    channel.cmd = frame.init.cmd;
-    channel.seq = 0;
-    memcpy(channel.data, frame.init.data, copied);
-    channel.expire = device_get_tick() + CTAPHID_TRANS_TIMEOUT;
+    ch->bcnt_current = copied = MIN(ch->bcnt_total, ISIZE);
+    ch->cid = rx->cid;
+    ch->state = CHANNEL_RECEIVING;
+    ch->cmd = rx->init.cmd;
+    ch->seq = 0;
+    memcpy(ch->data, rx->init.data, copied);
+    ch->expire = device_get_tick() + CTAPHID_TRANS_TIMEOUT;
   } else {
-    // DBG_MSG("CTAP cont frame, state=%d cmd=0x%x seq=%d\n", (int)channel.state, (int)channel.cmd, (int)FRAME_SEQ(frame));
-    if (channel.state == CTAPHID_IDLE) goto consume_frame; // ignore spurious continuation packet
-    if (FRAME_SEQ(frame) != channel.seq++) {
-      DBG_MSG("seq=%d\n", (int)FRAME_SEQ(frame));
-      channel.state = CTAPHID_IDLE;
-      CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_SEQ);
-      goto consume_frame;
+    // DBG_MSG("CTAP cont frame, cmd=0x%x seq=%d\n", (int)ch->cmd, (int)FRAME_SEQ(*rx));
+    if (ch == NULL || ch->state != CHANNEL_RECEIVING) return LOOP_SUCCESS; // ignore spurious continuation packet
+    if (FRAME_SEQ(*rx) != ch->seq++) {
+      DBG_MSG("seq=%d\n", (int)FRAME_SEQ(*rx));
+      ch->state = CHANNEL_IDLE;
+      CTAPHID_SendErrorResponse(ch->cid, ERR_INVALID_SEQ);
+      return LOOP_SUCCESS;
     }
     uint16_t copied;
-    copied = MIN(channel.bcnt_total - channel.bcnt_current, CSIZE);
-    memcpy(channel.data + channel.bcnt_current, frame.cont.data, copied);
-    channel.bcnt_current += copied;
+    copied = MIN(ch->bcnt_total - ch->bcnt_current, CSIZE);
+    memcpy(ch->data + ch->bcnt_current, rx->cont.data, copied);
+    ch->bcnt_current += copied;
   }
-  has_frame = 0;
-
-  if (channel.bcnt_current == channel.bcnt_total) {
-    channel.expire = UINT32_MAX;
-    switch (channel.cmd) {
-    case CTAPHID_MSG:
-      DBG_MSG("MSG\n");
-      if (wait_for_user)
-        CTAPHID_SendErrorResponse(channel.cid, ERR_CHANNEL_BUSY);
-      else if (channel.bcnt_total < 4) // APDU CLA...P2
-        CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_LEN);
-      else
-        CTAPHID_Execute_Msg();
-      break;
-    case CTAPHID_CBOR:
-      DBG_MSG("CBOR\n");
-      if (wait_for_user)
-        CTAPHID_SendErrorResponse(channel.cid, ERR_CHANNEL_BUSY);
-      else if (channel.bcnt_total == 0)
-        CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_LEN);
-      else
-        CTAPHID_Execute_Cbor();
-      break;
-    case CTAPHID_INIT:
-      DBG_MSG("INIT\n");
-      if (wait_for_user)
-        CTAPHID_SendErrorResponse(channel.cid, ERR_CHANNEL_BUSY);
-      else
-        CTAPHID_Execute_Init();
-      break;
-    case CTAPHID_PING:
-      DBG_MSG("PING\n");
-      if (wait_for_user)
-        CTAPHID_SendErrorResponse(channel.cid, ERR_CHANNEL_BUSY);
-      else
-        CTAPHID_SendResponse(channel.cid, channel.cmd, channel.data, channel.bcnt_total);
-      break;
-     case CTAPHID_WINK:
-      DBG_MSG("WINK\n");
-      if (!wait_for_user) ctap_wink();
-      CTAPHID_SendResponse(channel.cid, channel.cmd, channel.data, 0);
-      break;
-    case CTAPHID_CANCEL:
-      DBG_MSG("CANCEL when wait_for_user=%d\n", (int)wait_for_user);
-      ret = LOOP_CANCEL;
-      break;
-    default:
-      DBG_MSG("Invalid CMD 0x%x\n", (int)channel.cmd);
-      CTAPHID_SendErrorResponse(channel.cid, ERR_INVALID_CMD);
-      break;
+
+  if (ch->bcnt_current == ch->bcnt_total) CTAPHID_Complete(ch, wait_for_user);
+  return LOOP_SUCCESS;
+}
+
+uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
+  uint8_t ret = LOOP_SUCCESS;
+  const uint32_t now = device_get_tick();
+  CTAPHID_Pump(); // retry a report refused by the endpoint
+  // every report or timeout may queue a reply, which must leave the reserved entries free
+  for (int i = 0; i < CTAPHID_CHANNEL_NUM && CTAPHID_TxFree() > TX_RESERVED; ++i) {
+    if (channels[i].state == CHANNEL_RECEIVING && now > channels[i].expire) {
+      DBG_MSG("CTAP Timeout\n");
+      channels[i].state = CHANNEL_IDLE;
+      CTAPHID_SendErrorResponse(channels[i].cid, ERR_MSG_TIMEOUT);
     }
-    channel.state = CTAPHID_IDLE;
   }
 
-consume_frame:
-  has_frame = 0;
+  // take at most a ring of reports, so that a host streaming reports cannot stall the loop
+  for (int i = 0; i < CTAPHID_RX_RING_SIZE && rx_tail != rx_head && CTAPHID_TxFree() > TX_RESERVED; ++i) {
+    device_mark_activity();
+    __sync_synchronize(); // read the report only after its index
+    ret = CTAPHID_HandleFrame(&rx_ring[rx_tail % CTAPHID_RX_RING_SIZE], wait_for_user);
+    __sync_synchronize(); // done with the slot before it is handed back
+    rx_tail = rx_tail + 1;
+    if (ret == LOOP_CANCEL) return ret;
+  }
+
+  // the queue is served in FIFO order, one request per loop, and never from within a running request
+  if (wait_for_user || current != NULL || queue_len == 0 || CTAPHID_TxFree() < TX_RESERVED) return ret;
+  current = &channels[queue[queue_head]];
+  queue_head = (queue_head + 1) % CTAPHID_CHANNEL_NUM;
+  --queue_len;
+  current->state = CHANNEL_EXECUTING;
+  if (current->cmd == CTAPHID_MSG)
+    CTAPHID_Execute_Msg(current);
+  else
+    CTAPHID_Execute_Cbor(current);
+  if (current->state == CHANNEL_EXECUTING) current->state = CHANNEL_IDLE; // no response queued
+  current = NULL;
   return ret;
 }
 
 void CTAPHID_SendKeepAlive(uint8_t status) {
-  memset(&frame, 0, sizeof(frame));
-  frame.cid = channel.cid;
-  frame.type = TYPE_INIT;
-  frame.init.cmd |= CTAPHID_KEEPALIVE;
-  frame.init.bcnth = 0;
-  frame.init.bcntl = 1;
-  frame.init.data[0] = status;
-  CTAPHID_SendFrame();
+  if (current == NULL) return;
+  // a keepalive still queued for the channel is as good as a new one
+  for (uint8_t i = tx_tail; i != tx_head; ++i) {
+    const CTAPHID_TxMessage *msg = &tx_queue[i % CTAPHID_TX_QUEUE_SIZE];
+    if (msg->cid == current->cid && msg->cmd == CTAPHID_KEEPALIVE && msg->seq == TX_SEQ_INIT) return;
+  }
+  CTAPHID_SendByte(current->cid, CTAPHID_KEEPALIVE, status);
 }
@@ -95,12 +95,34 @@ typedef struct {
 
 #define MAX_CTAP_BUFSIZE 1300
 
+// Number of channels assembled at the same time. Each takes about 1.3 KB of RAM for its buffer of MAX_CTAP_BUFSIZE.
+#ifndef CTAPHID_CHANNEL_NUM
+#define CTAPHID_CHANNEL_NUM 2
+#endif
+
+// Number of reports buffered from CTAPHID_OutEvent to CTAPHID_Loop, a power of 2 up to 128, 64 bytes each
+#ifndef CTAPHID_RX_RING_SIZE
+#define CTAPHID_RX_RING_SIZE 8
+#endif
+
+// Number of responses queued for transmission, a power of 2 up to 128, about 24 bytes each on 32-bit targets
+#ifndef CTAPHID_TX_QUEUE_SIZE
+#define CTAPHID_TX_QUEUE_SIZE 8
+#endif
+
+// Channel states
+#define CHANNEL_IDLE 0
+#define CHANNEL_RECEIVING 1 // assembling a message
+#define CHANNEL_READY 2     // waiting in the execution queue
+#define CHANNEL_EXECUTING 3
+#define CHANNEL_SENDING 4   // the buffer holds a response being sent
+
 typedef struct {
   uint32_t cid;
   uint16_t bcnt_total;
   uint16_t bcnt_current;
   uint32_t expire;
-  uint8_t state;
+  volatile uint8_t state;
   uint8_t cmd;
   uint8_t seq;
   alignas(4) uint8_t data[MAX_CTAP_BUFSIZE];
@@ -110,6 +132,10 @@ typedef struct _USBD_HandleTypeDef USBD_HandleTypeDef;
 
 uint8_t CTAPHID_Init(uint8_t (*send_report)(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len));
 uint8_t CTAPHID_OutEvent(uint8_t *data);
+// Number of reports dropped because the receive ring was full
+uint32_t CTAPHID_GetOverruns(void);
+// Called once the report passed to send_report has been sent
+void CTAPHID_InEvent(void);
 void CTAPHID_SendKeepAlive(uint8_t status);
 uint8_t CTAPHID_Loop(uint8_t wait_for_user);
 
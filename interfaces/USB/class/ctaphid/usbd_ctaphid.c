@@ -91,6 +91,7 @@ uint8_t USBD_CTAPHID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 
 uint8_t USBD_CTAPHID_DataIn() {
   hid_handle.state = CTAPHID_IDLE;
+  CTAPHID_InEvent();
   return USBD_OK;
 }
 
@@ -100,17 +101,11 @@ uint8_t USBD_CTAPHID_DataOut(USBD_HandleTypeDef *pdev) {
   return USBD_OK;
 }
 
+// Start sending a report without waiting, USBD_CTAPHID_DataIn tells when it is done
 uint8_t USBD_CTAPHID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
-  if (pdev->dev_state == USBD_STATE_CONFIGURED) {
-    volatile CTAPHID_StateTypeDef *state = &hid_handle.state;
-    int retry = 0;
-    while (*state != CTAPHID_IDLE) {
-      // if reports are not being processed on host, we may get stuck here
-      if (++retry > 50) return USBD_BUSY;
-      device_delay(1);
-    }
-    hid_handle.state = CTAPHID_BUSY;
-    USBD_LL_Transmit(pdev, EP_IN(ctap_hid), report, len);
-  }
+  if (pdev->dev_state != USBD_STATE_CONFIGURED) return USBD_FAIL;
+  if (hid_handle.state != CTAPHID_IDLE) return USBD_BUSY;
+  hid_handle.state = CTAPHID_BUSY;
+  USBD_LL_Transmit(pdev, EP_IN(ctap_hid), report, len);
   return USBD_OK;
 }
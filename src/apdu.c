@@ -148,6 +148,7 @@ int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh) {
 }
 
 void process_apdu(CAPDU *capdu, RAPDU *rapdu) {
+  device_mark_activity();
   if (CLA == 0xFF && INS == 0xEE && P1 == 0xFF && P2 == 0xEE) {
       // A special APDU to trigger Eject
       KBDHID_Eject();
@@ -25,3 +25,12 @@ void applets_poweroff(void) {
   openpgp_poweroff();
   ndef_poweroff();
 }
+
+int applets_idle(void) {
+  ctap_expire_secrets();
+  // one job at a time keeps the device responsive
+  if (ctap_fill_key_pool() > 0) return 1;
+  if (ctap_compact() > 0) return 1;
+  if (oath_compact() > 0) return 1;
+  return 0;
+}
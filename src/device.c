@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "common.h"
 #include <admin.h>
+#include <applets.h>
 #include <ccid.h>
 #include <ctaphid.h>
 #include <device.h>
@@ -9,18 +10,22 @@
 
 volatile static uint8_t touch_result;
 static uint8_t has_rf;
-static uint32_t last_blink, blink_timeout, blink_interval;
+static uint32_t last_blink, blink_timeout, blink_interval, last_activity;
 static enum { ON, OFF } led_status;
 typedef enum { WAIT_NONE = 1, WAIT_CCID, WAIT_CTAPHID, WAIT_DEEP, WAIT_DEEP_TOUCHED, WAIT_DEEP_CANCEL } wait_status_t;
 volatile static wait_status_t wait_status = WAIT_NONE; // WAIT_NONE is not 0, hence inited
 
 uint8_t device_is_blinking(void) { return blink_timeout != 0; }
 
+void device_mark_activity(void) { last_activity = device_get_tick(); }
+
 void device_loop(void) {
   CCID_Loop();
   CTAPHID_Loop(0);
   WebUSB_Loop();
   KBDHID_Loop();
+  // once all work is done, wait for another idle period before retrying
+  if (device_get_tick() - last_activity >= DEVICE_IDLE_TIME && applets_idle() == 0) device_mark_activity();
 }
 
 bool device_allow_kbd_touch(void) {
@@ -4,126 +4,521 @@
 
 static lfs_t lfs;
 
-static alignas(4) uint8_t file_buffer[LFS_CACHE_SIZE];
+/*
+ * Open file handles are kept in a small LRU cache so that repeated accesses
+ * to the same file (e.g. record scans) skip the metadata walk of open/close.
+ *
+ * littlefs does not keep the data of two handles of the same file coherent,
+ * hence every access to a path goes through its single cached handle. Each
+ * write is followed by lfs_file_sync, so a cached handle never holds pending
+ * data and the on-flash state is the same as with open/write/close. The only
+ * exception is fs_append_nosync, whose data are committed by fs_sync or when
+ * the handle is closed.
+ *
+ * One slot more than FS_HANDLE_CACHE_SIZE is kept, so that a file is opened
+ * into a free slot and the LRU handle is only closed once the open succeeded.
+ */
+#define HANDLE_SLOTS (FS_HANDLE_CACHE_SIZE + 1)
 
-static struct lfs_file_config file_config = {
-    .buffer = file_buffer
-};
+typedef struct {
+  char path[FS_PATH_MAX];
+  lfs_file_t file;
+  struct lfs_file_config config;
+  alignas(4) uint8_t buffer[LFS_CACHE_SIZE];
+  uint32_t stamp; // 0 for unused
+} fs_handle_t;
 
-int fs_format(const struct lfs_config *cfg) { return lfs_format(&lfs, cfg); }
+static fs_handle_t handles[HANDLE_SLOTS];
+static uint32_t handle_clock;
 
-int fs_mount(const struct lfs_config *cfg) { return lfs_mount(&lfs, cfg); }
+// lfs_fs_size traverses the whole file system, so its result is kept until the next modification
+static lfs_ssize_t used_blocks = -1;
+
+static void usage_invalidate(void) { used_blocks = -1; }
+
+/*
+ * I/O counters, broken down by the prefix of the path being accessed. Every
+ * fs call sets io_bucket before it reaches littlefs, so the block device
+ * calls made on its behalf are charged to the same bucket.
+ */
+static const char *const io_prefixes[FS_STATS_BUCKETS - 1] = {"ctap_", "piv-", "pgp-", "oath", "pass", "admin", "store_"};
+static fs_io_stats_t io_stats[FS_STATS_BUCKETS];
+static uint8_t io_bucket = FS_STATS_BUCKETS - 1;
+static struct lfs_config io_cfg; // the config given to littlefs, with counting block device callbacks
+static const struct lfs_config *bd_cfg;
+
+static fs_io_stats_t *io_begin(const char *path) {
+  io_bucket = FS_STATS_BUCKETS - 1;
+  if (path != NULL) {
+    for (uint8_t i = 0; i < FS_STATS_BUCKETS - 1; ++i) {
+      if (strncmp(path, io_prefixes[i], strlen(io_prefixes[i])) == 0) {
+        io_bucket = i;
+        break;
+      }
+    }
+  }
+  return &io_stats[io_bucket];
+}
+
+static int io_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+  UNUSED(c);
+  ++io_stats[io_bucket].block_reads;
+  return bd_cfg->read(bd_cfg, block, off, buffer, size);
+}
+
+static int io_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                   lfs_size_t size) {
+  UNUSED(c);
+  ++io_stats[io_bucket].block_progs;
+  return bd_cfg->prog(bd_cfg, block, off, buffer, size);
+}
+
+static int io_erase(const struct lfs_config *c, lfs_block_t block) {
+  UNUSED(c);
+  ++io_stats[io_bucket].block_erases;
+  return bd_cfg->erase(bd_cfg, block);
+}
+
+static int io_sync(const struct lfs_config *c) {
+  UNUSED(c);
+  return bd_cfg->sync(bd_cfg);
+}
+
+static const struct lfs_config *io_wrap(const struct lfs_config *cfg) {
+  bd_cfg = cfg;
+  io_cfg = *cfg;
+  io_cfg.read = io_read;
+  io_cfg.prog = io_prog;
+  io_cfg.erase = io_erase;
+  io_cfg.sync = io_sync;
+  io_begin(NULL);
+  return &io_cfg;
+}
+
+static void handle_close(fs_handle_t *h) {
+  lfs_file_close(&lfs, &h->file);
+  h->stamp = 0;
+}
+
+static fs_handle_t *handle_lookup(const char *path) {
+  for (int i = 0; i < HANDLE_SLOTS; ++i)
+    if (handles[i].stamp != 0 && strcmp(handles[i].path, path) == 0) return &handles[i];
+  return NULL;
+}
+
+static fs_handle_t *handle_free_slot(void) {
+  for (int i = 0; i < HANDLE_SLOTS; ++i)
+    if (handles[i].stamp == 0) return &handles[i];
+  return NULL; // never, at most FS_HANDLE_CACHE_SIZE handles are open
+}
+
+// close the least recently used handle if more than FS_HANDLE_CACHE_SIZE are open
+static void handle_evict(void) {
+  fs_handle_t *lru = NULL;
+  int n_open = 0;
+  for (int i = 0; i < HANDLE_SLOTS; ++i) {
+    if (handles[i].stamp == 0) continue;
+    ++n_open;
+    if (lru == NULL || handles[i].stamp < lru->stamp) lru = &handles[i];
+  }
+  if (n_open > FS_HANDLE_CACHE_SIZE) handle_close(lru);
+}
+
+static int handle_get(const char *path, int create, fs_handle_t **out) {
+  fs_handle_t *h = handle_lookup(path);
+  if (h == NULL) {
+    if (strlen(path) >= FS_PATH_MAX) return LFS_ERR_NAMETOOLONG;
+    h = handle_free_slot();
+    h->config.buffer = h->buffer;
+    int err = lfs_file_opencfg(&lfs, &h->file, path, create ? LFS_O_RDWR | LFS_O_CREAT : LFS_O_RDWR, &h->config);
+    if (err < 0) return err; // the cached handles are untouched
+    strcpy(h->path, path);
+    h->stamp = UINT32_MAX; // the newest, kept by handle_evict
+    handle_evict();
+  }
+  if (++handle_clock == 0) { // wrapped, restart the ages
+    for (int i = 0; i < HANDLE_SLOTS; ++i)
+      if (handles[i].stamp != 0) handles[i].stamp = 1;
+    handle_clock = 2;
+  }
+  h->stamp = handle_clock;
+  *out = h;
+  return 0;
+}
+
+static void handle_drop_all(void) {
+  // the handles belong to the previous lfs instance, forget them without touching the flash
+  for (int i = 0; i < HANDLE_SLOTS; ++i) handles[i].stamp = 0;
+}
+
+int fs_flush(void) {
+  int ret = 0;
+  io_begin(NULL);
+  for (int i = 0; i < HANDLE_SLOTS; ++i) {
+    if (handles[i].stamp == 0) continue;
+    int err = lfs_file_close(&lfs, &handles[i].file);
+    if (err < 0) ret = err;
+    handles[i].stamp = 0;
+  }
+  return ret;
+}
+
+void fs_invalidate(const char *path) {
+  fs_handle_t *h = handle_lookup(path);
+  if (h != NULL) handle_close(h);
+}
+
+int fs_format(const struct lfs_config *cfg) {
+  usage_invalidate();
+  handle_drop_all();
+  return lfs_format(&lfs, io_wrap(cfg));
+}
+
+int fs_mount(const struct lfs_config *cfg) {
+  usage_invalidate();
+  handle_drop_all();
+  return lfs_mount(&lfs, io_wrap(cfg));
+}
 
 int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
-  lfs_file_t f;
+  fs_handle_t *h;
   lfs_ssize_t read_length;
-  int err = lfs_file_opencfg(&lfs, &f, path, LFS_O_RDONLY, &file_config);
+  fs_io_stats_t *stats = io_begin(path);
+  int err = handle_get(path, 0, &h);
   if (err < 0) return err;
-  err = lfs_file_seek(&lfs, &f, off, LFS_SEEK_SET);
+  err = lfs_file_seek(&lfs, &h->file, off, LFS_SEEK_SET);
   if (err < 0) goto err_close;
-  read_length = lfs_file_read(&lfs, &f, buf, len);
+  read_length = lfs_file_read(&lfs, &h->file, buf, len);
   if (read_length < 0) {
     err = read_length;
     goto err_close;
   }
-  err = lfs_file_close(&lfs, &f);
-  if (err < 0) return err;
+  stats->bytes_read += read_length;
   return read_length;
 
 err_close:
-  lfs_file_close(&lfs, &f);
+  handle_close(h);
   return err;
 }
 
 int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc) {
-  lfs_file_t f;
+  fs_handle_t *h;
+  fs_io_stats_t *stats = io_begin(path);
+  usage_invalidate();
 #ifdef TEST
   if (testmode_err_triggered(path, true)) {
     return LFS_ERR_IO;
   }
 #endif
-  int flags = LFS_O_WRONLY | LFS_O_CREAT;
-  if (trunc) flags |= LFS_O_TRUNC;
-  int err = lfs_file_opencfg(&lfs, &f, path, flags, &file_config);
+  int err = handle_get(path, 1, &h);
   if (err < 0) return err;
-  err = lfs_file_seek(&lfs, &f, off, LFS_SEEK_SET);
+  if (trunc) {
+    err = lfs_file_truncate(&lfs, &h->file, 0);
+    if (err < 0) goto err_close;
+  }
+  err = lfs_file_seek(&lfs, &h->file, off, LFS_SEEK_SET);
   if (err < 0) goto err_close;
   if (len > 0) {
-    err = lfs_file_write(&lfs, &f, buf, len);
+    err = lfs_file_write(&lfs, &h->file, buf, len);
     if (err < 0) goto err_close;
+    stats->bytes_written += len;
   }
-  err = lfs_file_close(&lfs, &f);
-  if (err < 0) return err;
+  err = lfs_file_sync(&lfs, &h->file);
+  if (err < 0) goto err_close;
+  ++stats->commits;
   return 0;
   err_close:
-  lfs_file_close(&lfs, &f);
+  handle_close(h);
   return err;
 }
 
 int append_file(const char *path, const void *buf, lfs_size_t len) {
-  lfs_file_t f;
-  int err = lfs_file_opencfg(&lfs, &f, path, LFS_O_WRONLY | LFS_O_CREAT, &file_config);
+  fs_handle_t *h;
+  fs_io_stats_t *stats = io_begin(path);
+  usage_invalidate();
+  int err = handle_get(path, 1, &h);
   if (err < 0) return err;
-  err = lfs_file_seek(&lfs, &f, 0, LFS_SEEK_END);
+  err = lfs_file_seek(&lfs, &h->file, 0, LFS_SEEK_END);
   if (err < 0) goto err_close;
   if (len > 0) {
-    err = lfs_file_write(&lfs, &f, buf, len);
+    err = lfs_file_write(&lfs, &h->file, buf, len);
     if (err < 0) goto err_close;
+    stats->bytes_written += len;
   }
-  err = lfs_file_close(&lfs, &f);
-  if (err < 0) return err;
+  err = lfs_file_sync(&lfs, &h->file);
+  if (err < 0) goto err_close;
+  ++stats->commits;
   return 0;
   err_close:
-  lfs_file_close(&lfs, &f);
+  handle_close(h);
   return err;
 }
 
+int fs_append_nosync(const char *path, const void *buf, lfs_size_t len) {
+  fs_handle_t *h;
+  fs_io_stats_t *stats = io_begin(path);
+  usage_invalidate();
+  int err = handle_get(path, 1, &h);
+  if (err < 0) return err;
+  err = lfs_file_seek(&lfs, &h->file, 0, LFS_SEEK_END);
+  if (err >= 0 && len > 0) err = lfs_file_write(&lfs, &h->file, buf, len);
+  if (err < 0) {
+    handle_close(h);
+    return err;
+  }
+  stats->bytes_written += len;
+  return 0;
+}
+
+int fs_sync(const char *path) {
+  fs_handle_t *h = handle_lookup(path);
+  if (h == NULL) return 0; // the data were committed when the handle was closed
+  fs_io_stats_t *stats = io_begin(path);
+  int err = lfs_file_sync(&lfs, &h->file);
+  if (err < 0) {
+    handle_close(h);
+    return err;
+  }
+  ++stats->commits;
+  return 0;
+}
+
 int truncate_file(const char *path, lfs_size_t len) {
-  lfs_file_t f;
-  int flags = LFS_O_WRONLY | LFS_O_CREAT;
-  int err = lfs_file_opencfg(&lfs, &f, path, flags, &file_config);
+  fs_handle_t *h;
+  fs_io_stats_t *stats = io_begin(path);
+  usage_invalidate();
+  int err = handle_get(path, 1, &h);
   if (err < 0) return err;
-  err = lfs_file_truncate(&lfs, &f, len);
+  err = lfs_file_truncate(&lfs, &h->file, len);
   if (err < 0) goto err_close;
-  err = lfs_file_close(&lfs, &f);
-  if (err < 0) return err;
+  err = lfs_file_sync(&lfs, &h->file);
+  if (err < 0) goto err_close;
+  ++stats->commits;
   return 0;
   err_close:
-  lfs_file_close(&lfs, &f);
+  handle_close(h);
+  return err;
+}
+
+int fs_read_records(const char *path, int first_index, int count, void *record, lfs_size_t record_size,
+                    fs_record_visitor visitor, void *user) {
+  fs_handle_t *h;
+  fs_io_stats_t *stats = io_begin(path);
+  int err = handle_get(path, 0, &h);
+  if (err < 0) return err;
+  lfs_soff_t size = lfs_file_size(&lfs, &h->file);
+  if (size < 0) {
+    handle_close(h);
+    return size;
+  }
+  int n_records = (int) (size / record_size);
+  if (count >= 0 && first_index + count < n_records) n_records = first_index + count;
+  for (int i = first_index; i < n_records; ++i) {
+    // the visitor may access other files or this one, so look up the handle and seek every time
+    io_begin(path);
+    err = handle_get(path, 0, &h);
+    if (err < 0) return err;
+    err = lfs_file_seek(&lfs, &h->file, i * record_size, LFS_SEEK_SET);
+    if (err < 0) goto err_close;
+    lfs_ssize_t read_length = lfs_file_read(&lfs, &h->file, record, record_size);
+    if (read_length < 0) {
+      err = read_length;
+      goto err_close;
+    }
+    if (read_length != (lfs_ssize_t) record_size) return 0; // the file was truncated by the visitor
+    stats->bytes_read += read_length;
+    err = visitor(i, record, user);
+    if (err != 0) return err;
+  }
+  return 0;
+
+err_close:
+  handle_close(h);
   return err;
 }
 
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len) {
-  return lfs_getattr(&lfs, path, attr, buf, len);
+  fs_io_stats_t *stats = io_begin(path);
+  int ret = lfs_getattr(&lfs, path, attr, buf, len);
+  if (ret > 0) stats->bytes_read += ret;
+  return ret;
 }
 
 int write_attr(const char *path, uint8_t attr, const void *buf, lfs_size_t len) {
-  return lfs_setattr(&lfs, path, attr, buf, len);
+  fs_io_stats_t *stats = io_begin(path);
+  usage_invalidate();
+  int err = lfs_setattr(&lfs, path, attr, buf, len);
+  if (err < 0) return err;
+  stats->bytes_written += len;
+  ++stats->commits;
+  return err;
+}
+
+void fs_txn_begin(fs_txn_t *txn, const char *path) {
+  txn->path = path;
+  txn->attr_count = 0;
+  txn->write_count = 0;
+  txn->truncate = -1;
+}
+
+int fs_txn_setattr(fs_txn_t *txn, uint8_t attr, const void *buf, lfs_size_t len) {
+  for (int i = 0; i < txn->attr_count; ++i) {
+    if (txn->attrs[i].type == attr) { // the later update wins
+      txn->attrs[i].buffer = (void *) buf;
+      txn->attrs[i].size = len;
+      return 0;
+    }
+  }
+  if (txn->attr_count == FS_TXN_MAX_ATTRS) return LFS_ERR_NOSPC;
+  txn->attrs[txn->attr_count].type = attr;
+  txn->attrs[txn->attr_count].buffer = (void *) buf; // only read when opened for writing
+  txn->attrs[txn->attr_count].size = len;
+  ++txn->attr_count;
+  return 0;
+}
+
+int fs_txn_write(fs_txn_t *txn, lfs_soff_t off, const void *buf, lfs_size_t len) {
+  if (txn->write_count == FS_TXN_MAX_WRITES) return LFS_ERR_NOSPC;
+  txn->writes[txn->write_count].buf = buf;
+  txn->writes[txn->write_count].off = off;
+  txn->writes[txn->write_count].len = len;
+  ++txn->write_count;
+  return 0;
+}
+
+void fs_txn_truncate(fs_txn_t *txn, lfs_size_t size) { txn->truncate = (lfs_soff_t) size; }
+
+/*
+ * A transaction opens the file write-only in the spare handle slot, with its attrs in the config. littlefs
+ * marks a file opened for writing with attrs dirty, so closing it commits the file struct (including inline
+ * data) and all the attrs at once, even if the truncation and the writes change nothing. A write-only open
+ * does not read the attrs into their buffers, which hold the new values.
+ */
+int fs_txn_commit(fs_txn_t *txn) {
+  fs_io_stats_t *stats = io_begin(txn->path);
+  usage_invalidate();
+  if (txn->write_count == 0 && txn->attr_count == 0 && txn->truncate < 0) return 0;
+  ++stats->commits;
+  for (int i = 0; i < txn->write_count; ++i) stats->bytes_written += txn->writes[i].len;
+  for (int i = 0; i < txn->attr_count; ++i) stats->bytes_written += txn->attrs[i].size;
+  // a seek failing between two writes would leave the first one to be committed alone
+  int err = 0;
+  for (int i = 0; i < txn->write_count; ++i)
+    if (txn->writes[i].off < 0 || (lfs_size_t) txn->writes[i].off + txn->writes[i].len > LFS_FILE_MAX)
+      err = LFS_ERR_INVAL;
+  if (err == 0 && strlen(txn->path) >= FS_PATH_MAX) err = LFS_ERR_NAMETOOLONG;
+  if (err < 0) goto done;
+
+  // the cached handle would not see the data written through another one
+  fs_invalidate(txn->path);
+  fs_handle_t *h = handle_free_slot();
+  h->config.buffer = h->buffer;
+  h->config.attrs = txn->attrs;
+  h->config.attr_count = txn->attr_count;
+  err = lfs_file_opencfg(&lfs, &h->file, txn->path, txn->truncate >= 0 ? LFS_O_WRONLY | LFS_O_CREAT : LFS_O_WRONLY,
+                         &h->config);
+  if (err < 0) goto done;
+  if (txn->truncate >= 0) err = lfs_file_truncate(&lfs, &h->file, txn->truncate);
+  for (int i = 0; i < txn->write_count && err >= 0; ++i) {
+    err = lfs_file_seek(&lfs, &h->file, txn->writes[i].off, LFS_SEEK_SET);
+    if (err >= 0) err = lfs_file_write(&lfs, &h->file, txn->writes[i].buf, txn->writes[i].len);
+  }
+  // A failed write leaves the file erred, which littlefs never syncs. The truncation fails before any data
+  // is written, so then only the attrs have to be kept from the commit on close.
+  if (err < 0) h->config.attr_count = 0;
+  const int close_err = lfs_file_close(&lfs, &h->file);
+  if (err >= 0) err = close_err;
+  h->config.attrs = NULL;
+  h->config.attr_count = 0;
+
+done:
+  txn->attr_count = 0;
+  txn->write_count = 0;
+  txn->truncate = -1;
+  return err < 0 ? err : 0;
 }
 
 int get_file_size(const char *path) {
-  lfs_file_t f;
-  int err = lfs_file_opencfg(&lfs, &f, path, LFS_O_RDONLY, &file_config);
-  if (err < 0) return err;
-  int size = lfs_file_size(&lfs, &f);
-  if (size < 0) {
-    err = size;
-    goto err_close;
+  io_begin(path);
+  // a cached handle knows the size; otherwise stat the file, which neither opens it nor evicts another handle
+  fs_handle_t *h = handle_lookup(path);
+  if (h != NULL) {
+    int size = lfs_file_size(&lfs, &h->file);
+    if (size < 0) handle_close(h);
+    return size;
   }
-  err = lfs_file_close(&lfs, &f);
+  struct lfs_info info;
+  int err = lfs_stat(&lfs, path, &info);
   if (err < 0) return err;
-  return size;
-  err_close:
-  lfs_file_close(&lfs, &f);
-  return err;
+  return (int) info.size;
+}
+
+int fs_exists(const char *path) {
+  io_begin(path);
+  if (handle_lookup(path) != NULL) return 1;
+  struct lfs_info info;
+  int err = lfs_stat(&lfs, path, &info);
+  if (err == LFS_ERR_NOENT) return 0;
+  return err < 0 ? err : 1;
 }
 
 int get_fs_size(void) { return (int) (lfs.cfg->block_size * lfs.cfg->block_count) / 1024; }
 
 int get_fs_usage(void) {
-  int blocks = lfs_fs_size(&lfs);
+  int blocks = get_fs_used_blocks();
   if (blocks < 0) return blocks;
   return (int) (lfs.cfg->block_size * blocks) / 1024;
 }
 
-int fs_rename(const char *old, const char *new) { return lfs_rename(&lfs, old, new); }
+int get_fs_used_blocks(void) {
+  io_begin(NULL);
+  if (used_blocks < 0) used_blocks = lfs_fs_size(&lfs);
+  return (int) used_blocks;
+}
+
+int get_fs_block_count(void) { return (int) lfs.cfg->block_count; }
+
+int get_fs_block_size(void) { return (int) lfs.cfg->block_size; }
+
+int fs_list_files(int first_index, fs_file_visitor visitor, void *user) {
+  lfs_dir_t dir;
+  struct lfs_info info;
+  io_begin(NULL);
+  int err = lfs_dir_open(&lfs, &dir, "/");
+  if (err < 0) return err;
+  int index = 0;
+  while ((err = lfs_dir_read(&lfs, &dir, &info)) > 0) {
+    if (info.type != LFS_TYPE_REG) continue;
+    if (index >= first_index) {
+      // every write is synced, so the size in the directory entry is up to date
+      err = visitor(index, info.name, info.size, user);
+      if (err != 0) break;
+    }
+    ++index;
+  }
+  lfs_dir_close(&lfs, &dir);
+  return err;
+}
+
+int fs_rename(const char *old, const char *new) {
+  ++io_begin(new)->commits;
+  usage_invalidate();
+  fs_invalidate(old);
+  fs_invalidate(new);
+  return lfs_rename(&lfs, old, new);
+}
+
+int fs_remove(const char *path) {
+  ++io_begin(path)->commits;
+  usage_invalidate();
+  fs_invalidate(path);
+  return lfs_remove(&lfs, path);
+}
+
+void fs_get_io_stats(fs_io_stats_t stats[FS_STATS_BUCKETS]) { memcpy(stats, io_stats, sizeof(io_stats)); }
+
+const char *fs_io_stats_prefix(int bucket) {
+  return bucket >= 0 && bucket < FS_STATS_BUCKETS - 1 ? io_prefixes[bucket] : "";
+}
+
+void fs_reset_io_stats(void) { memset(io_stats, 0, sizeof(io_stats)); }
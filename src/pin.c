@@ -9,11 +9,28 @@
 #define DEFAULT_RETRY_ATTR 1
 
 int pin_create(const pin_t *pin, const void *buf, uint8_t len, uint8_t max_retries) {
-  int err = write_file(pin->path, buf, 0, len, 1);
+  fs_txn_t txn;
+  fs_txn_begin(&txn, pin->path);
+  fs_txn_truncate(&txn, 0);
+  fs_txn_write(&txn, 0, buf, len);
+  fs_txn_setattr(&txn, RETRY_ATTR, &max_retries, sizeof(max_retries));
+  fs_txn_setattr(&txn, DEFAULT_RETRY_ATTR, &max_retries, sizeof(max_retries));
+  int err = fs_txn_commit(&txn);
   if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &max_retries, sizeof(max_retries));
+  return 0;
+}
+
+// Replace the PIN, which may be empty, and reset the retry counter in one commit
+static int pin_reset(const pin_t *pin, const void *buf, uint8_t len) {
+  uint8_t ctr;
+  int err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
   if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, DEFAULT_RETRY_ATTR, &max_retries, sizeof(max_retries));
+  fs_txn_t txn;
+  fs_txn_begin(&txn, pin->path);
+  fs_txn_truncate(&txn, 0);
+  if (len > 0) fs_txn_write(&txn, 0, buf, len);
+  fs_txn_setattr(&txn, RETRY_ATTR, &ctr, sizeof(ctr));
+  err = fs_txn_commit(&txn);
   if (err < 0) return PIN_IO_FAIL;
   return 0;
 }
@@ -43,31 +60,20 @@ int pin_verify(pin_t *pin, const void *buf, uint8_t len, uint8_t *retries) {
 #endif
   }
   pin->is_validated = 1;
+  memzero(pin_buf, sizeof(pin_buf));
+  const uint8_t remaining = ctr;
   err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) {
-    memzero(pin_buf, sizeof(pin_buf));
-    return PIN_IO_FAIL;
-  }
+  if (err < 0) return PIN_IO_FAIL;
+  if (ctr == remaining) return 0; // nothing to reset, save a commit
   err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) {
-    memzero(pin_buf, sizeof(pin_buf));
-    return PIN_IO_FAIL;
-  }
-  memzero(pin_buf, sizeof(pin_buf));
+  if (err < 0) return PIN_IO_FAIL;
   return 0;
 }
 
 int pin_update(pin_t *pin, const void *buf, uint8_t len) {
   if (len < pin->min_length || len > pin->max_length) return PIN_LENGTH_INVALID;
   pin->is_validated = 0;
-  int err = write_file(pin->path, buf, 0, len, 1);
-  if (err < 0) return PIN_IO_FAIL;
-  uint8_t ctr;
-  err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) return PIN_IO_FAIL;
-  return 0;
+  return pin_reset(pin, buf, len);
 }
 
 int pin_get_size(const pin_t *pin) { return get_file_size(pin->path); }
@@ -88,13 +94,4 @@ int pin_get_default_retries(const pin_t *pin) {
   return ctr;
 }
 
-int pin_clear(const pin_t *pin) {
-  int err = write_file(pin->path, NULL, 0, 0, 1);
-  if (err < 0) return PIN_IO_FAIL;
-  uint8_t ctr;
-  err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) return PIN_IO_FAIL;
-  return 0;
-}
+int pin_clear(const pin_t *pin) { return pin_reset(pin, NULL, 0); }
@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <store.h>
+
+#define SLOT_LIVE           0xA5
+#define SLOT_FREE           0x5A
+#define KEEP_ATTR_MAX_SIZE  64
+
+typedef struct {
+  uint16_t crc; // of the record, valid when live
+  uint8_t state;
+  uint8_t next; // the next free slot, valid when free
+} __packed store_slot_t;
+
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t) (*data++ << 8);
+    for (int i = 0; i < 8; ++i)
+      crc = crc & 0x8000 ? (uint16_t) ((crc << 1) ^ 0x1021) : (uint16_t) (crc << 1);
+  }
+  return crc;
+}
+
+static lfs_soff_t slot_offset(const store_t *store, int index) {
+  return (lfs_soff_t) index * (lfs_soff_t) (sizeof(store_slot_t) + store->record_size);
+}
+
+static int read_slot(const store_t *store, int index, store_slot_t *slot) {
+  int err = read_file(store->path, slot, slot_offset(store, index), sizeof(store_slot_t));
+  if (err < 0) return err;
+  return err == sizeof(store_slot_t) ? 0 : LFS_ERR_CORRUPT;
+}
+
+// append a slot to a file being rebuilt, which is committed by finish_rebuild
+static int append_slot(const store_t *store, const char *path, const store_slot_t *slot, const void *record) {
+  int err = fs_append_nosync(path, slot, sizeof(store_slot_t));
+  if (err < 0) return err;
+  return fs_append_nosync(path, record, store->record_size);
+}
+
+// commit the slots appended to a rebuilt file, which must hold n_slots of them
+static int finish_rebuild(const store_t *store, const char *path, int n_slots) {
+  int err = fs_sync(path);
+  if (err < 0) return err;
+  err = get_file_size(path);
+  if (err < 0) return err;
+  return err == slot_offset(store, n_slots) ? 0 : LFS_ERR_CORRUPT;
+}
+
+static int copy_keep_attrs(const store_t *store, const char *path) {
+  for (int i = 0; i < store->keep_attr_count; ++i) {
+    uint8_t buf[KEEP_ATTR_MAX_SIZE];
+    int len = read_attr(store->path, store->keep_attrs[i], buf, sizeof(buf));
+    if (len == LFS_ERR_NOATTR) continue;
+    if (len < 0) return len;
+    if (len > (int) sizeof(buf)) return LFS_ERR_NOSPC;
+    int err = write_attr(path, store->keep_attrs[i], buf, len);
+    if (err < 0) return err;
+  }
+  return 0;
+}
+
+static int create_empty(const char *path) {
+  int err = fs_remove(path); // may be left by an interrupted rebuild
+  if (err < 0 && err != LFS_ERR_NOENT) return err;
+  return write_file(path, NULL, 0, 0, 1);
+}
+
+typedef struct {
+  const store_t *store;
+  store_header_t header;
+} store_migration;
+
+// fs_read_records visitor, copies a legacy record into a slot of STORE_TMP_FILE
+static int migrate_record(int index, void *record, void *user) {
+  store_migration *migration = user;
+  const store_t *store = migration->store;
+  store_slot_t slot = {.crc = 0, .state = SLOT_FREE, .next = migration->header.free_head};
+  if (index >= store->capacity) return LFS_ERR_FBIG;
+  if (store->legacy_live == NULL || store->legacy_live(record)) {
+    slot.crc = crc16(record, store->record_size);
+    slot.state = SLOT_LIVE;
+    slot.next = STORE_NIL;
+    ++migration->header.n_live;
+  } else {
+    migration->header.free_head = (uint8_t) index;
+  }
+  return append_slot(store, STORE_TMP_FILE, &slot, record);
+}
+
+// Rebuild the file in STORE_TMP_FILE, then replace the original one with it.
+// The original file stays untouched until the final rename.
+static int migrate(const store_t *store, void *record) {
+  DBG_MSG("Migrating %s\n", store->path);
+  store_migration migration = {.store = store, .header = {.version = STORE_VERSION, .free_head = STORE_NIL}};
+  int err = create_empty(STORE_TMP_FILE);
+  if (err < 0) return err;
+  err = fs_read_records(store->path, 0, -1, record, store->record_size, migrate_record, &migration);
+  if (err < 0) return err;
+  const int size = get_file_size(store->path);
+  if (size < 0) return size;
+  err = finish_rebuild(store, STORE_TMP_FILE, size / store->record_size);
+  if (err < 0) return err;
+  err = copy_keep_attrs(store, STORE_TMP_FILE);
+  if (err < 0) return err;
+  err = write_attr(STORE_TMP_FILE, STORE_ATTR, &migration.header, sizeof(migration.header));
+  if (err < 0) return err;
+  return fs_rename(STORE_TMP_FILE, store->path);
+}
+
+int store_open(store_t *store, void *record) {
+  int err = read_attr(store->path, STORE_ATTR, &store->header, sizeof(store->header));
+  if (err == LFS_ERR_NOATTR) {
+    err = migrate(store, record);
+    if (err < 0) return err;
+    err = read_attr(store->path, STORE_ATTR, &store->header, sizeof(store->header));
+  }
+  if (err < 0) return err;
+  if (err != sizeof(store->header) || store->header.version != STORE_VERSION) return LFS_ERR_CORRUPT;
+  const int size = get_file_size(store->path);
+  if (size < 0) return size;
+  store->n_slots = (uint8_t) (size / slot_offset(store, 1));
+  if (store->n_slots == 0) { // truncated by an interrupted store_format
+    store->header.free_head = STORE_NIL;
+    store->header.n_live = 0;
+  }
+  return 0;
+}
+
+int store_format(store_t *store) {
+  int err = write_file(store->path, NULL, 0, 0, 1);
+  if (err < 0) return err;
+  store->header.version = STORE_VERSION;
+  store->header.free_head = STORE_NIL;
+  store->header.n_live = 0;
+  store->n_slots = 0;
+  return write_attr(store->path, STORE_ATTR, &store->header, sizeof(store->header));
+}
+
+int store_next_index(const store_t *store) {
+  if (store->header.free_head != STORE_NIL) return store->header.free_head;
+  if (store->n_slots >= store->capacity) return LFS_ERR_NOSPC;
+  return store->n_slots;
+}
+
+int store_alloc(store_t *store, const void *record) {
+  const int index = store_next_index(store);
+  if (index < 0) return index;
+  store_header_t header = store->header;
+  store_slot_t slot;
+  if (index == header.free_head) {
+    int err = read_slot(store, index, &slot);
+    if (err < 0) return err;
+    if (slot.state != SLOT_FREE) {
+      ERR_MSG("Broken free-list at %d of %s\n", index, store->path);
+      return LFS_ERR_CORRUPT;
+    }
+    header.free_head = slot.next;
+  }
+  ++header.n_live;
+  slot.crc = crc16(record, store->record_size);
+  slot.state = SLOT_LIVE;
+  slot.next = STORE_NIL;
+  fs_txn_t txn;
+  fs_txn_begin(&txn, store->path);
+  fs_txn_write(&txn, slot_offset(store, index), &slot, sizeof(slot));
+  fs_txn_write(&txn, slot_offset(store, index) + sizeof(slot), record, store->record_size);
+  fs_txn_setattr(&txn, STORE_ATTR, &header, sizeof(header));
+  int err = fs_txn_commit(&txn);
+  if (err < 0) return err;
+  store->header = header;
+  if (index == store->n_slots) ++store->n_slots;
+  return index;
+}
+
+int store_write(store_t *store, int index, const void *record) {
+  if (index < 0 || index >= store->n_slots) return LFS_ERR_NOENT;
+  store_slot_t slot;
+  int err = read_slot(store, index, &slot);
+  if (err < 0) return err;
+  if (slot.state != SLOT_LIVE) return LFS_ERR_NOENT;
+  slot.crc = crc16(record, store->record_size);
+  fs_txn_t txn;
+  fs_txn_begin(&txn, store->path);
+  fs_txn_write(&txn, slot_offset(store, index), &slot, sizeof(slot));
+  fs_txn_write(&txn, slot_offset(store, index) + sizeof(slot), record, store->record_size);
+  return fs_txn_commit(&txn);
+}
+
+int store_read(store_t *store, int index, void *record) {
+  if (index < 0 || index >= store->n_slots) return LFS_ERR_NOENT;
+  store_slot_t slot;
+  int err = read_slot(store, index, &slot);
+  if (err < 0) return err;
+  if (slot.state != SLOT_LIVE) return LFS_ERR_NOENT;
+  err = read_file(store->path, record, slot_offset(store, index) + sizeof(slot), store->record_size);
+  if (err < 0) return err;
+  if (err != store->record_size || crc16(record, store->record_size) != slot.crc) {
+    ERR_MSG("Checksum mismatch at %d of %s\n", index, store->path);
+    return LFS_ERR_CORRUPT;
+  }
+  return 0;
+}
+
+int store_delete(store_t *store, int index) {
+  if (index < 0 || index >= store->n_slots) return 0;
+  store_slot_t slot;
+  int err = read_slot(store, index, &slot);
+  if (err < 0) return err;
+  if (slot.state != SLOT_LIVE) return 0;
+  store_header_t header = store->header;
+  slot.crc = 0;
+  slot.state = SLOT_FREE;
+  slot.next = header.free_head;
+  header.free_head = (uint8_t) index;
+  --header.n_live;
+  fs_txn_t txn;
+  fs_txn_begin(&txn, store->path);
+  fs_txn_write(&txn, slot_offset(store, index), &slot, sizeof(slot));
+  fs_txn_setattr(&txn, STORE_ATTR, &header, sizeof(header));
+  err = fs_txn_commit(&txn);
+  if (err < 0) return err;
+  store->header = header;
+  return 0;
+}
+
+int store_foreach(store_t *store, int first_index, void *record, fs_record_visitor visitor, void *user) {
+  // n_slots is read every time since the visitor may add records
+  for (int i = first_index; i < store->n_slots; ++i) {
+    int err = store_read(store, i, record);
+    if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) continue;
+    if (err < 0) return err;
+    err = visitor(i, record, user);
+    if (err != 0) return err;
+  }
+  return 0;
+}
+
+int store_compact(store_t *store, const char *tmp_path, void *record, uint8_t *remap, fs_record_visitor fixup,
+                  void *user) {
+  store_header_t header = {.version = STORE_VERSION, .free_head = STORE_NIL, .n_live = 0};
+  int err = create_empty(tmp_path);
+  if (err < 0) return err;
+  for (int i = 0; i < store->n_slots; ++i) {
+    if (remap) remap[i] = STORE_NIL;
+    err = store_read(store, i, record);
+    if (err == LFS_ERR_NOENT || err == LFS_ERR_CORRUPT) continue;
+    if (err < 0) return err;
+    if (fixup) {
+      err = fixup(i, record, user);
+      if (err < 0) return err;
+      if (err > 0) continue;
+    }
+    const store_slot_t slot = {.crc = crc16(record, store->record_size), .state = SLOT_LIVE, .next = STORE_NIL};
+    err = append_slot(store, tmp_path, &slot, record);
+    if (err < 0) return err;
+    if (remap) remap[i] = header.n_live;
+    ++header.n_live;
+  }
+  err = finish_rebuild(store, tmp_path, header.n_live);
+  if (err < 0) return err;
+  err = copy_keep_attrs(store, tmp_path);
+  if (err < 0) return err;
+  return write_attr(tmp_path, STORE_ATTR, &header, sizeof(header));
+}
+
+int store_swap(const char *journal, const char *const files[][2], int n) {
+  // once the journal exists, store_swap_recover finishes the renames
+  int err = write_file(journal, NULL, 0, 0, 1);
+  if (err < 0) return err;
+  for (int i = 0; i < n; ++i) {
+    err = fs_rename(files[i][0], files[i][1]);
+    if (err < 0) return err;
+  }
+  return fs_remove(journal);
+}
+
+int store_swap_recover(const char *journal, const char *const files[][2], int n) {
+  const int committed = fs_exists(journal);
+  if (committed < 0) return committed;
+  for (int i = 0; i < n; ++i) {
+    int err;
+    if (committed) {
+      if (fs_exists(files[i][0]) <= 0) continue; // renamed before the interruption
+      DBG_MSG("Finishing the swap of %s\n", files[i][1]);
+      err = fs_rename(files[i][0], files[i][1]);
+    } else {
+      err = fs_remove(files[i][0]);
+      if (err == LFS_ERR_NOENT) err = 0;
+    }
+    if (err < 0) return err;
+  }
+  if (!committed) return 0;
+  return fs_remove(journal);
+}
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <../applets/ctap/ctap-internal.h>
+#include <../applets/ctap/secret.h>
+#include <apdu.h>
+#include <bd/lfs_rambd.h>
+#include <ctap.h>
+#include <fs.h>
+#include <lfs.h>
+
+static struct lfs_config cfg;
+
+// a power loss: the cached file handles and the RAM state are lost, then the card boots again
+static void power_cycle(void) {
+  assert_int_equal(fs_mount(&cfg), 0);
+  assert_int_equal(ctap_install(0), 0);
+}
+
+static uint32_t ctap_commits(void) {
+  fs_io_stats_t stats[FS_STATS_BUCKETS];
+  fs_get_io_stats(stats);
+  assert_string_equal(fs_io_stats_prefix(0), "ctap_");
+  return stats[0].commits;
+}
+
+static void test_monotonic(void **state) {
+  (void)state;
+
+  // how many values are used before each power loss, around the size of a reservation
+  const int used[] = {1, 0, 5, SIGN_CTR_RESERVATION - 1, SIGN_CTR_RESERVATION, SIGN_CTR_RESERVATION + 1, 1,
+                      3 * SIGN_CTR_RESERVATION + 2};
+  uint32_t last = 0, counter;
+  assert_int_equal(ctap_install(1), 0);
+  for (size_t i = 0; i < sizeof(used) / sizeof(used[0]); ++i) {
+    for (int j = 0; j < used[i]; ++j) {
+      assert_int_equal(increase_counter(&counter), 0);
+      assert_true(counter > last);
+      last = counter;
+    }
+    power_cycle();
+  }
+  // at most a reservation is skipped per power loss
+  assert_int_equal(increase_counter(&counter), 0);
+  assert_true(counter > last);
+  assert_true(counter - last <= SIGN_CTR_RESERVATION);
+}
+
+static void test_one_write_per_reservation(void **state) {
+  (void)state;
+
+  uint32_t counter, first;
+  power_cycle();
+  const uint32_t commits = ctap_commits();
+  assert_int_equal(increase_counter(&first), 0); // reserves a block
+  for (int i = 1; i < SIGN_CTR_RESERVATION; ++i) {
+    assert_int_equal(increase_counter(&counter), 0);
+    assert_int_equal(counter, first + i);
+  }
+  assert_int_equal(ctap_commits(), commits + 1);
+  assert_int_equal(increase_counter(&counter), 0); // the next block
+  assert_int_equal(counter, first + SIGN_CTR_RESERVATION);
+  assert_int_equal(ctap_commits(), commits + 2);
+
+  // the persisted value is the end of the block, so a new boot continues after it
+  uint32_t limit;
+  assert_int_equal(read_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, &limit, sizeof(limit)), sizeof(limit));
+  assert_int_equal(limit, first + 2 * SIGN_CTR_RESERVATION - 1);
+  power_cycle();
+  assert_int_equal(increase_counter(&counter), 0);
+  assert_int_equal(counter, limit + 1);
+}
+
+int main() {
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  bd.cfg = &bdcfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 32;
+  lfs_rambd_create(&cfg, &bdcfg);
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  uint8_t key[PRI_KEY_SIZE], r_buf[16];
+  memset(key, 0x11, sizeof(key));
+  CAPDU C = {.data = key, .lc = sizeof(key)};
+  RAPDU R = {.data = r_buf};
+  ctap_install(1);
+  ctap_install_private_key(&C, &R); // also writes the SM2 attr, without which ctap_install(0) fails
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_monotonic),
+      cmocka_unit_test(test_one_write_per_reservation),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_rambd_destroy(&cfg);
+
+  return ret;
+}
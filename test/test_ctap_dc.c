@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <../applets/ctap/cose-key.h>
+#include <../applets/ctap/ctap-errors.h>
+#include <../applets/ctap/ctap-internal.h>
+#include <../applets/ctap/dc-index.h>
+#include <bd/lfs_rambd.h>
+#include <cbor.h>
+#include <ctap.h>
+#include <device.h>
+#include <fs.h>
+#include <lfs.h>
+#include <stdio.h>
+#include <store.h>
+
+#define USER_ID_LEN 32
+#define USER_LEN    (3 + USER_ID_LEN + USER_NAME_LIMIT - 1 + DISPLAY_NAME_LIMIT - 1) // encoded, see dc_encode_user
+
+typedef struct {
+  uint8_t user; // every byte of the user id
+  credential_id id;
+} found_dc;
+
+static uint8_t req[1024], resp[1024];
+
+static void fill_user(user_entity *user, uint8_t id) {
+  memset(user, 0, sizeof(*user));
+  memset(user->id, id, USER_ID_LEN);
+  user->id_size = USER_ID_LEN;
+  memset(user->name, 'n', USER_NAME_LIMIT - 1);
+  memset(user->display_name, 'd', DISPLAY_NAME_LIMIT - 1);
+}
+
+static uint8_t send_cbor(const CborEncoder *encoder, size_t *len) {
+  *len = sizeof(resp);
+  const size_t req_len = 1 + cbor_encoder_get_buffer_size(encoder, req + 1);
+  assert_int_equal(ctap_process_cbor_with_src(req, req_len, resp, len, CTAP_SRC_CCID), 0);
+  return resp[0];
+}
+
+// a DC of user on rp_id, which replaces the DC of the same user
+static uint8_t make_credential(const char *rp_id, uint8_t user) {
+  CborEncoder encoder, map, sub_map, array, param;
+  const uint8_t client_data_hash[CLIENT_DATA_HASH_SIZE] = {0};
+  user_entity entity;
+  size_t len;
+  fill_user(&entity, user);
+  req[0] = CTAP_MAKE_CREDENTIAL;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 5);
+  cbor_encode_int(&map, MC_REQ_CLIENT_DATA_HASH);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  cbor_encode_int(&map, MC_REQ_RP);
+  cbor_encoder_create_map(&map, &sub_map, 1);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_text_stringz(&sub_map, rp_id);
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encode_int(&map, MC_REQ_USER);
+  cbor_encoder_create_map(&map, &sub_map, 3);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_byte_string(&sub_map, entity.id, entity.id_size);
+  cbor_encode_text_stringz(&sub_map, "name");
+  cbor_encode_text_stringz(&sub_map, entity.name);
+  cbor_encode_text_stringz(&sub_map, "displayName");
+  cbor_encode_text_stringz(&sub_map, entity.display_name);
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encode_int(&map, MC_REQ_PUB_KEY_CRED_PARAMS);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encoder_create_map(&array, &param, 2);
+  cbor_encode_text_stringz(&param, "alg");
+  cbor_encode_int(&param, COSE_ALG_ES256);
+  cbor_encode_text_stringz(&param, "type");
+  cbor_encode_text_stringz(&param, "public-key");
+  cbor_encoder_close_container(&array, &param);
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, MC_REQ_OPTIONS);
+  cbor_encoder_create_map(&map, &sub_map, 1);
+  cbor_encode_text_stringz(&sub_map, "rk");
+  cbor_encode_boolean(&sub_map, true);
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encoder_close_container(&encoder, &map);
+  return send_cbor(&encoder, &len);
+}
+
+// GetAssertion on rp_id without an allow list, or GetNextAssertion if rp_id is NULL
+static uint8_t get_assertion(const char *rp_id, found_dc *found, int *n_found) {
+  CborEncoder encoder, map;
+  const uint8_t client_data_hash[CLIENT_DATA_HASH_SIZE] = {0};
+  size_t len;
+  req[0] = rp_id ? CTAP_GET_ASSERTION : CTAP_GET_NEXT_ASSERTION;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  if (rp_id) {
+    cbor_encoder_create_map(&encoder, &map, 2);
+    cbor_encode_int(&map, GA_REQ_RP_ID);
+    cbor_encode_text_stringz(&map, rp_id);
+    cbor_encode_int(&map, GA_REQ_CLIENT_DATA_HASH);
+    cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+    cbor_encoder_close_container(&encoder, &map);
+  }
+  const uint8_t status = send_cbor(&encoder, &len);
+  if (status != 0) return status;
+
+  CborParser parser;
+  CborValue it, value, field;
+  uint8_t user_id[USER_ID_MAX_SIZE];
+  size_t size;
+  int key;
+  *n_found = 1;
+  assert_int_equal(cbor_parser_init(resp + 1, len - 1, 0, &parser, &it), CborNoError);
+  assert_int_equal(cbor_value_enter_container(&it, &value), CborNoError);
+  while (!cbor_value_at_end(&value)) {
+    assert_int_equal(cbor_value_get_int_checked(&value, &key), CborNoError);
+    assert_int_equal(cbor_value_advance(&value), CborNoError);
+    if (key == GA_RESP_CREDENTIAL) {
+      assert_int_equal(cbor_value_map_find_value(&value, "id", &field), CborNoError);
+      size = sizeof(found->id);
+      assert_int_equal(cbor_value_copy_byte_string(&field, (uint8_t *) &found->id, &size, NULL), CborNoError);
+      assert_int_equal(size, sizeof(found->id));
+    } else if (key == GA_RESP_PUBLIC_KEY_CREDENTIAL_USER_ENTITY) {
+      assert_int_equal(cbor_value_map_find_value(&value, "id", &field), CborNoError);
+      size = sizeof(user_id);
+      assert_int_equal(cbor_value_copy_byte_string(&field, user_id, &size, NULL), CborNoError);
+      assert_int_equal(size, USER_ID_LEN);
+      found->user = user_id[0];
+    } else if (key == GA_RESP_NUMBER_OF_CREDENTIALS) {
+      assert_int_equal(cbor_value_get_int_checked(&value, n_found), CborNoError);
+    }
+    assert_int_equal(cbor_value_advance(&value), CborNoError);
+  }
+  return 0;
+}
+
+// the DCs of rp_id, the newest first, as a platform enumerates them
+static int list_dcs(const char *rp_id, found_dc *found) {
+  int n, n_next;
+  const uint8_t status = get_assertion(rp_id, &found[0], &n);
+  if (status == CTAP2_ERR_NO_CREDENTIALS) return 0;
+  assert_int_equal(status, 0);
+  for (int i = 1; i < n; ++i) assert_int_equal(get_assertion(NULL, &found[i], &n_next), 0);
+  assert_int_not_equal(get_assertion(NULL, &found[0], &n_next), 0); // no more
+  return n;
+}
+
+static void assert_users(const char *rp_id, const uint8_t *users, int n) {
+  found_dc found[MAX_DC_NUM_IN_ASSERTION];
+  assert_int_equal(list_dcs(rp_id, found), n);
+  for (int i = 0; i < n; ++i) assert_int_equal(found[i].user, users[i]);
+}
+
+// an interrupted MakeCredential of the DC at slot, whose rollback by the next command deletes the DC
+static void interrupt_make_credential(int slot, const char *rp_id) {
+  CTAP_dc_general_attr attr;
+  found_dc found;
+  int n;
+  assert_int_equal(read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)), sizeof(attr));
+  attr.pending_add = 1;
+  attr.index = (uint16_t) slot;
+  sha256_raw((const uint8_t *) rp_id, strlen(rp_id), attr.rp_id_hash);
+  assert_int_equal(write_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)), 0);
+  get_assertion(rp_id, &found, &n);
+  assert_int_equal(read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)), sizeof(attr));
+  assert_int_equal(attr.pending_add, 0);
+}
+
+static void test_legacy_migration(void **state) {
+  (void)state;
+
+  found_dc a[3], b[1];
+  assert_int_equal(ctap_install(1), 0);
+  for (uint8_t user = 1; user <= 3; ++user) assert_int_equal(make_credential("a.com", user), 0);
+  assert_int_equal(make_credential("b.com", 4), 0);
+  // valid credential ids for the legacy records
+  assert_int_equal(list_dcs("a.com", a), 3);
+  assert_int_equal(list_dcs("b.com", b), 1);
+
+  // the legacy layout: full records in DC_FILE, with a deleted one, and RP metas with a slot bitmap
+  CTAP_discoverable_credential dcs[5] = {0};
+  const found_dc *order[5] = {&a[2], &b[0], &a[2], &a[1], &a[0]}; // users 1, 4, 1 (deleted), 2, 3
+  for (int i = 0; i < 5; ++i) {
+    dcs[i].credential_id = order[i]->id;
+    fill_user(&dcs[i].user, order[i]->user);
+  }
+  dcs[2].deleted = true;
+  assert_int_equal(write_file(DC_FILE, dcs, 0, sizeof(dcs), 1), 0);
+  CTAP_legacy_rp_meta metas[2] = {{.rp_id = "a.com", .rp_id_len = 5, .slots = 0x19},
+                                  {.rp_id = "b.com", .rp_id_len = 5, .slots = 0x02}};
+  sha256_raw(metas[0].rp_id, metas[0].rp_id_len, metas[0].rp_id_hash);
+  sha256_raw(metas[1].rp_id, metas[1].rp_id_len, metas[1].rp_id_hash);
+  assert_int_equal(write_file(DC_META_FILE, metas, 0, sizeof(metas), 1), 0);
+  const CTAP_legacy_dc_general_attr legacy_attr = {.numbers = 4};
+  assert_int_equal(write_attr(DC_FILE, DC_GENERAL_ATTR, &legacy_attr, sizeof(legacy_attr)), 0);
+  assert_int_equal(fs_remove(DC_PAGE_FILE), 0);
+  assert_int_equal(fs_remove(DC_USER_FILE), 0);
+  assert_int_equal(fs_remove(RP_FILE), 0);
+
+  assert_int_equal(ctap_install(0), 0);
+  assert_int_equal(fs_exists(DC_META_FILE), 0);
+  assert_int_equal(get_file_size(DC_FILE), 0);
+  assert_int_equal(fs_exists(DC_PAGE_FILE), 1);
+  CTAP_dc_general_attr attr;
+  assert_int_equal(read_attr(DC_FILE, DC_GENERAL_ATTR, &attr, sizeof(attr)), sizeof(attr));
+  assert_int_equal(attr.numbers, 4);
+  assert_int_equal(attr.pending_add, 0);
+  // the DCs are created in the order of the legacy records
+  assert_users("a.com", (const uint8_t[]){3, 2, 1}, 3);
+  assert_users("b.com", (const uint8_t[]){4}, 1);
+
+  // nothing is migrated again, and the migrated RP takes new DCs
+  assert_int_equal(ctap_install(0), 0);
+  assert_int_equal(make_credential("a.com", 5), 0);
+  assert_int_equal(make_credential("a.com", 1), 0);
+  assert_users("a.com", (const uint8_t[]){1, 5, 3, 2}, 4);
+  assert_users("b.com", (const uint8_t[]){4}, 1);
+}
+
+static void test_alloc_delete_compact(void **state) {
+  (void)state;
+
+  uint8_t a[MAX_DC_NUM_IN_ASSERTION], b[MAX_DC_NUM_IN_ASSERTION];
+  int n;
+  assert_int_equal(ctap_install(1), 0);
+  // a user i of a.com at slot 2i, and b.com 100 + i at 2i + 1, then a.com 30 to 39 at 60 to 69 over two pages
+  for (uint8_t i = 0; i < 40; ++i) {
+    assert_int_equal(make_credential("a.com", i), 0);
+    if (i < 30) assert_int_equal(make_credential("b.com", 100 + i), 0);
+  }
+  for (int i = 0; i < 10; ++i) interrupt_make_credential(2 * i, "a.com"); // frees 10 slots of the first page
+  for (uint8_t i = 0; i < 10; ++i) assert_int_equal(make_credential("b.com", 100 + i), 0);
+  for (int round = 0; round < 2; ++round) // the garbage of the second page
+    for (uint8_t i = 34; i < 40; ++i) assert_int_equal(make_credential("a.com", i), 0);
+  assert_int_equal(get_file_size(DC_USER_FILE), (64 + 10) * USER_LEN);
+  assert_int_equal(get_file_size(DC_USER_FILE "1"), (6 + 12) * USER_LEN);
+
+  // a replaced DC becomes the newest
+  n = 0;
+  for (uint8_t i = 39; i >= 10; --i) a[n++] = i;
+  n = 0;
+  for (uint8_t i = 109; i >= 100; --i) b[n++] = i;
+  for (uint8_t i = 129; i >= 110; --i) b[n++] = i;
+  assert_users("a.com", a, 30);
+  assert_users("b.com", b, 30);
+
+  int steps = 0, ret;
+  while ((ret = ctap_compact()) > 0) ++steps;
+  assert_int_equal(ret, 0);
+  assert_int_equal(steps, 2);
+  assert_int_equal(get_file_size(DC_USER_FILE), (64 - 10) * USER_LEN);
+  assert_int_equal(get_file_size(DC_USER_FILE "1"), 6 * USER_LEN);
+  assert_users("a.com", a, 30);
+  assert_users("b.com", b, 30);
+
+  // the same from the flash, and new DCs take the freed slots and stay the newest
+  assert_int_equal(ctap_install(0), 0);
+  assert_users("a.com", a, 30);
+  assert_users("b.com", b, 30);
+  assert_int_equal(make_credential("b.com", 130), 0);
+  memmove(b + 1, b, 30);
+  b[0] = 130;
+  assert_users("b.com", b, 31);
+  assert_int_equal(get_file_size(DC_USER_FILE), (64 - 10 + 1) * USER_LEN);
+  assert_int_equal(ctap_compact(), 0);
+}
+
+static void test_index_remap_rp(void **state) {
+  (void)state;
+
+  uint8_t hashes[4][SHA256_DIGEST_LENGTH] = {{0}};
+  credential_id ids[6];
+  memset(ids, 0, sizeof(ids));
+  dc_index_clear();
+  for (int rp = 0; rp < 4; ++rp) {
+    hashes[rp][1] = (uint8_t) (rp + 1);
+    dc_index_set_rp(rp, hashes[rp]);
+  }
+  const int dc_rps[5] = {1, 3, 1, 2, 3};
+  for (int slot = 0; slot < 5; ++slot) {
+    ids[slot].nonce[1] = (uint8_t) (slot + 1);
+    dc_index_set(slot, dc_rps[slot], &ids[slot]);
+  }
+  // RP 0 and 2 are released, and a compaction of RP_FILE moves RP 1 and 3 to 0 and 1
+  dc_index_remove(3);
+  dc_index_remove_rp(2);
+  dc_index_remove_rp(0);
+  const uint8_t remap[4] = {STORE_NIL, 0, STORE_NIL, 1};
+  dc_index_remap_rp(remap, 4);
+
+  assert_int_equal(dc_index_next_rp(0, hashes[1]), 0);
+  assert_int_equal(dc_index_next_rp(0, hashes[3]), 1);
+  assert_int_equal(dc_index_next_rp(0, hashes[0]), -1);
+  assert_int_equal(dc_index_next_rp(0, hashes[2]), -1);
+  assert_int_equal(dc_index_next_rp(2, NULL), -1);
+  assert_int_equal(dc_index_rp_count(0), 2);
+  assert_int_equal(dc_index_rp_count(1), 2);
+  assert_int_equal(dc_index_rp_count(2), 0);
+  assert_int_equal(dc_index_next(0, 0, NULL), 0);
+  assert_int_equal(dc_index_next(1, 0, NULL), 2);
+  assert_int_equal(dc_index_next(3, 0, NULL), -1);
+  assert_int_equal(dc_index_next(0, 1, NULL), 1);
+  assert_int_equal(dc_index_next(2, 1, NULL), 4);
+  assert_int_equal(dc_index_next(0, 1, ids[4].nonce), 4);
+
+  // the moved lists are still linked
+  dc_index_remove(2);
+  assert_int_equal(dc_index_rp_count(0), 1);
+  assert_int_equal(dc_index_next(1, 0, NULL), -1);
+  dc_index_set(5, 1, &ids[5]);
+  assert_int_equal(dc_index_rp_count(1), 3);
+  assert_int_equal(dc_index_next(2, 1, NULL), 4);
+  assert_int_equal(dc_index_next(5, 1, NULL), 5);
+}
+
+static void test_compact_rps(void **state) {
+  (void)state;
+
+  char rp_ids[12][12];
+  assert_int_equal(ctap_install(1), 0);
+  // users 2k and 2k + 1 of RP k at the slots of the same numbers
+  for (int k = 0; k < 12; ++k) {
+    snprintf(rp_ids[k], sizeof(rp_ids[k]), "rp%d.com", k);
+    assert_int_equal(make_credential(rp_ids[k], (uint8_t) (2 * k)), 0);
+    assert_int_equal(make_credential(rp_ids[k], (uint8_t) (2 * k + 1)), 0);
+  }
+  // release the first 9 RPs, enough for a compaction of RP_FILE after the one of the page
+  for (int k = 0; k < 9; ++k) {
+    interrupt_make_credential(2 * k, rp_ids[k]);
+    interrupt_make_credential(2 * k + 1, rp_ids[k]);
+  }
+  int steps = 0, ret;
+  while ((ret = ctap_compact()) > 0) ++steps;
+  assert_int_equal(ret, 0);
+  assert_int_equal(steps, 2);
+
+  // the RAM index follows the moved RPs
+  found_dc found[2];
+  for (int k = 0; k < 9; ++k) assert_int_equal(list_dcs(rp_ids[k], found), 0);
+  for (int k = 9; k < 12; ++k)
+    assert_users(rp_ids[k], (const uint8_t[]){(uint8_t) (2 * k + 1), (uint8_t) (2 * k)}, 2);
+  assert_int_equal(make_credential(rp_ids[10], 50), 0);
+  assert_int_equal(make_credential(rp_ids[9], 18), 0);
+  assert_int_equal(make_credential(rp_ids[0], 0), 0);
+
+  for (int boot = 0; boot < 2; ++boot) {
+    assert_users(rp_ids[9], (const uint8_t[]){18, 19}, 2);
+    assert_users(rp_ids[10], (const uint8_t[]){50, 21, 20}, 3);
+    assert_users(rp_ids[11], (const uint8_t[]){23, 22}, 2);
+    assert_users(rp_ids[0], (const uint8_t[]){0}, 1);
+    for (int k = 1; k < 9; ++k) assert_int_equal(list_dcs(rp_ids[k], found), 0);
+    // and the same index is built from the flash
+    assert_int_equal(ctap_install(0), 0);
+  }
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  bd.cfg = &bdcfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 32;
+  lfs_rambd_create(&cfg, &bdcfg);
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  // over NFC, which skips the waits for user presence
+  FILE *f = fopen("/tmp/canokey-test-nfc", "w");
+  if (f != NULL) {
+    fprintf(f, "1");
+    fclose(f);
+  }
+  set_nfc_state(1);
+
+  uint8_t key[PRI_KEY_SIZE];
+  memset(key, 0x11, sizeof(key));
+  CAPDU C = {.data = key, .lc = sizeof(key)};
+  RAPDU R = {.data = resp};
+  ctap_install(1);
+  ctap_install_private_key(&C, &R); // the attestation key, which MakeCredential requires
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_legacy_migration),
+      cmocka_unit_test(test_alloc_delete_compact),
+      cmocka_unit_test(test_index_remap_rp),
+      cmocka_unit_test(test_compact_rps),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_rambd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <bd/lfs_rambd.h>
+#include <common.h>
+#include <fs.h>
+#include <lfs.h>
+
+#define N_FILES   5 // more than FS_HANDLE_CACHE_SIZE
+#define LONG_PATH "a_path_longer_than_fs_path_max"
+
+static struct lfs_config cfg;
+static const char *const paths[N_FILES] = {"f0", "f1", "f2", "f3", "f4"};
+
+static uint32_t other_commits(void) {
+  fs_io_stats_t stats[FS_STATS_BUCKETS];
+  fs_get_io_stats(stats);
+  return stats[FS_STATS_BUCKETS - 1].commits;
+}
+
+static int sum_records(int index, void *record, void *user) {
+  UNUSED(index);
+  *(int *) user += *(uint32_t *) record;
+  return 0;
+}
+
+static int find_record(int index, void *record, void *user) {
+  return *(uint32_t *) record == *(uint32_t *) user ? index + 1 : 0;
+}
+
+// reads all other files from the visitor, which evicts the handle being walked
+static int read_others(int index, void *record, void *user) {
+  UNUSED(record);
+  uint8_t buf;
+  for (int i = 1; i < N_FILES; ++i) assert_int_equal(read_file(paths[i], &buf, 0, 1), 1);
+  ++*(int *) user;
+  return index == 3 ? 4 : 0;
+}
+
+static void test_cache(void **state) {
+  (void)state;
+
+  uint8_t buf[2];
+  // touch more files than the cache holds, each one is evicted and reopened in turn
+  for (int round = 0; round < 3; ++round)
+    for (uint8_t i = 0; i < N_FILES; ++i) {
+      const uint8_t data[2] = {i, (uint8_t) round};
+      assert_int_equal(write_file(paths[i], data, 0, sizeof(data), round == 0), 0);
+    }
+  for (uint8_t i = 0; i < N_FILES; ++i) {
+    assert_int_equal(read_file(paths[i], buf, 0, sizeof(buf)), sizeof(buf));
+    assert_int_equal(buf[0], i);
+    assert_int_equal(buf[1], 2);
+    assert_int_equal(get_file_size(paths[i]), sizeof(buf));
+  }
+
+  // every write is committed, so the data survive the loss of the cached handles
+  assert_int_equal(append_file(paths[0], "x", 1), 0);
+  assert_int_equal(truncate_file(paths[1], 1), 0);
+  assert_int_equal(fs_mount(&cfg), 0);
+  assert_int_equal(get_file_size(paths[0]), 3);
+  assert_int_equal(read_file(paths[0], buf, 2, 1), 1);
+  assert_int_equal(buf[0], 'x');
+  assert_int_equal(get_file_size(paths[1]), 1);
+
+  // a renamed or removed file is not served from a stale handle
+  assert_int_equal(write_file("old", "o", 0, 1, 1), 0);
+  assert_int_equal(read_file("old", buf, 0, 1), 1);
+  assert_int_equal(fs_rename("old", "moved"), 0);
+  assert_int_equal(read_file("old", buf, 0, 1), LFS_ERR_NOENT);
+  assert_int_equal(read_file("moved", buf, 0, 1), 1);
+  assert_int_equal(buf[0], 'o');
+  assert_int_equal(fs_remove("moved"), 0);
+  assert_int_equal(get_file_size("moved"), LFS_ERR_NOENT);
+  assert_int_equal(fs_flush(), 0);
+}
+
+static void test_append_nosync(void **state) {
+  (void)state;
+
+  uint8_t buf[4];
+  assert_int_equal(write_file(paths[0], NULL, 0, 0, 1), 0);
+  uint32_t commits = other_commits();
+  for (uint8_t i = 0; i < 4; ++i) assert_int_equal(fs_append_nosync(paths[0], &i, 1), 0);
+  assert_int_equal(other_commits(), commits);
+  assert_int_equal(get_file_size(paths[0]), 4);
+  assert_int_equal(fs_sync(paths[0]), 0);
+  assert_int_equal(other_commits(), commits + 1);
+  assert_int_equal(fs_mount(&cfg), 0);
+  assert_int_equal(read_file(paths[0], buf, 0, sizeof(buf)), sizeof(buf));
+  for (uint8_t i = 0; i < 4; ++i) assert_int_equal(buf[i], i);
+
+  // the pending data are committed when the handle is evicted
+  assert_int_equal(fs_append_nosync(paths[0], "y", 1), 0);
+  for (int i = 1; i < N_FILES; ++i) assert_int_equal(read_file(paths[i], buf, 0, 1), 1);
+  assert_int_equal(fs_sync(paths[0]), 0); // no handle left, nothing to do
+  assert_int_equal(fs_mount(&cfg), 0);
+  assert_int_equal(get_file_size(paths[0]), 5);
+}
+
+static void test_errors(void **state) {
+  (void)state;
+
+  uint8_t buf[4];
+  uint32_t record;
+  assert_int_equal(read_file(paths[0], buf, 0, 1), 1); // cached
+  assert_int_equal(read_file("missing", buf, 0, 1), LFS_ERR_NOENT);
+  assert_int_equal(get_file_size("missing"), LFS_ERR_NOENT);
+  assert_int_equal(read_attr("missing", 1, buf, 1), LFS_ERR_NOENT);
+  assert_int_equal(fs_read_records("missing", 0, -1, &record, sizeof(record), sum_records, NULL), LFS_ERR_NOENT);
+  assert_int_equal(fs_remove("missing"), LFS_ERR_NOENT);
+  assert_int_equal(write_file(LONG_PATH, buf, 0, 1, 1), LFS_ERR_NAMETOOLONG);
+  assert_int_equal(append_file(LONG_PATH, buf, 1), LFS_ERR_NAMETOOLONG);
+  assert_int_equal(fs_append_nosync(LONG_PATH, buf, 1), LFS_ERR_NAMETOOLONG);
+  assert_int_equal(read_file(LONG_PATH, buf, 0, 1), LFS_ERR_NAMETOOLONG);
+
+  fs_txn_t txn;
+  fs_txn_begin(&txn, paths[0]);
+  for (int i = 0; i < FS_TXN_MAX_ATTRS; ++i) assert_int_equal(fs_txn_setattr(&txn, i + 1, buf, 1), 0);
+  assert_int_equal(fs_txn_setattr(&txn, FS_TXN_MAX_ATTRS + 1, buf, 1), LFS_ERR_NOSPC);
+  for (int i = 0; i < FS_TXN_MAX_WRITES; ++i) assert_int_equal(fs_txn_write(&txn, 0, buf, 1), 0);
+  assert_int_equal(fs_txn_write(&txn, 0, buf, 1), LFS_ERR_NOSPC);
+  fs_txn_begin(&txn, LONG_PATH);
+  fs_txn_truncate(&txn, 0);
+  assert_int_equal(fs_txn_commit(&txn), LFS_ERR_NAMETOOLONG);
+
+  // the failures left the cached handle usable
+  assert_int_equal(read_file(paths[0], buf, 0, 1), 1);
+  assert_int_equal(buf[0], 0);
+}
+
+static void test_exists(void **state) {
+  (void)state;
+
+  assert_int_equal(fs_exists("new"), 0);
+  assert_int_equal(write_file("new", "z", 0, 1, 1), 0);
+  assert_int_equal(fs_exists("new"), 1); // cached
+  assert_int_equal(fs_flush(), 0);
+  assert_int_equal(fs_exists("new"), 1); // from the directory entry
+  assert_int_equal(fs_remove("new"), 0);
+  assert_int_equal(fs_exists("new"), 0);
+}
+
+static void test_read_records(void **state) {
+  (void)state;
+
+  uint32_t record, records[6] = {1, 2, 3, 4, 5, 6};
+  int sum = 0, visits = 0;
+  assert_int_equal(write_file(paths[0], records, 0, sizeof(records), 1), 0);
+  assert_int_equal(fs_read_records(paths[0], 0, -1, &record, sizeof(record), sum_records, &sum), 0);
+  assert_int_equal(sum, 21);
+  sum = 0;
+  assert_int_equal(fs_read_records(paths[0], 1, 3, &record, sizeof(record), sum_records, &sum), 0);
+  assert_int_equal(sum, 2 + 3 + 4);
+  sum = 0;
+  assert_int_equal(fs_read_records(paths[0], 4, 10, &record, sizeof(record), sum_records, &sum), 0);
+  assert_int_equal(sum, 5 + 6);
+
+  // the walk stops on the first non-zero value of the visitor
+  uint32_t target = 4;
+  assert_int_equal(fs_read_records(paths[0], 0, -1, &record, sizeof(record), find_record, &target), 4);
+  target = 7;
+  assert_int_equal(fs_read_records(paths[0], 0, -1, &record, sizeof(record), find_record, &target), 0);
+
+  // the walk goes on after the visitor evicted its handle
+  assert_int_equal(fs_read_records(paths[0], 0, -1, &record, sizeof(record), read_others, &visits), 4);
+  assert_int_equal(visits, 4);
+  assert_int_equal(record, 4);
+
+  // a partial record at the end is skipped
+  assert_int_equal(append_file(paths[0], "p", 1), 0);
+  sum = 0;
+  assert_int_equal(fs_read_records(paths[0], 0, -1, &record, sizeof(record), sum_records, &sum), 0);
+  assert_int_equal(sum, 21);
+}
+
+int main() {
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  bd.cfg = &bdcfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 32;
+  lfs_rambd_create(&cfg, &bdcfg);
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_cache),
+      cmocka_unit_test(test_append_nosync),
+      cmocka_unit_test(test_errors),
+      cmocka_unit_test(test_exists),
+      cmocka_unit_test(test_read_records),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_rambd_destroy(&cfg);
+
+  return ret;
+}
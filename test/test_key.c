@@ -4,7 +4,7 @@
 #include <stddef.h>
 #include <cmocka.h>
 
-#include <bd/lfs_filebd.h>
+#include <bd/lfs_rambd.h>
 #include <crypto-util.h>
 #include <fs.h>
 #include <key.h>
@@ -170,15 +170,15 @@ static void test_encode_eddsa(void **state) {
 
 int main() {
   struct lfs_config cfg;
-  lfs_filebd_t bd;
-  struct lfs_filebd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
   bd.cfg = &bdcfg;
   memset(&cfg, 0, sizeof(cfg));
   cfg.context = &bd;
-  cfg.read = &lfs_filebd_read;
-  cfg.prog = &lfs_filebd_prog;
-  cfg.erase = &lfs_filebd_erase;
-  cfg.sync = &lfs_filebd_sync;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
   cfg.read_size = 1;
   cfg.prog_size = 512;
   cfg.block_size = 512;
@@ -186,7 +186,7 @@ int main() {
   cfg.block_cycles = 50000;
   cfg.cache_size = 512;
   cfg.lookahead_size = 32;
-  lfs_filebd_create(&cfg, "lfs-root", &bdcfg);
+  lfs_rambd_create(&cfg, &bdcfg);
 
   fs_format(&cfg);
   fs_mount(&cfg);
@@ -199,7 +199,7 @@ int main() {
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
 
-  lfs_filebd_destroy(&cfg);
+  lfs_rambd_destroy(&cfg);
 
   return ret;
 }
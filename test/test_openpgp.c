@@ -7,7 +7,7 @@
 #include "openpgp.h"
 #include <apdu.h>
 #include <crypto-util.h>
-#include <bd/lfs_filebd.h>
+#include <bd/lfs_rambd.h>
 #include <fs.h>
 #include <lfs.h>
 
@@ -210,15 +210,15 @@ static void test_special(void **state) {
 
 int main() {
   struct lfs_config cfg;
-  lfs_filebd_t bd;
-  struct lfs_filebd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
   bd.cfg = &bdcfg;
   memset(&cfg, 0, sizeof(cfg));
   cfg.context = &bd;
-  cfg.read = &lfs_filebd_read;
-  cfg.prog = &lfs_filebd_prog;
-  cfg.erase = &lfs_filebd_erase;
-  cfg.sync = &lfs_filebd_sync;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
   cfg.read_size = 1;
   cfg.prog_size = 512;
   cfg.block_size = 512;
@@ -226,7 +226,7 @@ int main() {
   cfg.block_cycles = 50000;
   cfg.cache_size = 512;
   cfg.lookahead_size = 32;
-  lfs_filebd_create(&cfg, "lfs-root", &bdcfg);
+  lfs_rambd_create(&cfg, &bdcfg);
 
   fs_format(&cfg);
   fs_mount(&cfg);
@@ -244,7 +244,7 @@ int main() {
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
 
-  lfs_filebd_destroy(&cfg);
+  lfs_rambd_destroy(&cfg);
 
   return ret;
 }
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <bd/lfs_rambd.h>
+#include <fs.h>
+#include <lfs.h>
+#include <pin.h>
+
+#define ATTR 0x01
+
+static pin_t pin = {.min_length = 6, .max_length = PIN_MAX_LENGTH, .is_validated = 0, .path = "pin"};
+
+static void test_empty_pin(void **state) {
+  (void)state;
+
+  uint8_t retries;
+  fs_remove(pin.path);
+  // created empty, like the resetting code of OpenPGP
+  assert_int_equal(pin_create(&pin, NULL, 0, 3), 0);
+  assert_int_equal(pin_get_size(&pin), 0);
+  assert_int_equal(pin_get_retries(&pin), 3);
+  assert_int_equal(pin_get_default_retries(&pin), 3);
+
+  assert_int_equal(pin_update(&pin, "123456", 6), 0);
+  assert_int_equal(pin_get_size(&pin), 6);
+  assert_int_equal(pin_verify(&pin, "654321", 6, &retries), PIN_AUTH_FAIL);
+  assert_int_equal(retries, 2);
+  assert_int_equal(pin_update(&pin, "1234567", 7), 0);
+  assert_int_equal(pin_get_retries(&pin), 3);
+  assert_int_equal(pin_verify(&pin, "1234567", 7, &retries), 0);
+  assert_true(pin.is_validated);
+
+  assert_int_equal(pin_clear(&pin), 0);
+  assert_int_equal(pin_get_size(&pin), 0);
+  assert_int_equal(pin_verify(&pin, "123456", 6, &retries), PIN_AUTH_FAIL);
+  assert_int_equal(pin_get_retries(&pin), 2);
+  // clearing an empty PIN changes no data, but still resets the counter
+  assert_int_equal(pin_clear(&pin), 0);
+  assert_int_equal(pin_get_retries(&pin), 3);
+  assert_int_equal(pin_get_default_retries(&pin), 3);
+}
+
+static void test_create_again(void **state) {
+  (void)state;
+
+  assert_int_equal(pin_create(&pin, "123456", 6, 3), 0);
+  // the same data again with other counters
+  assert_int_equal(pin_create(&pin, "123456", 6, 5), 0);
+  assert_int_equal(pin_get_retries(&pin), 5);
+  assert_int_equal(pin_get_default_retries(&pin), 5);
+  assert_int_equal(pin_verify(&pin, "123456", 6, NULL), 0);
+}
+
+static void test_txn_attrs_only(void **state) {
+  (void)state;
+
+  fs_txn_t txn;
+  uint8_t data[4] = {1, 2, 3, 4}, attr = 0x5A, buf[4];
+  assert_int_equal(write_file(pin.path, data, 0, sizeof(data), 1), 0);
+  // truncate to the current size and write nothing, which leaves only the attr to commit
+  fs_txn_begin(&txn, pin.path);
+  fs_txn_truncate(&txn, sizeof(data));
+  fs_txn_setattr(&txn, ATTR, &attr, sizeof(attr));
+  assert_int_equal(fs_txn_commit(&txn), 0);
+  attr = 0;
+  assert_int_equal(read_attr(pin.path, ATTR, &attr, sizeof(attr)), 1);
+  assert_int_equal(attr, 0x5A);
+  assert_int_equal(read_file(pin.path, buf, 0, sizeof(buf)), sizeof(buf));
+  assert_memory_equal(buf, data, sizeof(data));
+
+  // the values to commit are not overwritten by the ones on the flash
+  attr = 0xA5;
+  fs_txn_begin(&txn, pin.path);
+  fs_txn_setattr(&txn, ATTR, &attr, sizeof(attr));
+  assert_int_equal(fs_txn_commit(&txn), 0);
+  assert_int_equal(attr, 0xA5);
+  attr = 0;
+  assert_int_equal(read_attr(pin.path, ATTR, &attr, sizeof(attr)), 1);
+  assert_int_equal(attr, 0xA5);
+
+  // a new file
+  fs_remove(pin.path);
+  fs_txn_begin(&txn, pin.path);
+  fs_txn_truncate(&txn, 0);
+  fs_txn_setattr(&txn, ATTR, &attr, sizeof(attr));
+  assert_int_equal(fs_txn_commit(&txn), 0);
+  assert_int_equal(get_file_size(pin.path), 0);
+  assert_int_equal(read_attr(pin.path, ATTR, &attr, sizeof(attr)), 1);
+
+  // a missing file is not created without a truncation
+  fs_remove(pin.path);
+  fs_txn_begin(&txn, pin.path);
+  fs_txn_setattr(&txn, ATTR, &attr, sizeof(attr));
+  assert_int_equal(fs_txn_commit(&txn), LFS_ERR_NOENT);
+  assert_int_equal(fs_exists(pin.path), 0);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  bd.cfg = &bdcfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 32;
+  lfs_rambd_create(&cfg, &bdcfg);
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_empty_pin),
+      cmocka_unit_test(test_create_again),
+      cmocka_unit_test(test_txn_attrs_only),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_rambd_destroy(&cfg);
+
+  return ret;
+}
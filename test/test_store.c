@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <bd/lfs_rambd.h>
+#include <fs.h>
+#include <lfs.h>
+#include <store.h>
+
+#define PATH         "store"
+#define TMP_PATH     "store_compact"
+#define JOURNAL_PATH "store_journal"
+#define USER_ATTR    0x01
+
+typedef struct {
+  uint8_t live;
+  uint8_t data[15];
+} record_t;
+
+static int legacy_live(const void *record) { return ((const record_t *) record)->live; }
+
+static const uint8_t keep_attrs[] = {USER_ATTR};
+
+static store_t store = {.path = PATH,
+                        .record_size = sizeof(record_t),
+                        .capacity = 4,
+                        .legacy_live = legacy_live,
+                        .keep_attrs = keep_attrs,
+                        .keep_attr_count = sizeof(keep_attrs)};
+
+static record_t make_record(uint8_t seed) {
+  record_t r = {.live = 1};
+  memset(r.data, seed, sizeof(r.data));
+  return r;
+}
+
+static int count_records(int index, void *record, void *user) {
+  UNUSED(index);
+  UNUSED(record);
+  ++*(int *) user;
+  return 0;
+}
+
+static void test_alloc_delete(void **state) {
+  (void)state;
+
+  record_t r, out;
+  assert_int_equal(store_format(&store), 0);
+  for (uint8_t i = 0; i < 4; ++i) {
+    r = make_record(i);
+    assert_int_equal(store_alloc(&store, &r), i);
+  }
+  r = make_record(9);
+  assert_int_equal(store_alloc(&store, &r), LFS_ERR_NOSPC);
+
+  // the freed slots are reused, the last freed first
+  assert_int_equal(store_delete(&store, 1), 0);
+  assert_int_equal(store_delete(&store, 2), 0);
+  assert_int_equal(store_delete(&store, 2), 0);
+  assert_int_equal(store_live_count(&store), 2);
+  assert_int_equal(store_read(&store, 2, &out), LFS_ERR_NOENT);
+  assert_int_equal(store_next_index(&store), 2);
+  assert_int_equal(store_alloc(&store, &r), 2);
+  assert_int_equal(store_next_index(&store), 1);
+
+  int n = 0;
+  assert_int_equal(store_foreach(&store, 0, &out, count_records, &n), 0);
+  assert_int_equal(n, 3);
+
+  // reload from the file
+  assert_int_equal(store_open(&store, &out), 0);
+  assert_int_equal(store_count(&store), 4);
+  assert_int_equal(store_live_count(&store), 3);
+  assert_int_equal(store_next_index(&store), 1);
+  assert_int_equal(store_read(&store, 2, &out), 0);
+  assert_memory_equal(&out, &r, sizeof(r));
+  r = make_record(8);
+  assert_int_equal(store_write(&store, 2, &r), 0);
+  assert_int_equal(store_read(&store, 2, &out), 0);
+  assert_memory_equal(&out, &r, sizeof(r));
+  assert_int_equal(store_write(&store, 1, &r), LFS_ERR_NOENT);
+}
+
+static void test_checksum(void **state) {
+  (void)state;
+
+  record_t r = make_record(1), out;
+  assert_int_equal(store_format(&store), 0);
+  assert_int_equal(store_alloc(&store, &r), 0);
+  assert_int_equal(store_alloc(&store, &r), 1);
+  // flip a byte of the first record behind the store
+  uint8_t byte;
+  const int off = 4 + 5; // slot header + offset in the record
+  assert_int_equal(read_file(PATH, &byte, off, 1), 1);
+  byte ^= 0xFF;
+  assert_int_equal(write_file(PATH, &byte, off, 1, 0), 0);
+  assert_int_equal(store_read(&store, 0, &out), LFS_ERR_CORRUPT);
+  int n = 0;
+  assert_int_equal(store_foreach(&store, 0, &out, count_records, &n), 0);
+  assert_int_equal(n, 1);
+}
+
+static void test_migration(void **state) {
+  (void)state;
+
+  record_t legacy[3] = {make_record(1), make_record(2), make_record(3)}, out;
+  legacy[1].live = 0;
+  const uint8_t attr = 0x42;
+  assert_int_equal(fs_remove(PATH), 0); // drop STORE_ATTR
+  assert_int_equal(write_file(PATH, legacy, 0, sizeof(legacy), 1), 0);
+  assert_int_equal(write_attr(PATH, USER_ATTR, &attr, sizeof(attr)), 0);
+
+  assert_int_equal(store_open(&store, &out), 0);
+  assert_int_equal(store_count(&store), 3);
+  assert_int_equal(store_live_count(&store), 2);
+  assert_int_equal(store_read(&store, 0, &out), 0);
+  assert_memory_equal(&out, &legacy[0], sizeof(out));
+  assert_int_equal(store_read(&store, 1, &out), LFS_ERR_NOENT);
+  assert_int_equal(store_read(&store, 2, &out), 0);
+  assert_memory_equal(&out, &legacy[2], sizeof(out));
+  assert_int_equal(store_next_index(&store), 1);
+  uint8_t buf = 0;
+  assert_int_equal(read_attr(PATH, USER_ATTR, &buf, sizeof(buf)), 1);
+  assert_int_equal(buf, attr);
+  assert_int_equal(get_file_size(STORE_TMP_FILE), LFS_ERR_NOENT);
+
+  assert_int_equal(store_open(&store, &out), 0); // no more migration
+  assert_int_equal(store_live_count(&store), 2);
+}
+
+static int drop_seed(int index, void *record, void *user) {
+  UNUSED(index);
+  return ((record_t *) record)->data[0] == *(uint8_t *) user;
+}
+
+static void test_compact(void **state) {
+  (void)state;
+
+  static const char *const files[][2] = {{TMP_PATH, PATH}};
+  record_t r, out;
+  uint8_t remap[4], drop = 3;
+  const uint8_t attr = 0x42;
+  assert_int_equal(store_format(&store), 0);
+  assert_int_equal(write_attr(PATH, USER_ATTR, &attr, sizeof(attr)), 0);
+  for (uint8_t i = 0; i < 4; ++i) {
+    r = make_record(i);
+    assert_int_equal(store_alloc(&store, &r), i);
+  }
+  assert_int_equal(store_delete(&store, 0), 0);
+  assert_int_equal(store_delete(&store, 2), 0);
+  assert_int_equal(store_free_count(&store), 2);
+
+  // the store is intact until the swap
+  assert_int_equal(store_compact(&store, TMP_PATH, &out, remap, drop_seed, &drop), 0);
+  assert_int_equal(remap[0], STORE_NIL);
+  assert_int_equal(remap[1], 0);
+  assert_int_equal(remap[2], STORE_NIL);
+  assert_int_equal(remap[3], STORE_NIL);
+  assert_int_equal(store_read(&store, 3, &out), 0);
+
+  // an interrupted rebuild is discarded
+  assert_int_equal(store_swap_recover(JOURNAL_PATH, files, 1), 0);
+  assert_int_equal(get_file_size(TMP_PATH), LFS_ERR_NOENT);
+  assert_int_equal(store_count(&store), 4);
+
+  // a committed swap is completed
+  drop = 0xFF;
+  assert_int_equal(store_compact(&store, TMP_PATH, &out, remap, drop_seed, &drop), 0);
+  assert_int_equal(remap[3], 1);
+  assert_int_equal(write_file(JOURNAL_PATH, NULL, 0, 0, 1), 0);
+  assert_int_equal(store_swap_recover(JOURNAL_PATH, files, 1), 0);
+  assert_int_equal(get_file_size(JOURNAL_PATH), LFS_ERR_NOENT);
+  assert_int_equal(store_open(&store, &out), 0);
+  assert_int_equal(store_count(&store), 2);
+  assert_int_equal(store_free_count(&store), 0);
+  assert_int_equal(store_next_index(&store), 2);
+  r = make_record(3);
+  assert_int_equal(store_read(&store, 1, &out), 0);
+  assert_memory_equal(&out, &r, sizeof(r));
+  uint8_t buf = 0;
+  assert_int_equal(read_attr(PATH, USER_ATTR, &buf, sizeof(buf)), 1);
+  assert_int_equal(buf, attr);
+
+  assert_int_equal(store_compact(&store, TMP_PATH, &out, remap, NULL, NULL), 0);
+  assert_int_equal(store_swap(JOURNAL_PATH, files, 1), 0);
+  assert_int_equal(get_file_size(TMP_PATH), LFS_ERR_NOENT);
+  assert_int_equal(store_open(&store, &out), 0);
+  assert_int_equal(store_live_count(&store), 2);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_rambd_t bd;
+  struct lfs_rambd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+  bd.cfg = &bdcfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_rambd_read;
+  cfg.prog = &lfs_rambd_prog;
+  cfg.erase = &lfs_rambd_erase;
+  cfg.sync = &lfs_rambd_sync;
+  cfg.read_size = 1;
+  cfg.prog_size = 512;
+  cfg.block_size = 512;
+  cfg.block_count = 256;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 512;
+  cfg.lookahead_size = 32;
+  lfs_rambd_create(&cfg, &bdcfg);
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_alloc_delete),
+      cmocka_unit_test(test_checksum),
+      cmocka_unit_test(test_migration),
+      cmocka_unit_test(test_compact),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_rambd_destroy(&cfg);
+
+  return ret;
+}
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "applets.h"
 #include "device.h"
+#include "fabrication.h"
 #include "ndef.h"
 #include "oath.h"
 #include "openpgp.h"
@@ -11,13 +12,33 @@
 #include <apdu.h>
 #include <assert.h>
 #include <bd/lfs_filebd.h>
+#include <bd/lfs_rambd.h>
 #include <ctap.h>
 #include <fs.h>
 #include <lfs.h>
+#include <stdio.h>
+
+#define CARD_BLOCK_SIZE 512
+#define CARD_BLOCK_COUNT 256
 
 static struct lfs_config cfg;
 static lfs_filebd_t bd;
-static struct lfs_filebd_config bdcfg = {.read_size = 1, .prog_size = 512, .erase_size = 512, .erase_count = 256};
+static struct lfs_filebd_config bdcfg = {
+    .read_size = 1, .prog_size = CARD_BLOCK_SIZE, .erase_size = CARD_BLOCK_SIZE, .erase_count = CARD_BLOCK_COUNT};
+static lfs_rambd_t ram_bd;
+static uint8_t ram_image[CARD_BLOCK_SIZE * CARD_BLOCK_COUNT];
+static struct lfs_rambd_config ram_bdcfg = {.read_size = 1,
+                                            .prog_size = CARD_BLOCK_SIZE,
+                                            .erase_size = CARD_BLOCK_SIZE,
+                                            .erase_count = CARD_BLOCK_COUNT,
+                                            .buffer = ram_image};
+static const char *ram_image_path;
+// the snapshot of ram_image, and the blocks changed since it was taken
+static uint8_t snapshot_image[sizeof(ram_image)];
+static uint8_t snapshot_dirty[CARD_BLOCK_COUNT / 8];
+static uint8_t snapshot_valid;
+// static buffers, so that mounting again does not leak
+static alignas(4) uint8_t read_buffer[LFS_CACHE_SIZE], prog_buffer[LFS_CACHE_SIZE], lookahead_buffer[32];
 
 uint8_t private_key[] = {0x46, 0x5b, 0x44, 0x5d, 0x8e, 0x78, 0x34, 0x53, 0xf7, 0x4b, 0x90,
                          0x00, 0xd2, 0x20, 0x32, 0x51, 0x99, 0x5e, 0x12, 0xdc, 0xd1, 0x21,
@@ -119,22 +140,95 @@ static void oath_init() {
   oath_process_apdu(capdu, rapdu);
 }
 
+static int load_image(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return 1;
+  size_t len = fread(ram_image, 1, sizeof(ram_image), fp);
+  fclose(fp);
+  if (len != sizeof(ram_image)) {
+    memset(ram_image, 0, sizeof(ram_image));
+    return 1;
+  }
+  return 0;
+}
+
+static void mark_dirty(lfs_block_t block) { snapshot_dirty[block / 8] |= 1 << (block % 8); }
+
+static int ram_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+  mark_dirty(block);
+  return lfs_rambd_prog(c, block, off, buffer, size);
+}
+
+static int ram_erase(const struct lfs_config *c, lfs_block_t block) {
+  mark_dirty(block);
+  return lfs_rambd_erase(c, block);
+}
+
+int card_snapshot_save(void) {
+  if (cfg.context != &ram_bd) return 1;
+  memcpy(snapshot_image, ram_image, sizeof(ram_image));
+  memset(snapshot_dirty, 0, sizeof(snapshot_dirty));
+  snapshot_valid = 1;
+  return 0;
+}
+
+int card_snapshot_restore(void) {
+  if (cfg.context != &ram_bd || !snapshot_valid) return 1;
+  for (lfs_block_t block = 0; block < CARD_BLOCK_COUNT; ++block) {
+    if (snapshot_dirty[block / 8] & (1 << (block % 8)))
+      memcpy(ram_image + block * CARD_BLOCK_SIZE, snapshot_image + block * CARD_BLOCK_SIZE, CARD_BLOCK_SIZE);
+  }
+  memset(snapshot_dirty, 0, sizeof(snapshot_dirty));
+  // drop the caches of littlefs and reload the states of applets
+  if (fs_mount(&cfg)) return 1;
+  applets_install();
+  return 0;
+}
+
+int card_fs_dump(const char *image) {
+  if (image == NULL) image = ram_image_path;
+  if (image == NULL || cfg.context != &ram_bd) return 1;
+  FILE *fp = fopen(image, "wb");
+  if (fp == NULL) return 1;
+  size_t len = fwrite(ram_image, 1, sizeof(ram_image), fp);
+  fclose(fp);
+  return len == sizeof(ram_image) ? 0 : 1;
+}
+
 int card_fs_init(const char *lfs_root) {
-  bd.cfg = &bdcfg;
   memset(&cfg, 0, sizeof(cfg));
-  cfg.context = &bd;
-  cfg.read = &lfs_filebd_read;
-  cfg.prog = &lfs_filebd_prog;
-  cfg.erase = &lfs_filebd_erase;
-  cfg.sync = &lfs_filebd_sync;
+  if (lfs_root == NULL || strncmp(lfs_root, CARD_RAM_PREFIX, strlen(CARD_RAM_PREFIX)) == 0) {
+    cfg.context = &ram_bd;
+    cfg.read = &lfs_rambd_read;
+    cfg.prog = &ram_prog;
+    cfg.erase = &ram_erase;
+    cfg.sync = &lfs_rambd_sync;
+  } else {
+    bd.cfg = &bdcfg;
+    cfg.context = &bd;
+    cfg.read = &lfs_filebd_read;
+    cfg.prog = &lfs_filebd_prog;
+    cfg.erase = &lfs_filebd_erase;
+    cfg.sync = &lfs_filebd_sync;
+  }
   cfg.read_size = 1;
-  cfg.prog_size = 512;
-  cfg.block_size = 512;
-  cfg.block_count = 256;
+  cfg.prog_size = CARD_BLOCK_SIZE;
+  cfg.block_size = CARD_BLOCK_SIZE;
+  cfg.block_count = CARD_BLOCK_COUNT;
   cfg.block_cycles = 50000;
-  cfg.cache_size = 512;
-  cfg.lookahead_size = 32;
-  if (lfs_filebd_create(&cfg, lfs_root, &bdcfg)) return 1;
+  cfg.cache_size = LFS_CACHE_SIZE;
+  cfg.lookahead_size = sizeof(lookahead_buffer);
+  cfg.read_buffer = read_buffer;
+  cfg.prog_buffer = prog_buffer;
+  cfg.lookahead_buffer = lookahead_buffer;
+  if (cfg.context == &ram_bd) {
+    if (lfs_rambd_create(&cfg, &ram_bdcfg)) return 1;
+    snapshot_valid = 0;
+    ram_image_path = lfs_root == NULL || lfs_root[strlen(CARD_RAM_PREFIX)] == '\0' ? NULL : lfs_root + strlen(CARD_RAM_PREFIX);
+    if (ram_image_path != NULL) load_image(ram_image_path); // start from a blank device if it fails
+  } else {
+    if (lfs_filebd_create(&cfg, lfs_root, &bdcfg)) return 1;
+  }
 
   int err = fs_mount(&cfg);
   if (err) { // should happen for the first boot
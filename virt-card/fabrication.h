@@ -1,5 +1,31 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 #pragma once
 
+// Use a RAM block device, optionally loaded from the image file after the prefix, e.g. "ram:/tmp/lfs-image"
+#define CARD_RAM_PREFIX "ram:"
+
+/**
+ * Mount the file system and personalize the card from scratch.
+ *
+ * @param lfs_root The file backing the block device, NULL or "ram:[image]" for a RAM block device.
+ */
 int card_fabrication_procedure(const char *lfs_root);
 int card_read(const char * lfs_root);
+
+/**
+ * Write the RAM block device to an image file, which can be loaded by "ram:<image>" later.
+ *
+ * @param image The image file, or NULL for the one the device was loaded from.
+ */
+int card_fs_dump(const char *image);
+
+/**
+ * Take a snapshot of the RAM block device, e.g. right after card_fabrication_procedure.
+ */
+int card_snapshot_save(void);
+
+/**
+ * Roll the RAM block device back to the snapshot, then remount it and reload the applets.
+ * Only the blocks written since the snapshot are copied.
+ */
+int card_snapshot_restore(void);
@@ -107,6 +107,7 @@ static int current_fd;
 static uint8_t udp_send_current_fd(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
   // printf("udp_send_current_fd %hu\n", len);
   udp_send(current_fd, report, len);
+  CTAPHID_InEvent(); // sent at once
   return 0;
 }
 